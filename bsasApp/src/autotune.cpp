@@ -0,0 +1,89 @@
+
+#include <sstream>
+
+#include "autotune.h"
+
+AutoTuner::Config::Config()
+    :enable(false)
+    ,maxEventRate(10.0, 1000.0)
+    ,maxEventAge(0.5, 10.0)
+    ,flushPeriod(0.5, 10.0)
+    ,holdoff(30u)
+{}
+
+AutoTuner::AutoTuner(const Config& conf)
+    :conf(conf)
+    ,quiet_rate(0u)
+    ,quiet_age(0u)
+    ,quiet_flush(0u)
+{}
+
+Collector::Limits AutoTuner::initial() const
+{
+    Collector::Limits L;
+    L.maxEventRate = conf.maxEventRate.clip(L.maxEventRate);
+    L.maxEventAge = conf.maxEventAge.clip(L.maxEventAge);
+    L.flushPeriod = conf.flushPeriod.clip(L.flushPeriod);
+    return L;
+}
+
+namespace {
+size_t delta(size_t cur, size_t prev)
+{
+    return cur>=prev ? cur-prev : cur;
+}
+} // namespace
+
+bool AutoTuner::step(const Sample& totals, Collector::Limits& L, std::string& reason)
+{
+    const size_t overflow = delta(totals.nOverflow, prev.nOverflow),
+                 late = delta(totals.nLate, prev.nLate),
+                 aged = delta(totals.nAged, prev.nAged);
+    prev = totals;
+
+    const Collector::Limits orig(L);
+    std::ostringstream msg;
+
+    // events buffer size
+    if(overflow) {
+        L.maxEventRate = conf.maxEventRate.clip(L.maxEventRate*1.5);
+        quiet_rate = 0u;
+        msg<<overflow<<" overflow. ";
+
+    } else if(++quiet_rate >= conf.holdoff) {
+        L.maxEventRate = conf.maxEventRate.clip(L.maxEventRate*0.9);
+        quiet_rate = 0u;
+    }
+
+    // partial event timeout
+    if(late) {
+        L.maxEventAge = conf.maxEventAge.clip(L.maxEventAge*1.25);
+        quiet_age = 0u;
+        msg<<late<<" late. ";
+
+    } else if(aged && ++quiet_age >= conf.holdoff) {
+        // waiting longer would not have completed these
+        L.maxEventAge = conf.maxEventAge.clip(L.maxEventAge*0.9);
+        quiet_age = 0u;
+    }
+
+    // delivery holdoff
+    if(totals.deliverTime > 0.5*L.flushPeriod) {
+        L.flushPeriod = conf.flushPeriod.clip(L.flushPeriod*1.25);
+        quiet_flush = 0u;
+        msg<<"slow delivery "<<totals.deliverTime<<" s. ";
+
+    } else if(totals.deliverTime < 0.1*L.flushPeriod && ++quiet_flush >= conf.holdoff) {
+        L.flushPeriod = conf.flushPeriod.clip(L.flushPeriod*0.9);
+        quiet_flush = 0u;
+    }
+
+    if(L.maxEventRate==orig.maxEventRate && L.maxEventAge==orig.maxEventAge && L.flushPeriod==orig.flushPeriod)
+        return false;
+
+    if(msg.str().empty())
+        msg<<"quiet. ";
+    msg<<"maxEventRate="<<L.maxEventRate<<" maxEventAge="<<L.maxEventAge<<" flushPeriod="<<L.flushPeriod;
+    reason = msg.str();
+    return true;
+}
@@ -0,0 +1,53 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+
+#include "collector.h"
+
+/* Adjusts the Collector::Limits of one table, within operator set bounds.
+ *
+ * - Overflow of the events buffer raises maxEventRate.  Lowered again after a quiet period.
+ * - Updates arriving after their slice was flushed raise maxEventAge.
+ *   Slices aged out incomplete, with nothing late, lower it.
+ * - Receivers which take a large fraction of flushPeriod raise it.  A small fraction lowers it.
+ */
+struct AutoTuner {
+    struct Bounds {
+        double min, max;
+        Bounds(double min, double max) :min(min), max(max) {}
+        double clip(double v) const { return v<min ? min : v>max ? max : v; }
+    };
+
+    struct Config {
+        bool enable;
+        Bounds maxEventRate, maxEventAge, flushPeriod;
+        // # of consecutive quiet step()s before lowering a limit
+        unsigned holdoff;
+        Config();
+    };
+
+    // Collector counters.  Totals, not deltas
+    struct Sample {
+        size_t nOverflow, nLate, nAged;
+        double deliverTime; // longest delivery since previous sample (seconds)
+        Sample() :nOverflow(0u), nLate(0u), nAged(0u), deliverTime(0.0) {}
+    };
+
+    explicit AutoTuner(const Config& conf);
+
+    const Config conf;
+
+    // initial limits, clipped to bounds
+    Collector::Limits initial() const;
+
+    // Called periodically.  Returns true if L is changed, with a description in 'reason'.
+    // A decrease in totals (new Collector) is treated as a reset.
+    bool step(const Sample& totals, Collector::Limits& L, std::string& reason);
+
+private:
+    Sample prev;
+    unsigned quiet_rate, quiet_age, quiet_flush;
+};
+
+#endif // AUTOTUNE_H
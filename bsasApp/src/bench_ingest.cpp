@@ -0,0 +1,144 @@
+/* Cost of CA ingestion, with preemptive callbacks or a polled context.
+ *
+ *   bench_ingest [-t seconds] [-P poll period] <format> [#PVs ...]
+ *
+ * PV names are made from a printf() format of the index (eg. 'BENCH:%zu').  For each #PVs,
+ * a Collector subscribes with each mode in turn.  Once all have connected (or 10 seconds),
+ * counters are sampled over 'seconds' (default 10).
+ *
+ * Reports updates/sec, notEmpty() per 1000 updates, processor wakeups/sec,
+ * time in CA callbacks per update, and process CPU time (all threads) per update.
+ *
+ * Default is 1000 PVs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+#include <string>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <pv/sharedVector.h>
+
+#include "collector.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+// Receivers are part of the cost.  Count, and drop.
+struct NullReceiver : public Receiver
+{
+    virtual ~NullReceiver() {}
+    virtual void names(const std::vector<std::string>& n) {}
+    virtual void slices(const slices_t& s) {}
+};
+
+struct Sample {
+    size_t updates, notify, wakeups, callbacks, callbackUs;
+    clock_t cpu;
+    epicsUInt64 mono;
+
+    Sample(const CAContext& ctxt, Collector& collect)
+        :updates(0u), callbacks(0u), callbackUs(0u)
+    {
+        for(size_t i=0, N=collect.pvs.size(); i<N; i++)
+            updates += epicsAtomicGetSizeT(&collect.subscription(i)->counters.nUpdates);
+        for(size_t i=0, N=ctxt.nshards(); i<N; i++) {
+            callbacks += epicsAtomicGetSizeT(&ctxt.shard(i).nCallbacks);
+            callbackUs += epicsAtomicGetSizeT(&ctxt.shard(i).callbackUs);
+        }
+        notify = epicsAtomicGetSizeT(&collect.nNotify);
+        {
+            Guard G(collect.mutex);
+            wakeups = size_t(collect.wake_latency.count);
+        }
+        cpu = clock();
+        mono = epicsMonotonicGet();
+    }
+};
+
+void run(const char *format, double duration, bool polled, size_t npvs)
+{
+    pvd::shared_vector<std::string> names(npvs);
+    for(size_t i=0; i<npvs; i++) {
+        char buf[128];
+        epicsSnprintf(buf, sizeof(buf), format, i);
+        names[i] = buf;
+    }
+
+    CAContext ctxt(epicsThreadPriorityMedium, false, 0, polled);
+    Collector collect(ctxt, pvd::freeze(names), epicsThreadPriorityMedium);
+
+    NullReceiver R;
+    collect.add_receiver(&R);
+
+    size_t nconn = 0u;
+    for(unsigned n=0; n<1000u && nconn<npvs; n++) {
+        epicsThreadSleep(0.01);
+        nconn = 0u;
+        for(size_t i=0; i<npvs; i++)
+            nconn += epicsAtomicGetIntT(&collect.subscription(i)->connected)!=0;
+    }
+
+    const Sample before(ctxt, collect);
+    epicsThreadSleep(duration);
+    const Sample after(ctxt, collect);
+
+    collect.remove_receiver(&R);
+
+    const double secs = (after.mono - before.mono)*1e-9;
+    const size_t updates = after.updates - before.updates,
+                 callbacks = after.callbacks - before.callbacks;
+    const double per = updates ? 1.0/updates : 0.0;
+
+    printf("%7zu  %-10s  %7zu  %10.1f  %10.1f  %10.1f  %10.2f  %10.2f\n",
+           npvs, polled ? "polled" : "preemptive", nconn,
+           updates/secs,
+           (after.notify - before.notify)*1e3*per,
+           (after.wakeups - before.wakeups)/secs,
+           callbacks ? double(after.callbackUs - before.callbackUs)/callbacks : 0.0,
+           double(after.cpu - before.cpu)/CLOCKS_PER_SEC*1e6*per);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const char *format = 0;
+    double duration = 10.0;
+    std::vector<size_t> npvs;
+
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "-t")==0 && i+1<argc) {
+            duration = strtod(argv[++i], 0);
+        } else if(strcmp(argv[i], "-P")==0 && i+1<argc) {
+            collectorCaPollPeriod = strtod(argv[++i], 0);
+        } else if(!format) {
+            format = argv[i];
+        } else {
+            npvs.push_back(strtoul(argv[i], 0, 0));
+        }
+    }
+    if(!format) {
+        fprintf(stderr, "Usage: %s [-t seconds] [-P poll period] <format> [#PVs ...]\n", argv[0]);
+        return 1;
+    }
+    if(npvs.empty())
+        npvs.push_back(1000u);
+
+    printf("# sampled over %.1f s.  poll period %.3f s\n", duration, collectorCaPollPeriod);
+    printf("#   #PV  mode        #conn    updates/s  notify/1k   wakeups/s  cb-us/upd  cpu-us/upd\n");
+
+    for(size_t n=0; n<npvs.size(); n++) {
+        run(format, duration, false, npvs[n]);
+        run(format, duration, true, npvs[n]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* Compare slice assembly with a std::map event index (as previously done by Collector)
+ * against the k-way Merger.
+ *
+ *   bench_merge [#events [#columns ...]]
+ *
+ * Default is 240 events (2 seconds at 120Hz) for 1000 and 10000 columns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <vector>
+
+#include <epicsTime.h>
+#include <pv/sharedVector.h>
+
+#include "merger.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+typedef std::vector<DBRValue> slice_t;
+typedef std::vector<std::pair<epicsUInt64, slice_t> > slices_t;
+typedef std::vector<std::vector<DBRValue> > input_t; // [column][event]
+
+void generate(input_t& input, size_t ncols, size_t nevents)
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    input.clear();
+    input.resize(ncols);
+
+    for(size_t c=0; c<ncols; c++) {
+        input[c].reserve(nevents);
+
+        epicsTimeStamp ts(now);
+        for(size_t e=0; e<nevents; e++) {
+            epicsTimeAddSeconds(&ts, 1.0/120);
+
+            if((e*7u + c*13u)%100u==0u)
+                continue; // 1% of updates missing
+
+            DBRValue val(DBRValue::alloc(0, pvd::pvDouble, 1u));
+            val->ts = ts;
+            val->sevr = val->stat = 0;
+            *static_cast<double*>(val->data()) = double(e);
+            input[c].push_back(val);
+        }
+    }
+}
+
+epicsUInt64 keyof(const DBRValue& val)
+{
+    epicsUInt64 key = val->ts.secPastEpoch;
+    key <<= 32;
+    key |= val->ts.nsec;
+    return key;
+}
+
+// as Collector::process_dequeue() and process_test() did with std::map
+double run_map(input_t& input, slices_t& out)
+{
+    typedef std::map<epicsUInt64, slice_t> events_t;
+    events_t events;
+
+    epicsTimeStamp start, end;
+    epicsTimeGetCurrent(&start);
+
+    const size_t ncols = input.size();
+    std::vector<size_t> pos(ncols, 0u);
+
+    // round robin, one value per column per pass
+    bool nothing = false;
+    while(!nothing) {
+        nothing = true;
+        for(size_t c=0; c<ncols; c++) {
+            if(pos[c]==input[c].size())
+                continue;
+            nothing = false;
+
+            DBRValue& val = input[c][pos[c]++];
+
+            slice_t& slice = events[keyof(val)];
+            slice.resize(ncols);
+            slice[c].swap(val);
+        }
+    }
+
+    out.reserve(events.size());
+    for(events_t::iterator it(events.begin()), end(events.end()); it!=end;) {
+        events_t::iterator cur = it++;
+        out.push_back(*cur);
+        events.erase(cur);
+    }
+
+    epicsTimeGetCurrent(&end);
+    return epicsTimeDiffInSeconds(&end, &start);
+}
+
+double run_merge(input_t& input, slices_t& out)
+{
+    const size_t ncols = input.size();
+    Merger merger(ncols);
+
+    // as Collector, output slices are taken from a pre-allocated arena
+    size_t nslices = 0u;
+    for(size_t c=0; c<ncols; c++)
+        nslices = std::max(nslices, input[c].size());
+    nslices += nslices/10u;
+    out.resize(nslices);
+    for(size_t i=0; i<nslices; i++)
+        out[i].second.resize(ncols);
+
+    epicsTimeStamp start, end;
+    epicsTimeGetCurrent(&start);
+
+    for(size_t c=0; c<ncols; c++) {
+        for(size_t e=0, E=input[c].size(); e<E; e++) {
+            DBRValue& val = input[c][e];
+            merger.push(c, keyof(val), val);
+        }
+    }
+
+    size_t n = 0u;
+    while(!merger.empty()) {
+        if(n==out.size()) {
+            out.resize(n+1u);
+            out[n].second.resize(ncols);
+        }
+        out[n].first = merger.pop(&out[n].second);
+        n++;
+    }
+
+    epicsTimeGetCurrent(&end);
+    out.resize(n);
+    return epicsTimeDiffInSeconds(&end, &start);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t nevents = 240u;
+    std::vector<size_t> ncolumns;
+
+    if(argc>1)
+        nevents = strtoul(argv[1], 0, 0);
+    for(int i=2; i<argc; i++)
+        ncolumns.push_back(strtoul(argv[i], 0, 0));
+    if(ncolumns.empty()) {
+        ncolumns.push_back(1000u);
+        ncolumns.push_back(10000u);
+    }
+
+    printf("# columns  events  slices  map(ms)  merge(ms)  speedup\n");
+
+    for(size_t i=0; i<ncolumns.size(); i++) {
+        input_t input;
+        generate(input, ncolumns[i], nevents);
+
+        double tmap, tmerge;
+        size_t nmap, nmerge;
+        {
+            input_t work(input);
+            slices_t out;
+            tmap = run_map(work, out);
+            nmap = out.size();
+        }
+        {
+            input_t work(input);
+            slices_t out;
+            tmerge = run_merge(work, out);
+            nmerge = out.size();
+        }
+
+        if(nmap!=nmerge) {
+            fprintf(stderr, "Error: map assembled %zu slices, merge %zu\n", nmap, nmerge);
+            return 1;
+        }
+
+        printf("%9zu  %6zu  %6zu  %7.1f  %9.1f  %7.2f\n",
+               ncolumns[i], nevents, nmerge,
+               tmap*1e3, tmerge*1e3, tmerge>0.0 ? tmap/tmerge : 0.0);
+    }
+
+    return 0;
+}
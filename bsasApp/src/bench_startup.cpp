@@ -0,0 +1,177 @@
+/* Time from creating a Collector of N PVs until its first complete slice is delivered.
+ *
+ *   bench_startup [#PVs ...]
+ *   bench_startup -p <format> [-t timeout] [#PVs ...]
+ *
+ * Without -p, a fake CA context is used.  Each PV "connects" with one update, all with the same timestamp.
+ * This measures channel bookkeeping, and the first pass of the Collector.
+ *
+ * With -p, PV names are made from a printf() format of the index (eg. 'BENCH:%zu'), using real CA.
+ * Also reports time until 50%, 90%, and all channels have connected.  Gives up after timeout seconds (default 60).
+ *
+ * Default is 1000, 10000, and 50000 PVs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <epicsMath.h>
+#include <pv/sharedVector.h>
+
+#include "collector.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+struct BenchReceiver : public Receiver
+{
+    epicsMutex mutex;
+    epicsEvent done;
+    epicsUInt64 start;
+    // ms from start.  NaN until seen
+    double first, complete;
+    size_t first_fill;
+
+    explicit BenchReceiver(epicsUInt64 start) :start(start), first(epicsNAN), complete(epicsNAN), first_fill(0u) {}
+    virtual ~BenchReceiver() {}
+
+    virtual void names(const std::vector<std::string>& n) {}
+    virtual void slices(const slices_t& s) {
+        const double now = (epicsMonotonicGet() - start)*1e-6;
+        Guard G(mutex);
+        for(size_t r=0, R=s.size(); r<R; r++) {
+            size_t nvalid = 0u;
+            for(size_t c=0, C=s[r].second.size(); c<C; c++)
+                nvalid += s[r].second[c].valid() && s[r].second[c]->sevr<=3;
+
+            if(isnan(first)) {
+                first = now;
+                first_fill = nvalid;
+            }
+            if(nvalid==s[r].second.size()) {
+                complete = now;
+                done.signal();
+                break;
+            }
+        }
+    }
+};
+
+double since(epicsUInt64 start)
+{
+    return (epicsMonotonicGet() - start)*1e-6;
+}
+
+void run(const char *format, double timeout, size_t npvs)
+{
+    pvd::shared_vector<std::string> names(npvs);
+    for(size_t i=0; i<npvs; i++) {
+        char buf[128];
+        if(format)
+            epicsSnprintf(buf, sizeof(buf), format, i);
+        else
+            epicsSnprintf(buf, sizeof(buf), "bench:%zu", i);
+        names[i] = buf;
+    }
+
+    CAContext ctxt(epicsThreadPriorityMedium, !format);
+
+    const epicsUInt64 start = epicsMonotonicGet();
+
+    Collector collect(ctxt, pvd::freeze(names), epicsThreadPriorityMedium);
+    const double created = since(start);
+
+    BenchReceiver R(start);
+    collect.add_receiver(&R);
+
+    double connect[3] = {epicsNAN, epicsNAN, epicsNAN};
+
+    if(!format) {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+
+        {
+            // all queued and ready before the next pass
+            Guard G(collect.mutex);
+            for(size_t i=0; i<npvs; i++) {
+                DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 1u));
+                value->ts = now;
+                value->sevr = value->stat = 0;
+                *static_cast<double*>(value->data()) = double(i);
+                collect.subscription(i)->push(value);
+                collect.notEmpty(collect.subscription(i));
+            }
+        }
+
+        connect[0] = connect[1] = connect[2] = since(start);
+
+    } else {
+        const unsigned percent[3] = {50u, 90u, 100u};
+        while(since(start) < timeout*1e3 && isnan(connect[2])) {
+            size_t nconn = 0u;
+            for(size_t i=0; i<npvs; i++)
+                nconn += epicsAtomicGetIntT(&collect.subscription(i)->connected)!=0;
+
+            for(unsigned p=0; p<3u; p++) {
+                if(isnan(connect[p]) && nconn*100u >= npvs*percent[p])
+                    connect[p] = since(start);
+            }
+            epicsThreadSleep(0.01);
+        }
+    }
+
+    while(since(start) < timeout*1e3) {
+        {
+            Guard G(R.mutex);
+            if(!isnan(R.complete))
+                break;
+        }
+        R.done.wait(0.1);
+    }
+
+    collect.remove_receiver(&R);
+
+    Guard G(R.mutex);
+    printf("%7zu  %10.1f  %10.1f  %10.1f  %10.1f  %10.1f  %7zu  %11.1f\n",
+           npvs, created, connect[0], connect[1], connect[2], R.first, R.first_fill, R.complete);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const char *format = 0;
+    double timeout = 60.0;
+    std::vector<size_t> npvs;
+
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "-p")==0 && i+1<argc) {
+            format = argv[++i];
+        } else if(strcmp(argv[i], "-t")==0 && i+1<argc) {
+            timeout = strtod(argv[++i], 0);
+        } else {
+            npvs.push_back(strtoul(argv[i], 0, 0));
+        }
+    }
+    if(npvs.empty()) {
+        npvs.push_back(1000u);
+        npvs.push_back(10000u);
+        npvs.push_back(50000u);
+    }
+
+    printf("# times in ms from creating the Collector.  NaN if not reached\n");
+    printf("#   #PV     created   50%%-conn   90%%-conn  100%%-conn  1st-slice  1st-fill  1st-complete\n");
+
+    for(size_t n=0; n<npvs.size(); n++)
+        run(format, timeout, npvs[n]);
+
+    return 0;
+}
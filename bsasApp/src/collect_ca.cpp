@@ -1,17 +1,23 @@
 
 #include <string.h>
 
+#include <new>
+#include <map>
+#include <deque>
 #include <stdexcept>
 #include <sstream>
 
 #include <errlog.h>
 #include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
 #include <db_access.h>
 #include <cadef.h>
 #include <pv/reftrack.h>
 
 #include "collector.h"
 #include "collect_ca.h"
+#include "realtime.h"
 
 #include <epicsExport.h>
 
@@ -21,6 +27,15 @@ int collectorCaDebug;
 
 double collectorCaScalarMaxRate = 140.0;
 double collectorCaArrayMaxRate = 1.5;
+// resize queues from measured update rates
+int collectorCaAdaptive = 1;
+// adaptive queue holds collectorCaHeadroom * bsasFlushPeriod of updates
+double collectorCaHeadroom = 2.0;
+// upper bound on adaptive queue length
+int collectorCaMaxQueue = 10000;
+// searches for a large table begin while the rest of its channels are created
+int collectorCaConnectBatch = 256;
+double collectorCaPollPeriod = 0.01;
 
 namespace {
 
@@ -40,6 +55,49 @@ struct eca_error : public std::runtime_error
     }
 };
 
+pvd::ScalarType scalarTypeOf(long dbr_time_type)
+{
+    switch(dbr_time_type) {
+    case DBR_TIME_STRING: return pvd::pvString;
+    case DBR_TIME_SHORT:  return pvd::pvShort;
+    case DBR_TIME_FLOAT:  return pvd::pvFloat;
+    case DBR_TIME_ENUM:   return pvd::pvShort;
+    case DBR_TIME_CHAR:   return pvd::pvByte;
+    case DBR_TIME_LONG:   return pvd::pvInt;
+    case DBR_TIME_DOUBLE: return pvd::pvDouble;
+    default:
+        // treat any unknown as byte array
+        return pvd::pvByte;
+    }
+}
+
+// deleter for shared_vector aliasing Holder storage
+struct HolderRef {
+    DBRValue ref;
+    explicit HolderRef(const DBRValue& ref) :ref(ref) {}
+    void operator()(const void*) { ref.reset(); }
+};
+
+template<typename T>
+pvd::shared_vector<const void> aliasHolder(const DBRValue& ref, const void *data, size_t count)
+{
+    pvd::shared_vector<const T> typed(static_cast<const T*>(data), HolderRef(ref), 0, count);
+    return pvd::static_shared_vector_cast<const void>(typed);
+}
+
+// account time of a Channel callback to its context
+struct CallbackLoad {
+    const CAContext& context;
+    const epicsUInt64 start;
+    explicit CallbackLoad(const CAContext& context) :context(context), start(epicsMonotonicGet()) {
+        RealTime::applyOnce(context.rt, RealTime::name(RealTime::CA));
+    }
+    ~CallbackLoad() {
+        epicsAtomicIncrSizeT(&context.nCallbacks);
+        epicsAtomicAddSizeT(&context.callbackUs, size_t((epicsMonotonicGet() - start)/1000u));
+    }
+};
+
 void onError(exception_handler_args args)
 {
     errlogPrintf("Collector CA exception on %s : %s on %s:%u\n%s",
@@ -54,6 +112,11 @@ size_t DBRValue::Holder::num_instances;
 
 DBRValue::Holder::Holder()
     :sevr(4), stat(LINK_ALARM), count(1u)
+    ,type(pvd::pvDouble)
+    ,refs(1)
+    ,size_class(0u)
+    ,pool(0)
+    ,account(0)
 {
     REFTRACE_INCREMENT(num_instances);
     ts.secPastEpoch = 0;
@@ -65,14 +128,395 @@ DBRValue::Holder::~Holder()
     REFTRACE_DECREMENT(num_instances);
 }
 
+pvd::shared_vector<const void> DBRValue::Holder::buffer() const
+{
+    epicsAtomicIncrIntT(&const_cast<Holder*>(this)->refs);
+    DBRValue self(const_cast<Holder*>(this));
+
+    switch(type) {
+    case pvd::pvByte:   return aliasHolder<pvd::int8>(self, data(), count);
+    case pvd::pvUByte:  return aliasHolder<pvd::uint8>(self, data(), count);
+    case pvd::pvShort:  return aliasHolder<pvd::int16>(self, data(), count);
+    case pvd::pvUShort: return aliasHolder<pvd::uint16>(self, data(), count);
+    case pvd::pvInt:    return aliasHolder<pvd::int32>(self, data(), count);
+    case pvd::pvUInt:   return aliasHolder<pvd::uint32>(self, data(), count);
+    case pvd::pvLong:   return aliasHolder<pvd::int64>(self, data(), count);
+    case pvd::pvULong:  return aliasHolder<pvd::uint64>(self, data(), count);
+    case pvd::pvFloat:  return aliasHolder<float>(self, data(), count);
+    case pvd::pvDouble: return aliasHolder<double>(self, data(), count);
+    default:
+        throw std::logic_error("DBRValue holds unsupported type");
+    }
+}
+
+size_t DBRValue::Pool::num_instances;
+size_t DBRValue::Pool::num_hits;
+size_t DBRValue::Pool::num_misses;
+
+DBRValue::Pool::Pool()
+    :depth(16u)
+    ,inuse(0u)
+    ,refs(1)
+    ,ncached(0u)
+    ,current(0)
+{
+    REFTRACE_INCREMENT(num_instances);
+    for(unsigned i=0; i<nClasses; i++) {
+        local[i] = 0;
+        returned[i] = 0;
+    }
+}
+
+DBRValue::Pool::~Pool()
+{
+    REFTRACE_DECREMENT(num_instances);
+    for(unsigned i=0; i<nClasses; i++) {
+        for(unsigned pass=0; pass<2; pass++) {
+            Free *F = pass==0 ? local[i] : static_cast<Free*>(returned[i]);
+            while(F) {
+                Free *next = F->next;
+                ::operator delete(F);
+                F = next;
+            }
+        }
+    }
+}
+
+void DBRValue::Pool::close()
+{
+    unref();
+}
+
+void DBRValue::Pool::unref()
+{
+    if(epicsAtomicDecrIntT(&refs)==0)
+        delete this;
+}
+
+// on allocating thread
+void* DBRValue::Pool::take(unsigned cls)
+{
+    Free *F = local[cls];
+    if(!F) {
+        // take everything released since last time
+        EpicsAtomicPtrT head;
+        do {
+            head = epicsAtomicGetPtrT(&returned[cls]);
+        } while(head && epicsAtomicCmpAndSwapPtrT(&returned[cls], head, 0)!=head);
+        F = static_cast<Free*>(head);
+    }
+    if(F) {
+        local[cls] = F->next;
+        epicsAtomicDecrSizeT(&ncached);
+    }
+    return F;
+}
+
+// on allocating thread
+void DBRValue::Pool::prefill(size_t bytes)
+{
+    const unsigned cls = size_class(bytes);
+    if(cls >= nClasses)
+        return;
+
+    const size_t total = sizeof(Holder) + (size_t(8u)<<cls);
+    while(epicsAtomicGetSizeT(&ncached) < depth) {
+        void *raw = ::operator new(total);
+        memset(raw, 0, total); // fault in
+
+        Free *F = static_cast<Free*>(raw);
+        F->next = local[cls];
+        local[cls] = F;
+        epicsAtomicIncrSizeT(&ncached);
+    }
+}
+
+// on any thread
+void DBRValue::Pool::give(unsigned cls, void *raw)
+{
+    if(epicsAtomicGetSizeT(&ncached) >= depth) {
+        ::operator delete(raw);
+        return;
+    }
+    epicsAtomicIncrSizeT(&ncached);
+
+    Free *F = static_cast<Free*>(raw);
+    EpicsAtomicPtrT head;
+    do {
+        head = epicsAtomicGetPtrT(&returned[cls]);
+        F->next = static_cast<Free*>(head);
+    } while(epicsAtomicCmpAndSwapPtrT(&returned[cls], head, F)!=head);
+}
+
+void DBRValue::Pool::setAccount(const std::tr1::shared_ptr<MemAccount>& acct)
+{
+    if(acct.get()==account())
+        return;
+    if(acct && std::find(accounts.begin(), accounts.end(), acct)==accounts.end())
+        accounts.push_back(acct);
+    epicsAtomicSetPtrT(&current, acct.get());
+}
+
+// on any thread.  Returns the account charged
+MemAccount* DBRValue::Pool::charge(size_t n)
+{
+    epicsAtomicAddSizeT(&inuse, n);
+    MemAccount *acct = account();
+    if(acct)
+        acct->add(n);
+    return acct;
+}
+
+// on any thread
+void DBRValue::Pool::credit(size_t n, MemAccount *acct)
+{
+    epicsAtomicSubSizeT(&inuse, n);
+    if(acct)
+        acct->sub(n);
+}
+
+DBRValue DBRValue::alloc(Pool *pool, pvd::ScalarType type, size_t count, bool take)
+{
+    const size_t bytes = count*pvd::ScalarTypeFunc::elementSize(type);
+    const unsigned cls = Pool::size_class(bytes);
+    const bool cached = pool && cls < Pool::nClasses; // otherwise too large to cache
+
+    void *raw = 0;
+    if(cached && take) {
+        raw = pool->take(cls);
+        epicsAtomicIncrSizeT(raw ? &Pool::num_hits : &Pool::num_misses);
+    }
+    const size_t total = sizeof(Holder) + (cached ? size_t(8u)<<cls : bytes);
+    if(!raw)
+        raw = ::operator new(total);
+    MemAccount *acct = pool ? pool->charge(total) : 0;
+
+    Holder *H = new (raw) Holder;
+    H->type = type;
+    H->count = count;
+    H->size_class = cls;
+    H->pool = pool;
+    H->account = acct;
+    if(pool)
+        epicsAtomicIncrIntT(&pool->refs);
+
+    return DBRValue(H);
+}
+
+void DBRValue::release(Holder *H)
+{
+    Pool *pool = H->pool;
+    MemAccount *acct = H->account;
+    const unsigned cls = H->size_class;
+    const bool cached = pool && cls < Pool::nClasses;
+    const size_t total = sizeof(Holder) + (cached ? size_t(8u)<<cls : H->count*pvd::ScalarTypeFunc::elementSize(H->type));
+
+    H->~Holder();
+
+    if(cached) {
+        pool->give(cls, H);
+    } else {
+        ::operator delete(H);
+    }
+    if(pool) {
+        pool->credit(total, acct);
+        pool->unref(); // after give() as may free
+    }
+}
+
+namespace {
+// order Subscriptions by Collector, then column
+struct byCollector {
+    bool operator()(const Subscription* lhs, const Subscription* rhs) const {
+        return &lhs->collector < &rhs->collector
+                || (&lhs->collector == &rhs->collector && lhs->column < rhs->column);
+    }
+};
+} // namespace
+
+struct CAContext::Ingest {
+    enum Op {Create, Clear, Sync, Push};
+    struct Request {
+        Op op;
+        Channel *channel; // NULL for Sync
+        epicsEvent *done; // signaled when complete.  NULL for Create and Push
+        DBRValue value; // for Push
+    };
+
+    CAContext& owner;
+
+    epicsMutex mutex;
+    // new requests, or stop
+    epicsEvent wakeup;
+    // context created, or failed
+    epicsEvent started;
+
+    // guarded by mutex
+    std::deque<Request> requests;
+    bool running;
+    int status; // of context creation
+
+    // only on ingest thread.  Subscriptions disarmed by fanout() during the current ca_poll()
+    std::vector<Subscription*> deferred;
+
+    epics::auto_ptr<pvd::Thread> worker;
+
+    Ingest(CAContext& owner, unsigned int prio)
+        :owner(owner)
+        ,running(true)
+        ,status(ECA_NORMAL)
+        ,worker(new pvd::Thread(pvd::Thread::Config(this, &Ingest::run)
+                                .name("BSA CA Ingest")
+                                .prio(prio)
+                                .autostart(false)))
+    {
+        worker->start();
+        started.wait();
+        if(status!=ECA_NORMAL) {
+            worker->exitWait();
+            eca_error::check(status, "Create context");
+        }
+    }
+
+    ~Ingest()
+    {
+        {
+            Guard G(mutex);
+            running = false;
+        }
+        wakeup.signal();
+        worker->exitWait();
+    }
+
+    // Create and Push are queued until the next pass.  Others wait for completion.
+    void request(Op op, Channel *channel, const DBRValue& value = DBRValue())
+    {
+        const bool queued = op==Create || op==Push;
+        epicsEvent done;
+        Request req = {op, channel, queued ? 0 : &done, value};
+        {
+            Guard G(mutex);
+            if(op==Clear) {
+                // never created?
+                bool created = true;
+                for(std::deque<Request>::iterator it(requests.begin()); it!=requests.end(); ) {
+                    if(it->channel==channel && (it->op==Create || it->op==Push)) {
+                        created &= it->op!=Create;
+                        it = requests.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                if(!created)
+                    return;
+            }
+            requests.push_back(req);
+        }
+        if(!queued) {
+            wakeup.signal();
+            done.wait();
+        }
+    }
+
+    void run()
+    {
+        // so that CallbackLoad doesn't apply again
+        RealTime::applyOnce(owner.rt, RealTime::name(RealTime::CA));
+
+        // callbacks only from ca_poll() on this thread
+        int err = ca_context_create(ca_disable_preemptive_callback);
+        if(err==ECA_NORMAL)
+            err = ca_add_exception_event(&onError, 0);
+        if(err!=ECA_NORMAL && ca_current_context())
+            ca_context_destroy();
+        {
+            Guard G(mutex);
+            status = err;
+            owner.context = err==ECA_NORMAL ? ca_current_context() : 0;
+        }
+        started.signal();
+        if(err!=ECA_NORMAL)
+            return;
+
+        std::deque<Request> todo;
+        Guard G(mutex);
+        while(running) {
+            todo.swap(requests);
+            UnGuard U(G);
+
+            for(size_t i=0, N=todo.size(); i<N; i++) {
+                const Request& req = todo[i];
+                if(req.op==Create) {
+                    try {
+                        req.channel->create();
+                    } catch(std::exception& e) {
+                        errlogPrintf("%s : %s\n", req.channel->pvname.c_str(), e.what());
+                    }
+                } else if(req.op==Clear) {
+                    req.channel->clear();
+                } else if(req.op==Push) {
+                    Guard C(req.channel->mutex);
+                    req.channel->latest = req.value;
+                    req.channel->fanout(req.value, 0);
+                }
+                // Sync is complete since handoff() of the previous pass
+                if(req.done)
+                    req.done->signal();
+            }
+            todo.clear();
+
+            // run all pending callbacks.  Also sends requests queued by create()
+            ca_poll();
+            handoff();
+
+            wakeup.wait(collectorCaPollPeriod);
+        }
+        UnGuard U(G);
+
+        ca_context_destroy();
+        owner.context = 0;
+    }
+
+    // one notEmpty() for each Collector with updates from this pass
+    void handoff()
+    {
+        if(deferred.empty())
+            return;
+
+        std::sort(deferred.begin(), deferred.end(), byCollector());
+
+        for(size_t begin=0u, N=deferred.size(); begin<N; ) {
+            Collector& collector = deferred[begin]->collector;
+            size_t end = begin+1u;
+            while(end<N && &deferred[end]->collector==&collector)
+                end++;
+            collector.notEmpty(&deferred[begin], end-begin);
+            begin = end;
+        }
+        deferred.clear();
+    }
+};
+
 size_t CAContext::num_instances;
 
-CAContext::CAContext(unsigned int prio, bool fake)
+CAContext::CAContext(unsigned int prio, bool fake, const RealTime::Config *rt, bool polled)
     :context(0)
+    ,assign(Hash)
+    ,index(0u)
+    ,rt(rt ? *rt : RealTime::roles[RealTime::CA])
+    ,nCallbacks(0u)
+    ,callbackUs(0u)
+    ,nCreated(0u)
+    ,nCleared(0u)
 {
     REFTRACE_INCREMENT(num_instances);
     if(fake) return;
 
+    if(polled) {
+        ingest.reset(new Ingest(*this, prio));
+        return;
+    }
+
     epicsThreadId me = epicsThreadGetIdSelf();
     unsigned int orig_prio = epicsThreadGetPrioritySelf();
 
@@ -112,6 +556,14 @@ CAContext::~CAContext()
 {
     REFTRACE_DECREMENT(num_instances);
 
+    for(size_t i=0; i<shards.size(); i++)
+        delete shards[i];
+
+    if(ingest.get()) {
+        ingest.reset(); // destroys context
+        return;
+    }
+
     if(!context) return;
 
     struct ca_client_context *current = ca_current_context();
@@ -127,7 +579,11 @@ CAContext::~CAContext()
 
 CAContext::Attach::Attach(const CAContext &ctxt)
     :previous(ca_current_context())
+    ,attached(ctxt.context && !ctxt.ingest.get() && previous!=ctxt.context)
 {
+    if(!attached)
+        return;
+
     if(previous)
         ca_detach_context();
 
@@ -136,53 +592,357 @@ CAContext::Attach::Attach(const CAContext &ctxt)
 
 CAContext::Attach::~Attach()
 {
+    if(!attached)
+        return;
+
     ca_detach_context();
 
     if(previous)
         ca_attach_context(previous);
 }
 
-size_t Subscription::num_instances;
+void CAContext::addShard(unsigned int prio, const RealTime::Config& rt)
+{
+    epics::auto_ptr<CAContext> ctxt(new CAContext(prio, !context, &rt, ingest.get()!=0));
+    ctxt->index = unsigned(nshards());
+    shards.push_back(ctxt.get());
+    ctxt.release();
+}
 
-Subscription::Subscription(const CAContext &context,
-                           size_t column,
-                           const std::string& pvname,
-                           Collector &collector)
+const CAContext& CAContext::shard(const std::string& pvname) const
+{
+    if(shards.empty())
+        return *this;
+
+    size_t len = pvname.size();
+    if(assign==Prefix)
+        len = std::min(len, pvname.find(':'));
+
+    // FNV-1a
+    epicsUInt32 H = 2166136261u;
+    for(size_t i=0; i<len; i++) {
+        H ^= (unsigned char)pvname[i];
+        H *= 16777619u;
+    }
+    return shard(H%nshards());
+}
+
+void CAContext::flush() const
+{
+    for(size_t i=0; i<shards.size(); i++)
+        shards[i]->flush();
+
+    if(ingest.get()) {
+        ingest->wakeup.signal(); // next pass creates queued channels
+        return;
+    }
+
+    if(!context)
+        return;
+
+    Attach A(*this);
+    eca_error::check(ca_flush_io(), "Flush");
+}
+
+void CAContext::sync() const
+{
+    for(size_t i=0; i<shards.size(); i++)
+        shards[i]->sync();
+
+    if(ingest.get())
+        ingest->request(Ingest::Sync, 0);
+}
+
+RateEstimator::RateEstimator(double window, double alpha)
+    :rate(0.0)
+    ,brate(0.0)
+    ,window(window)
+    ,alpha(alpha)
+    ,start(-1.0)
+    ,count(0u)
+    ,bytes(0u)
+    ,primed(false)
+{}
+
+bool RateEstimator::add(double now, size_t nbytes)
+{
+    if(start < 0.0) {
+        // opens the first window.  Later windows are opened by the update closing the previous
+        start = now;
+        return false;
+    }
+
+    count++;
+    bytes += nbytes;
+
+    const double elapsed = now - start;
+    if(elapsed < window)
+        return false;
+
+    const double r = count/elapsed,
+                 br = bytes/elapsed;
+    if(primed) {
+        rate += alpha*(r - rate);
+        brate += alpha*(br - brate);
+    } else {
+        // first window sets initial estimate
+        rate = r;
+        brate = br;
+        primed = true;
+    }
+
+    start = now;
+    count = bytes = 0u;
+    return true;
+}
+
+bool RateEstimator::decay(double now)
+{
+    const double elapsed = now - start;
+    if(!primed || elapsed < window)
+        return false;
+
+    // an upper bound, so a PV updating slower than the window is unchanged
+    const double r = (count+1u)/elapsed;
+    if(r >= rate)
+        return false;
+
+    brate *= r/rate;
+    rate = r;
+    return true;
+}
+
+size_t Channel::num_instances;
+
+namespace {
+// Channels by CAContext shard and PV name
+typedef std::map<std::pair<const CAContext*, std::string>, std::tr1::weak_ptr<Channel> > channels_t;
+epicsMutex channels_mutex;
+channels_t channels;
+} // namespace
+
+std::tr1::shared_ptr<Channel> Channel::lookup(const CAContext& context, const std::string& pvname,
+                                              const std::tr1::shared_ptr<MemAccount>& mem)
+{
+    const CAContext& shard = context.shard(pvname);
+
+    Guard G(channels_mutex);
+
+    const channels_t::key_type key(&shard, pvname);
+    channels_t::iterator it(channels.find(key));
+
+    std::tr1::shared_ptr<Channel> ret;
+    if(it!=channels.end())
+        ret = it->second.lock();
+
+    if(!ret) {
+        ret.reset(new Channel(shard, pvname, mem));
+        channels[key] = ret;
+
+    } else if(collectorCaDebug>0) {
+        errlogPrintf("Share Channel to '%s'\n", pvname.c_str());
+    }
+    return ret;
+}
+
+Channel::Channel(const CAContext& context, const std::string& pvname, const std::tr1::shared_ptr<MemAccount>& mem)
     :pvname(pvname)
     ,context(context)
-    ,collector(collector)
-    ,column(column)
+    ,pool(new DBRValue::Pool)
     ,chid(0)
     ,evid(0)
     ,connected(false)
-    ,nDisconnects(0u)
-    ,nErrors(0u)
-    ,nUpdates(0u)
-    ,nUpdateBytes(0u)
-    ,nOverflows(0u)
-    ,lDisconnects(0u)
-    ,lErrors(0u)
-    ,lUpdates(0u)
-    ,lUpdateBytes(0u)
-    ,lOverflows(0u)
-    ,limit(16u) // arbitrary, will be overwritten during first data update
+    ,nativeType(-1)
+    ,nativeArray(0)
+    ,limit(16u)
+    ,estRate(0u)
+    ,estByteRate(0u)
 {
     REFTRACE_INCREMENT(num_instances);
 
     last_event.secPastEpoch = 0;
     last_event.nsec = 0;
 
+    // until attach()
+    pool->setAccount(mem);
+
     if(!context.context) return;
 
+    if(context.ingest.get()) {
+        context.ingest->request(CAContext::Ingest::Create, this);
+        return;
+    }
+
     CAContext::Attach A(context);
+    try {
+        create();
+    } catch(...) {
+        pool->close();
+        REFTRACE_DECREMENT(num_instances);
+        throw;
+    }
+}
+
+Channel::~Channel()
+{
+    if(context.ingest.get()) {
+        context.ingest->request(CAContext::Ingest::Clear, this);
 
+    } else if(chid) {
+        CAContext::Attach A(context);
+        clear();
+    }
+
+    {
+        Guard G(channels_mutex);
+        // unless already replaced by lookup()
+        channels_t::iterator it(channels.find(std::make_pair(&context, pvname)));
+        if(it!=channels.end() && it->second.expired())
+            channels.erase(it);
+    }
+
+    latest.reset();
+    pool->close();
+    REFTRACE_DECREMENT(num_instances);
+}
+
+void Channel::create()
+{
     int err = ca_create_channel(pvname.c_str(), &onConnect, this, 0, &chid);
     eca_error::check(err, "Create Channel");
+    epicsAtomicIncrSizeT(&context.nCreated);
     if(collectorCaDebug>0) {
         errlogPrintf("Create Channel to '%s'\n", pvname.c_str());
     }
 }
 
+void Channel::clear()
+{
+    if(!chid)
+        return;
+
+    if(collectorCaDebug>0) {
+        errlogPrintf("Clear Channel to '%s'\n", pvname.c_str());
+    }
+
+    int err = ca_clear_channel(chid); // implies ca_clear_subscription
+    // any callbacks are complete now
+    chid = 0;
+    epicsAtomicIncrSizeT(&context.nCleared);
+    if(err!=ECA_NORMAL)
+        errlogPrintf("Clear Channel to '%s' : %s\n", pvname.c_str(), ca_message(err));
+}
+
+void Channel::attach(Subscription *sub)
+{
+    Guard G(mutex);
+    subscribers.push_back(sub);
+    if(subscribers.size()==1u)
+        pool->setAccount(sub->collector.mem); // eg. the creating table was removed before
+
+    if(!connected)
+        return;
+
+    // already connected for another Collector
+    connect(sub);
+    epicsAtomicSetSizeT(&sub->estRate, estRate);
+    epicsAtomicSetSizeT(&sub->estByteRate, estByteRate);
+
+    if(latest.valid()) {
+        // as CA would on a new subscription
+        DBRValue temp(latest);
+        if(sub->_push(temp))
+            sub->collector.notEmpty(sub);
+    }
+}
+
+void Channel::detach(Subscription *sub)
+{
+    Guard G(mutex);
+    std::vector<Subscription*>::iterator it(std::find(subscribers.begin(), subscribers.end(), sub));
+    if(it!=subscribers.end())
+        subscribers.erase(it);
+
+    // charge new updates to a table still using this PV
+    if(!subscribers.empty() && sub->collector.mem.get()==pool->account())
+        pool->setAccount(subscribers.front()->collector.mem);
+}
+
+void Channel::push(const DBRValue& v)
+{
+    if(context.ingest.get()) {
+        // as if from ca_poll()
+        context.ingest->request(CAContext::Ingest::Push, this, v);
+        return;
+    }
+    assert(!context.context); // only call in unittest code
+    Guard G(mutex);
+    latest = v;
+    fanout(v, 0);
+}
+
+// with mutex locked
+void Channel::connect(Subscription *sub)
+{
+    epicsAtomicSetIntT(&sub->nativeType, nativeType);
+    epicsAtomicSetIntT(&sub->nativeArray, nativeArray);
+    epicsAtomicSetIntT(&sub->connected, 1);
+    epicsAtomicCmpAndSwapSizeT(&sub->connectedAt, 0u, std::max(size_t(1u), size_t(epicsMonotonicGet()/1000000u)));
+    // only producer may change limit
+    sub->values.setLimit(limit);
+}
+
+// with mutex locked.  Push to each Subscription, except where 'skip' is set
+void Channel::fanout(const DBRValue& v, const std::vector<char>* skip)
+{
+    for(size_t i=0, N=subscribers.size(); i<N; i++) {
+        if(skip && (*skip)[i])
+            continue;
+
+        Subscription *sub = subscribers[i];
+        DBRValue temp(v);
+        if(!sub->_push(temp))
+            continue;
+        else if(context.ingest.get())
+            context.ingest->deferred.push_back(sub); // on ingest thread.  notEmpty() after ca_poll()
+        else
+            sub->collector.notEmpty(sub);
+    }
+}
+
+void Channel::countError()
+{
+    Guard G(mutex);
+    for(size_t i=0, N=subscribers.size(); i<N; i++)
+        epicsAtomicIncrSizeT(&subscribers[i]->counters.nErrors);
+}
+
+size_t Subscription::num_instances;
+
+Subscription::Subscription(const CAContext &context,
+                           size_t column,
+                           const std::string& pvname,
+                           Collector &collector)
+    :pvname(pvname)
+    ,context(context)
+    ,collector(collector)
+    ,column(column)
+    ,channel(Channel::lookup(context, pvname, collector.mem))
+    ,connected(0)
+    ,connectedAt(0u)
+    ,nativeType(-1)
+    ,nativeArray(0)
+    ,estRate(0u)
+    ,estByteRate(0u)
+    ,pool(channel->pool)
+    ,tier(MemBudget::DefaultTier)
+    ,values(16u) // arbitrary, will be overwritten during first data update
+    ,armed(1)
+{
+    REFTRACE_INCREMENT(num_instances);
+    channel->attach(this);
+}
+
 Subscription::~Subscription()
 {
     close();
@@ -191,77 +951,139 @@ Subscription::~Subscription()
 
 void Subscription::close()
 {
-    if(!context.context) return;
+    channel->detach(this);
+}
 
+// on Collector processor
+void Subscription::clear(size_t remain)
+{
+    size_t dropped = 0u;
     {
-        Guard G(mutex);
-        if(!chid) return;
-    }
-    CAContext::Attach A(context);
-
-    if(collectorCaDebug>0) {
-        errlogPrintf("Clear Channel to '%s'\n", pvname.c_str());
+        DBRValue junk;
+        while(values.size()>remain && values.pop(junk)) {
+            dropped++;
+        }
     }
 
-    int err = ca_clear_channel(chid); // implies ca_clear_subscription
-    // any callbacks are complete now;
-    {
-        Guard G(mutex);
-        chid = 0;
-        evid = 0;
+    if(dropped) {
+        epicsAtomicAddSizeT(&counters.nOverflows, dropped);
     }
-    eca_error::check(err);
 }
 
-void Subscription::clear(size_t remain)
+void Subscription::snapshot(Stats& out) const
 {
-    Guard G(mutex);
-    while(values.size()>remain) {
-        values.pop_front();
-        nOverflows++;
-    }
+    out.nDisconnects = epicsAtomicGetSizeT(&counters.nDisconnects);
+    out.nErrors = epicsAtomicGetSizeT(&counters.nErrors);
+    out.nUpdates = epicsAtomicGetSizeT(&counters.nUpdates);
+    out.nUpdateBytes = epicsAtomicGetSizeT(&counters.nUpdateBytes);
+    out.nOverflows = epicsAtomicGetSizeT(&counters.nOverflows);
+    out.nShed = epicsAtomicGetSizeT(&counters.nShed);
+}
 
+Subscription::Stats Subscription::Stats::operator-(const Stats& o) const
+{
+    Stats ret;
+    ret.nDisconnects = nDisconnects - o.nDisconnects;
+    ret.nErrors = nErrors - o.nErrors;
+    ret.nUpdates = nUpdates - o.nUpdates;
+    ret.nUpdateBytes = nUpdateBytes - o.nUpdateBytes;
+    ret.nOverflows = nOverflows - o.nOverflows;
+    ret.nShed = nShed - o.nShed;
+    return ret;
 }
 
+// on Collector processor
 DBRValue Subscription::pop()
 {
     DBRValue ret;
-    {
-        Guard G(mutex);
-        if(!values.empty()) {
-            ret = values.front();
-            values.pop_front();
-        }
-    }
+    values.pop(ret);
     return ret;
 }
 
+// on Collector processor
+size_t Subscription::pop(std::vector<DBRValue>& out, size_t max)
+{
+    return values.pop(out, max);
+}
+
+// on Collector processor
+bool Subscription::arm()
+{
+    // CAS implies a full barrier, so our test of values can't be reordered before setting 'armed'
+    epicsAtomicCmpAndSwapIntT(&armed, 0, 1);
+    if(values.empty())
+        return true;
+    // raced with push().  If producer got here first, then it has called notEmpty(), which is harmless.
+    epicsAtomicCmpAndSwapIntT(&armed, 1, 0);
+    return false;
+}
+
 void Subscription::push(const DBRValue &v)
 {
     assert(!context.context); // only call in unittest code
-    {
-        Guard G(mutex);
-        DBRValue temp(v);
-        _push(temp);
+    DBRValue temp(v);
+    _push(temp); // unittest calls Collector::notEmpty() explicitly
+}
+
+// on producer (Channel, with its mutex locked)
+bool Subscription::_push(DBRValue& v)
+{
+    if(!values.push(v)) {
+        // Full.  Drop this, the newest, update to maximize chance of overlapping with lower rate PVs.
+        // The producer can't remove older entries.  cf. EvictPolicy when the Collector overflows.
+        epicsAtomicIncrSizeT(&counters.nOverflows);
+        return false;
     }
+
+    return epicsAtomicCmpAndSwapIntT(&armed, 1, 0)==1;
+}
+
+void Channel::decay()
+{
+    Guard G(mutex);
+    if(rates.decay(epicsMonotonicGet()*1e-9))
+        publish(); // queues shrink lazily, with the next update
 }
 
-// assume locked
-void Subscription::_push(DBRValue& v)
+// with mutex locked
+void Channel::publish()
 {
-    while(values.size() > limit) {
-        // we drop newest element to maximize chance of overlapping with lower rate PVs
-        values.pop_front();
-        nOverflows++;
+    estRate = size_t(rates.rate*1e3);
+    estByteRate = size_t(rates.brate);
+    for(size_t i=0, N=subscribers.size(); i<N; i++) {
+        epicsAtomicSetSizeT(&subscribers[i]->estRate, estRate);
+        epicsAtomicSetSizeT(&subscribers[i]->estByteRate, estByteRate);
     }
+}
 
-    values.push_back(DBRValue());
-    values.back().swap(v);
+// on CA worker, with mutex locked.  resize queues to match estimated rate
+void Channel::adapt()
+{
+    publish();
+
+    if(!collectorCaAdaptive)
+        return;
+
+    size_t want = 4u + size_t(rates.rate*bsasFlushPeriod*collectorCaHeadroom);
+    if(collectorCaMaxQueue>4)
+        want = std::min(want, size_t(collectorCaMaxQueue));
+
+    // grow promptly to avoid overflow, shrink lazily
+    if(want > limit || want*2u < limit) {
+        if(collectorCaDebug>1)
+            errlogPrintf("%s queue limit %zu -> %zu for %.1f Hz\n", pvname.c_str(), limit, want, rates.rate);
+        limit = want;
+        // only producer may change limit
+        for(size_t i=0, N=subscribers.size(); i<N; i++)
+            subscribers[i]->values.setLimit(want);
+        pool->depth = 2u*want + 4u;
+    }
 }
 
-void Subscription::onConnect (struct connection_handler_args args)
+void Channel::onConnect (struct connection_handler_args args)
 {
-    Subscription *self = static_cast<Subscription*>(ca_puser(args.chid));
+    Channel *self = static_cast<Channel*>(ca_puser(args.chid));
+    CallbackLoad load(self->context);
     if(collectorCaDebug>0)
         errlogPrintf("%s %sconnected\n", ca_name(args.chid), (args.op==CA_OP_CONN_UP)?"":"dis");
     try {
@@ -281,13 +1103,22 @@ void Subscription::onConnect (struct connection_handler_args args)
             int err = ca_create_subscription(promoted, 0, args.chid, DBE_VALUE|DBE_ALARM, &onEvent, self, &self->evid);
             eca_error::check(err);
 
-            {
-                Guard G(self->mutex);
-                self->last_event.secPastEpoch = 0;
-                self->last_event.nsec = 0;
-                self->connected = true;
-                self->limit = std::max(size_t(4u), size_t(bsasFlushPeriod*(maxcnt!=1u ? collectorCaArrayMaxRate : collectorCaScalarMaxRate)));
-            }
+            self->last_event.secPastEpoch = 0;
+            self->last_event.nsec = 0;
+
+            Guard G(self->mutex);
+
+            self->connected = true;
+            self->nativeType = scalarTypeOf(promoted);
+            self->nativeArray = maxcnt!=1u;
+            self->limit = std::max(size_t(4u), size_t(bsasFlushPeriod*(maxcnt!=1u ? collectorCaArrayMaxRate : collectorCaScalarMaxRate)));
+            // enough for a full queue, plus those in flight through Collector and Receivers
+            self->pool->depth = 2u*self->limit + 4u;
+            if(bsasRTMemLock)
+                self->pool->prefill(dbr_value_size[promoted]*maxcnt);
+
+            for(size_t i=0, N=self->subscribers.size(); i<N; i++)
+                self->connect(self->subscribers[i]);
 
         } else if(args.op==CA_OP_CONN_DOWN) {
 
@@ -296,22 +1127,22 @@ void Subscription::onConnect (struct connection_handler_args args)
             const int err = ca_clear_subscription(self->evid);
             self->evid = 0;
 
-            DBRValue val(new DBRValue::Holder);
+            DBRValue val(DBRValue::alloc(self->pool, pvd::pvDouble, 0u));
             epicsTimeGetCurrent(&val->ts);
 
-            bool notify;
             {
                 Guard G(self->mutex);
-                notify = self->values.empty();
 
                 self->connected = false;
-                self->nDisconnects++;
+                self->latest = val;
 
-                self->_push(val);
-            }
+                for(size_t i=0, N=self->subscribers.size(); i<N; i++) {
+                    Subscription *sub = self->subscribers[i];
+                    epicsAtomicSetIntT(&sub->connected, 0);
+                    epicsAtomicIncrSizeT(&sub->counters.nDisconnects);
+                }
 
-            if(notify) {
-                self->collector.notEmpty(self);
+                self->fanout(val, 0);
             }
 
             eca_error::check(err);
@@ -320,16 +1151,16 @@ void Subscription::onConnect (struct connection_handler_args args)
             // shouldn't happen, but ignore if it does
         }
     } catch(std::exception& err) {
-        errlogPrintf("Unexpected exception in Subscription::onConnect() for \"%s\" : %s\n", ca_name(args.chid), err.what());
+        errlogPrintf("Unexpected exception in Channel::onConnect() for \"%s\" : %s\n", ca_name(args.chid), err.what());
 
-        Guard G(self->mutex);
-        self->nErrors++;
+        self->countError();
     }
 }
 
-void Subscription::onEvent (struct event_handler_args args)
+void Channel::onEvent (struct event_handler_args args)
 {
-    Subscription *self = static_cast<Subscription*>(args.usr);
+    Channel *self = static_cast<Channel*>(args.usr);
+    CallbackLoad load(self->context);
     if(collectorCaDebug>1)
         errlogPrintf("%s event dbr:%ld count:%ld\n", ca_name(args.chid), args.type, args.count);
     try {
@@ -346,61 +1177,63 @@ void Subscription::onEvent (struct event_handler_args args)
         if(args.count==0 && size > elem_size)
             size -= elem_size;
 
-        pvd::ScalarType type;
-        switch(args.type) {
-        case DBR_TIME_STRING: type = pvd::pvString; break;
-        case DBR_TIME_SHORT:  type = pvd::pvShort; break;
-        case DBR_TIME_FLOAT:  type = pvd::pvFloat; break;
-        case DBR_TIME_ENUM:   type = pvd::pvShort; break;
-        case DBR_TIME_CHAR:   type = pvd::pvByte; break;
-        case DBR_TIME_LONG:   type = pvd::pvInt; break;
-        case DBR_TIME_DOUBLE: type = pvd::pvDouble; break;
-        default:
-            // treat any unknown as byte array
-            type = pvd::pvByte; break;
-        }
+        const pvd::ScalarType type = scalarTypeOf(args.type);
 
         // all of the dbr_time_* structs have the same prefix for alarm and timestamp
         dbr_time_double meta;
         // dbr_time_double includes space for the first value, but we don't want to copy this now
         memcpy(&meta, args.dbr, offsetof(dbr_time_double, value));
 
-        pvd::shared_vector<void> buf;
-        if(type!=pvd::pvString) {
-            buf = pvd::ScalarTypeFunc::allocArray(type, count);
+        Guard G(self->mutex);
+        std::vector<Subscription*>& subs = self->subscribers;
 
-            if(buf.size() != elem_size*count)
+        DBRValue val;
+        if(type!=pvd::pvString) {
+            if(pvd::ScalarTypeFunc::elementSize(type) != elem_size)
                 throw std::logic_error("DBR buffer size computation error");
 
-            memcpy(buf.data(),
+            // MemBudget tier is per Subscription
+            std::vector<char>& shed = self->shed;
+            shed.resize(subs.size());
+            bool keep = false;
+            for(size_t i=0, N=subs.size(); i<N; i++) {
+                shed[i] = MemBudget::sheds(subs[i]->tier, elem_size*count);
+                if(shed[i])
+                    epicsAtomicIncrSizeT(&subs[i]->counters.nShed);
+                else
+                    keep = true;
+            }
+            if(!keep) {
+                // over memory budget for all.  drop before allocating
+                return;
+            }
+
+            // single allocation for meta-data and value
+            val = DBRValue::alloc(self->pool, type, count);
+
+            memcpy(val->data(),
                    dbr_value_ptr(args.dbr, args.type),
-                   buf.size());
+                   elem_size*count);
 
         } else {
             // TODO: not currently used
 
-            Guard G(self->mutex);
-
-            self->nErrors++;
-            self->nOverflows++;
+            for(size_t i=0, N=subs.size(); i<N; i++) {
+                epicsAtomicIncrSizeT(&subs[i]->counters.nErrors);
+                epicsAtomicIncrSizeT(&subs[i]->counters.nOverflows);
+            }
             if(collectorCaDebug>0) {
                 errlogPrintf("%s DBF_STRING not supported, ignoring\n", self->pvname.c_str());
             }
             return;
         }
+        const std::vector<char>& shed = self->shed;
 
-        DBRValue val(new DBRValue::Holder);
         val->sevr = meta.severity;
         val->stat = meta.status;
         val->ts = meta.stamp;
-        val->count = count;
-        val->buffer = pvd::freeze(buf);
 
-        bool notify;
         {
-            Guard G(self->mutex);
-
-            self->nUpdates++;
             /* Assumptions and approximations in bandwidth usage calculation.
              * Assume Ethernet with MTU 1500.
              * No IP fragmentation.
@@ -416,36 +1249,43 @@ void Subscription::onEvent (struct event_handler_args args)
              *
              * 98+1402 body bytes in the first frame. 66+1434 in subsequent frames.
              */
-            self->nUpdateBytes += size + 98u;
+            size_t nbytes = size + 98u;
             if(size > 1402u) {
-                self->nUpdateBytes += 66u*(1u + (size-1402u)/1434u);
+                nbytes += 66u*(1u + (size-1402u)/1434u);
+            }
+            for(size_t i=0, N=subs.size(); i<N; i++) {
+                if(shed[i])
+                    continue;
+                epicsAtomicIncrSizeT(&subs[i]->counters.nUpdates);
+                epicsAtomicAddSizeT(&subs[i]->counters.nUpdateBytes, nbytes);
             }
 
+            if(self->rates.add(epicsMonotonicGet()*1e-9, nbytes))
+                self->adapt();
+        }
 
-            if(epicsTimeDiffInSeconds(&meta.stamp, &self->last_event) > 0.0) {
-                notify = self->values.empty();
-
-                self->_push(val);
-            } else {
-                self->nErrors++;
-                notify = false;
+        bool monotonic = epicsTimeDiffInSeconds(&meta.stamp, &self->last_event) > 0.0;
+        if(!monotonic) {
+            for(size_t i=0, N=subs.size(); i<N; i++) {
+                if(!shed[i])
+                    epicsAtomicIncrSizeT(&subs[i]->counters.nErrors);
+            }
 
-                if(collectorCaDebug>2) {
-                    errlogPrintf("%s ignoring non-monotonic TS\n", self->pvname.c_str());
-                }
+            if(collectorCaDebug>2) {
+                errlogPrintf("%s ignoring non-monotonic TS\n", self->pvname.c_str());
             }
-            self->last_event = meta.stamp;
         }
+        self->last_event = meta.stamp;
 
-        if(notify) {
-            self->collector.notEmpty(self);
+        if(monotonic) {
+            self->latest = val;
+            self->fanout(val, &shed);
         }
 
     } catch(std::exception& err) {
-        errlogPrintf("Unexpected exception in Subscription::onEvent() for \"%s\" : %s\n", ca_name(args.chid), err.what());
+        errlogPrintf("Unexpected exception in Channel::onEvent() for \"%s\" : %s\n", ca_name(args.chid), err.what());
 
-        Guard G(self->mutex);
-        self->nErrors++;
+        self->countError();
     }
 }
 
@@ -453,4 +1293,9 @@ extern "C" {
 epicsExportAddress(int, collectorCaDebug);
 epicsExportAddress(double, collectorCaScalarMaxRate);
 epicsExportAddress(double, collectorCaArrayMaxRate);
+epicsExportAddress(int, collectorCaAdaptive);
+epicsExportAddress(double, collectorCaHeadroom);
+epicsExportAddress(int, collectorCaMaxQueue);
+epicsExportAddress(int, collectorCaConnectBatch);
+epicsExportAddress(double, collectorCaPollPeriod);
 }
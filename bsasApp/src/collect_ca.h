@@ -2,14 +2,21 @@
 #define COLLECT_CA_H
 
 #include <string>
-#include <deque>
+#include <vector>
+#include <algorithm>
 
 #include <epicsTime.h>
 #include <epicsMutex.h>
 #include <epicsGuard.h>
+#include <epicsAtomic.h>
 #include <alarm.h>
 #include <pv/noDefaultMethods.h>
 #include <pv/sharedVector.h>
+#include <pv/sharedPtr.h>
+
+#include "spsc_ring.h"
+#include "membudget.h"
+#include "realtime.h"
 
 typedef epicsGuard<epicsMutex> Guard;
 typedef epicsGuardRelease<epicsMutex> UnGuard;
@@ -21,82 +28,357 @@ struct oldSubscription;
 struct connection_handler_args;
 
 struct Collector;
+struct Subscription;
 
 struct DBRValue {
+    struct Pool;
+
+    // meta-data and value are a single allocation, with value stored immediately after Holder.
     struct Holder {
         static size_t num_instances;
 
         epicsTimeStamp ts; // in epics epoch
         epicsUInt16 sevr, // [0-3] or 4 (Disconnect)
                     stat; // status code a la Base alarm.h
-        epicsUInt32 count;
-        epics::pvData::shared_vector<const void> buffer; // contains DBF_* mapped to pvd:pv* code
+        epicsUInt32 count; // # of elements
+        epics::pvData::ScalarType type; // DBF_* mapped to pvd:pv* code
+
+        void* data() { return this+1; }
+        const void* data() const { return this+1; }
+
+        // alias value storage.  Holds a reference to this Holder
+        epics::pvData::shared_vector<const void> buffer() const;
+
+    private:
+        friend struct DBRValue;
+        friend struct Pool;
+
+        int volatile refs;
+        unsigned size_class; // value storage is (8<<size_class) bytes.  Unless pool==0
+        Pool *pool;
+        MemAccount *account; // charged by alloc(), credited by release().  Kept alive by pool
+
         Holder();
         ~Holder();
+        EPICS_NOT_COPYABLE(Holder)
+    };
+
+    /* Free lists of Holders, by size class.
+     * Allocation is only from one thread (CA worker), release from any thread.
+     * Reference counted by the owner and by each allocated Holder.
+     */
+    struct Pool {
+        static size_t num_instances;
+        static size_t num_hits, num_misses;
+
+        enum {nClasses = 18}; // up to 1MB
+
+        Pool();
+
+        // owner releases its reference
+        void close();
+
+        // on allocating thread.  Cache up to 'depth' Holders with storage for 'bytes', touching each
+        void prefill(size_t bytes);
+
+        // # of Holders to keep cached
+        size_t depth;
+
+        // bytes held by allocated Holders, until released
+        size_t volatile inuse;
+
+        // Also charge later allocations to 'acct', which may be NULL.  Holders already allocated
+        // are credited to the account they were charged to.  On any thread.  Calls are serialized by the owner.
+        void setAccount(const std::tr1::shared_ptr<MemAccount>& acct);
+        // charged for new allocations.  May be NULL
+        MemAccount* account() const { return static_cast<MemAccount*>(epicsAtomicGetPtrT(&current)); }
+
+        static unsigned size_class(size_t bytes) {
+            unsigned cls = 0u;
+            while((size_t(8u)<<cls) < bytes)
+                cls++;
+            return cls;
+        }
+
+    private:
+        friend struct DBRValue;
+
+        struct Free {
+            Free *next;
+        };
+
+        int volatile refs;
+        size_t volatile ncached;
+        // MemAccount*
+        EpicsAtomicPtrT volatile current;
+        // current and previous accounts, kept for Holders charged to them.  Only changed by setAccount()
+        std::vector<std::tr1::shared_ptr<MemAccount> > accounts;
+        // only accessed by allocating thread
+        Free *local[nClasses];
+        // pushed by releasing thread.  Taken in full by allocating thread.
+        EpicsAtomicPtrT volatile returned[nClasses];
+
+        ~Pool();
+        void* take(unsigned cls);
+        void give(unsigned cls, void* raw);
+        MemAccount* charge(size_t n);
+        void credit(size_t n, MemAccount *acct);
+        void unref();
+        EPICS_NOT_COPYABLE(Pool)
     };
+
+    // Allocate w/ storage for 'count' elements of 'type'.  pool may be NULL.
+    // Storage too large to cache is still accounted to the pool.
+    // From threads other than the allocating thread of pool, pass take=false to charge pool
+    // without taking from its cache.
+    static DBRValue alloc(Pool *pool, epics::pvData::ScalarType type, size_t count, bool take=true);
+
 private:
-    std::tr1::shared_ptr<Holder> held;
+    Holder *held;
+
+    explicit DBRValue(Holder *H) :held(H) {} // steals reference
+    static void release(Holder *H);
 public:
 
-    DBRValue() {}
-    DBRValue(Holder *H) :held(H) {}
+    DBRValue() :held(0) {}
+    DBRValue(const DBRValue& o) :held(o.held) {
+        if(held)
+            epicsAtomicIncrIntT(&held->refs);
+    }
+    ~DBRValue() { reset(); }
+
+    DBRValue& operator=(const DBRValue& o) {
+        DBRValue temp(o);
+        swap(temp);
+        return *this;
+    }
 
     bool valid() const { return !!held; }
-    Holder* operator->() {return held.get();}
-    const Holder* operator->() const {return held.get();}
+    Holder* operator->() {return held;}
+    const Holder* operator->() const {return held;}
 
     void swap(DBRValue& o) {
-        held.swap(o.held);
+        std::swap(held, o.held);
     }
     void reset() {
-        held.reset();
+        if(held && epicsAtomicDecrIntT(&held->refs)==0)
+            release(held);
+        held = 0;
     }
 };
 
+// # of channels created by Collector before each flush.  <=0 flushes only once all are created
+extern int collectorCaConnectBatch;
+// seconds between passes of the ingest thread of a polled CAContext.  0 polls continuously
+extern double collectorCaPollPeriod;
+
+/* One, or several, CA client contexts.
+ *
+ * With shards, channels are spread over this and each added context, so that monitor callbacks
+ * of many PVs run on the worker threads of several contexts.
+ *
+ * A polled context is non-preemptive, and owned by an ingest thread which makes all CA calls for it.
+ * Each pass drains all pending callbacks with ca_poll(), then notifies each Collector once
+ * for all of its Subscriptions which became non-empty.
+ */
 struct CAContext {
     static size_t num_instances;
 
-    explicit CAContext(unsigned int prio, bool fake=false);
+    // 'rt' configures CA worker threads of this context.  Defaults to RealTime::roles[RealTime::CA]
+    explicit CAContext(unsigned int prio, bool fake=false, const RealTime::Config* rt=0, bool polled=false);
     ~CAContext();
 
     struct ca_client_context *context;
 
-    // manage attachment of a context to the current thread
+    // non-NULL if polled
+    struct Ingest;
+    epics::auto_ptr<Ingest> ingest;
+
+    enum Assign {
+        Hash,   // by PV name
+        Prefix  // by PV name up to the first ':'.  Usually keeps PVs of one IOC, and its circuit, in one context
+    } assign;
+
+    // Add a context to spread channels over, polled if this one is.  Before any channels are created.
+    void addShard(unsigned int prio, const RealTime::Config& rt);
+    // # of contexts, including this one
+    size_t nshards() const { return 1u + shards.size(); }
+    const CAContext& shard(size_t i) const { return i==0u ? *this : *shards[i-1u]; }
+    // context for a new channel to pvname
+    const CAContext& shard(const std::string& pvname) const;
+
+    // i of shard(i) in the first context
+    unsigned index;
+    RealTime::Config rt;
+
+    // Channel callbacks on this context, and time (us) spent in them.  Read with epicsAtomicGetSizeT()
+    mutable size_t volatile nCallbacks, callbackUs;
+    // ca_create_channel() and ca_clear_channel() on this context.  Read with epicsAtomicGetSizeT()
+    mutable size_t volatile nCreated, nCleared;
+
+    // manage attachment of a context to the current thread.
+    // Nests, doing nothing if already attached, or for a fake or polled context.
     struct Attach {
         struct ca_client_context *previous;
+        bool attached;
         Attach(const CAContext&);
         ~Attach();
     };
 
+    // send queued requests, eg. searches for newly created channels.  Of all shards
+    void flush() const;
+    // Wait until polled shards have notified Collectors of updates which arrived before
+    // Subscriptions were close()d.  Before freeing those Subscriptions.
+    void sync() const;
+
+private:
+    std::vector<CAContext*> shards;
+
     EPICS_NOT_COPYABLE(CAContext)
 };
 
-struct Subscription {
+/* Online estimate of update rate and byte rate.
+ * Counts over windows of at least 'window' seconds, then smoothed with an EWMA.
+ * Not thread safe.
+ */
+struct RateEstimator {
+    double rate,  // updates/sec
+           brate; // bytes/sec
+
+    RateEstimator(double window = 1.0, double alpha = 0.3);
+
+    // account for one update of nbytes at time now (seconds on any monotonic clock).
+    // Returns true if estimates were updated.
+    bool add(double now, size_t nbytes);
+    // With no update for over a window, lower the estimates to what an update arriving 'now' would give.
+    // Returns true if estimates were updated.
+    bool decay(double now);
+
+private:
+    const double window, alpha;
+    double start; // of current window.  <0 before first update
+    size_t count, bytes;
+    bool primed;
+};
+
+/* One CA channel and monitor of a PV, shared by the Subscriptions of all Collectors (tables)
+ * using the same CAContext.  Each update is allocated once, and fanned out by reference to
+ * the queue of each Subscription.  Overflow, shedding, and stats are counted per Subscription.
+ */
+struct Channel {
     static size_t num_instances;
 
     const std::string pvname;
+    // shard of the context given to lookup()
     const CAContext& context;
-    Collector& collector;
-    const size_t column;
+
+    // Existing Channel of pvname, or a new one on context.shard(pvname) charging its updates to 'mem'
+    static std::tr1::shared_ptr<Channel> lookup(const CAContext& context, const std::string& pvname,
+                                                const std::tr1::shared_ptr<MemAccount>& mem);
+    ~Channel();
+
+    // begin fan out to sub.  If already connected, also pushes the most recent update.
+    void attach(Subscription *sub);
+    // end fan out to sub.  No push() to sub is in progress after return.
+    // With a polled context, its notEmpty() may be.  cf. CAContext::sync()
+    void detach(Subscription *sub);
+
+    // for test code only.  Fan out as an update from CA would be.
+    // With a polled context, queued for the next pass of the ingest thread.
+    void push(const DBRValue& v);
+
+    // on any thread.  Periodically, so that the estimated rates of a silent PV fall
+    void decay();
+
+    // DBRValue storage for updates of this PV.  Only allocated from by CA worker
+    DBRValue::Pool * const pool;
+
+private:
+    Channel(const CAContext& context, const std::string& pvname, const std::tr1::shared_ptr<MemAccount>& mem);
 
     // set before callbacks are possible, cleared after callbacks are impossible
     struct oldChannelNotify *chid;
-    // effectively a local of a CA worker, set and cleared from onConnect()
+    // effectively locals of a CA worker
     struct oldSubscription *evid;
+    epicsTimeStamp last_event;
+    RateEstimator rates;
+    std::vector<char> shed;
 
-    mutable epicsMutex mutex;
-
+    // serializes fan out with attach() and detach()
+    epicsMutex mutex;
+    // remaining members are guarded by mutex
+    std::vector<Subscription*> subscribers;
+    // copied to Subscriptions attaching later
     bool connected;
-    // stats counters
-    size_t nDisconnects, nErrors, nUpdates, nUpdateBytes, nOverflows;
-    // previous values of counters for delta
-    size_t lDisconnects, lErrors, lUpdates, lUpdateBytes, lOverflows;
-    // current buffer limit
-    size_t limit;
+    int nativeType, nativeArray;
+    size_t limit, estRate, estByteRate;
+    DBRValue latest;
 
-    epicsTimeStamp last_event;
+    void connect(Subscription *sub);
+    void fanout(const DBRValue& v, const std::vector<char>* skip);
+    void countError();
+    void publish();
+    void adapt();
+
+    // on a thread attached to context
+    void create();
+    void clear();
+
+    static void onConnect (struct connection_handler_args args);
+    static void onEvent (struct event_handler_args args);
 
-    std::deque<DBRValue> values;
+    friend struct CAContext::Ingest;
+
+    EPICS_NOT_COPYABLE(Channel)
+};
+
+struct Subscription {
+    static size_t num_instances;
+
+    const std::string pvname;
+    const CAContext& context;
+    Collector& collector;
+    // changed only by Collector::setNames(), while excluding Collector::notEmpty()
+    size_t column;
+
+    // may be shared with other Collectors
+    const std::tr1::shared_ptr<Channel> channel;
+
+    struct Stats {
+        size_t nDisconnects, nErrors, nUpdates, nUpdateBytes, nOverflows,
+               nShed; // dropped by MemBudget
+        Stats() :nDisconnects(0u), nErrors(0u), nUpdates(0u), nUpdateBytes(0u), nOverflows(0u), nShed(0u) {}
+        Stats operator-(const Stats& o) const;
+    };
+
+    // set/cleared by Channel
+    int volatile connected;
+    // epicsMonotonicGet() as ms at first connection.  0 until then
+    size_t volatile connectedAt;
+    // pvData::ScalarType of updates, and whether an array, from ca_field_type() and ca_element_count()
+    // at last connection.  nativeType is -1 until connected.  Set before 'connected'
+    int volatile nativeType, nativeArray;
+    // monotonic stats counters.  Only modified with epicsAtomic*() by CA worker and Collector processor.
+    // Read with snapshot() from any thread, without locking.
+    Stats counters;
+    // previous snapshot() by Coordinator for delta.  Only accessed by Coordinator handler.
+    Stats published;
+    // snapshot() at last bsasStatReset.  Accessed with Coordinator::mutex locked.
+    Stats base;
+
+    // most recent estimates of Channel, as mHz and bytes/sec.  Read with epicsAtomicGetSizeT()
+    size_t volatile estRate, estByteRate;
+
+    // DBRValue storage for updates of this PV.  Owned by channel
+    DBRValue::Pool *pool;
+    // MemBudget priority tier
+    unsigned volatile tier;
+
+    // Channel pushes, Collector processor pops.
+    // CA serializes all callbacks for a context, and Channel::mutex serializes attach(), so there is only one producer.
+    SPSCRing<DBRValue> values;
+    // set by consumer when values found empty.  cleared by producer, which then calls Collector::notEmpty()
+    int volatile armed;
 
     Subscription(const CAContext& context,
                  size_t column,
@@ -104,21 +386,29 @@ struct Subscription {
                  Collector& collector);
     ~Subscription();
 
+    // detach from channel
     void close();
 
     void clear(size_t remain);
 
+    // on any thread
+    void snapshot(Stats& out) const;
+
     // dequeue one update
     DBRValue pop();
+    // dequeue up to max updates onto the end of 'out'
+    size_t pop(std::vector<DBRValue>& out, size_t max);
+    // call after finding queue empty.  Returns false if the queue is no longer empty.
+    // Otherwise the next push() will trigger Collector::notEmpty()
+    bool arm();
 
     // for test code only
     void push(const DBRValue& v);
 
 private:
-    void _push(DBRValue& v);
-
-    static void onConnect (struct connection_handler_args args);
-    static void onEvent (struct event_handler_args args);
+    friend struct Channel;
+    // returns true if Collector should be notified
+    bool _push(DBRValue& v);
 
     EPICS_NOT_COPYABLE(Subscription)
 };
@@ -1,8 +1,13 @@
 
+#include <string.h>
+
 #include <list>
+#include <map>
+#include <sstream>
 #include <algorithm>
 
 #include <epicsMath.h>
+#include <epicsAtomic.h>
 #include <errlog.h>
 #include <pv/reftrack.h>
 
@@ -12,6 +17,10 @@
 
 namespace pvd = epics::pvData;
 
+int collectorDebug;
+
+// defaults for Collector::Limits
+
 // limit on number of potentially complete events to track
 static double maxEventRate = 20;
 // timeout to flush partial events
@@ -19,32 +28,246 @@ static double maxEventAge = 2.5;
 // holdoff after delivering events
 double bsasFlushPeriod = 2.0;
 
-int collectorDebug;
+Collector::Limits::Limits()
+    :maxEventRate(::maxEventRate)
+    ,maxEventAge(::maxEventAge)
+    ,flushPeriod(bsasFlushPeriod)
+{}
+
+// limit on number of potentially complete events to track
+size_t Collector::Limits::maxEvents() const
+{
+    return std::max(10.0, std::min(maxEventRate*flushPeriod, 5000.0));
+}
+
+SliceFill::SliceFill(size_t ncolumns)
+    :present((ncolumns+wbits-1u)/wbits, 0u)
+    ,expected(present.size(), 0u)
+    ,current(0u)
+    ,nexpected(0u)
+    ,nmissing(0u)
+{
+    filled.reserve(ncolumns);
+}
+
+void SliceFill::fill(size_t column, epicsUInt64 key)
+{
+    if(key > current) {
+        // new slice, initially empty
+        for(size_t i=0, N=filled.size(); i<N; i++)
+            set(present, filled[i], false);
+        filled.clear();
+        current = key;
+        nmissing = nexpected;
+
+    } else if(key < current || test(present, column)) {
+        return; // not newest, or duplicate
+    }
+
+    set(present, column, true);
+    filled.push_back(column);
+    if(test(expected, column))
+        nmissing--;
+}
+
+void SliceFill::expect(size_t column, bool expect)
+{
+    if(test(expected, column)==expect)
+        return;
+
+    set(expected, column, expect);
+    if(expect) {
+        nexpected++;
+        if(!test(present, column))
+            nmissing++;
+    } else {
+        nexpected--;
+        if(!test(present, column))
+            nmissing--;
+    }
+}
+
+const char* EvictPolicy::name(Kind kind)
+{
+    switch(kind) {
+    case DropOldest: return "oldest";
+    case DropNewest: return "newest";
+    case KeepNth: return "nth";
+    case KeepLikely: return "likely";
+    default: return "???";
+    }
+}
+
+EvictPolicy::Kind EvictPolicy::parse(const char *name)
+{
+    for(unsigned i=0; i<nKinds; i++) {
+        if(name && strcmp(name, EvictPolicy::name(Kind(i)))==0)
+            return Kind(i);
+    }
+    return nKinds;
+}
+
+namespace {
+epicsUInt64 key_of(const DBRValue& val)
+{
+    epicsUInt64 key = val->ts.secPastEpoch;
+    key <<= 32;
+    key |= val->ts.nsec;
+    return key;
+}
+} // namespace
+
+void EvictPolicy::select(std::vector<DBRValue>& values, const std::vector<epicsUInt64>& staged) const
+{
+    const size_t N = values.size();
+    size_t nkeep = 0u;
+
+    switch(kind) {
+    case DropOldest:
+        nkeep = std::min(keep, N);
+        for(size_t i=0; i<nkeep; i++)
+            values[i].swap(values[N-nkeep+i]);
+        break;
+
+    case DropNewest:
+        nkeep = std::min(keep, N);
+        break;
+
+    case KeepNth:
+        // every nth counting back from the newest, at most 'keep' of them
+        if(N && keep) {
+            const size_t stride = std::max(nth, size_t(1u)),
+                         count = std::min(keep, (N-1u)/stride + 1u);
+            for(size_t i=N-1u-(count-1u)*stride; i<N; i+=stride)
+                values[nkeep++].swap(values[i]);
+        }
+        break;
+
+    case KeepLikely: {
+        // newest first, in two passes.  Then restore order
+        std::vector<char> chosen(N, 0);
+        size_t nchosen = 0u;
+        for(size_t pass=0; pass<2u; pass++) {
+            for(size_t i=N; i && nchosen<keep; i--) {
+                if(chosen[i-1u])
+                    continue;
+                if(pass==0u && !std::binary_search(staged.begin(), staged.end(), key_of(values[i-1u])))
+                    continue;
+                chosen[i-1u] = 1;
+                nchosen++;
+            }
+        }
+        for(size_t i=0; i<N; i++) {
+            if(chosen[i])
+                values[nkeep++].swap(values[i]);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    values.resize(nkeep);
+}
 
 size_t Collector::num_instances;
 
-Collector::Collector(CAContext& ctxt, const names_t &names, unsigned int prio)
+Collector::Collector(CAContext& ctxt, const names_t &names, unsigned int prio, size_t nworkers, Executor *executor)
     :ctxt(ctxt)
     ,receivers_changed(false)
     ,nComplete(0u)
     ,nOverflow(0u)
-    ,waiting(false)
+    ,nLate(0u)
+    ,nAged(0u)
+    ,nSpilled(0u)
+    ,nReplayed(0u)
+    ,nSpillDrop(0u)
+    ,spill_used(0u)
+    ,replay_lag_ms(0u)
+    ,mem(new MemAccount)
+    ,connect_start(0u)
+    ,deliver_max_ns(0u)
+    ,waiting(0)
+    ,nNotify(0u)
+    ,wake_request(0u)
     ,run(true)
-    ,processor(pvd::Thread::Config(this, &Collector::process)
-               .name("BSA Processor")
-               .prio(prio))
+    ,executor(executor)
+    ,process_task(*this, &Collector::process_step, prio)
+    ,deliver_task(*this, &Collector::deliver_step, prio)
+    ,tuned(false)
+    ,spill_bytes(0u)
+    ,spill_changed(false)
+    ,max_events(Limits().maxEvents())
+    ,spill_enabled(false)
+    ,spill_horizon(epicsUInt64(-1))
+    ,nworkers(std::max(size_t(1u), nworkers))
+    ,prio(prio)
+    ,pvnames(names)
+    ,notifying(0)
+    ,relayout(0)
+    ,phase(0)
+    ,pending(0u)
+    ,flush_key(0u)
+    ,flush_all(false)
+    ,idle(false)
     ,oldest_key(0u)
+    ,delivery(16u)
+    ,delivered(16u)
 {
     REFTRACE_INCREMENT(num_instances);
 
+    for(size_t k=0; k<EvictPolicy::nKinds; k++)
+        nEvicted[k] = nEvictedBase[k] = 0u;
+
     pvs.resize(names.size());
 
-    for(size_t i=0, N=names.size(); i<N; i++)
+    // before Subscriptions, which may call notEmpty() immediately
+    layout();
+
     {
-        pvs[i].sub.reset(new Subscription(ctxt, i, names[i], *this));
+        std::vector<char> added(names.size(), 0);
+        try {
+            subscribe(pvs, names, added);
+        } catch(...) {
+            // no destructor to stop the shard workers, which reference *this
+            for(size_t i=0, N=names.size(); i<N; i++) {
+                if(added[i])
+                    pvs[i].sub->close();
+            }
+            ctxt.sync();
+            stop_shards();
+            REFTRACE_DECREMENT(num_instances);
+            throw;
+        }
     }
 
-    processor.start();
+    {
+        // enough for a full events buffer.  Grows if needed.
+        const size_t nslices = max_events+1u;
+        slice_arena.resize(nslices);
+        for(size_t i=0; i<nslices; i++)
+            slice_arena[i].resize(pvs.size());
+        completed.reserve(nslices);
+    }
+
+    deliver_after.secPastEpoch = deliver_after.nsec = 0u;
+
+    if(executor) {
+        executor->schedule(process_task);
+
+    } else {
+        processor.reset(new pvd::Thread(pvd::Thread::Config(this, &Collector::process)
+                                        .name("BSA Processor")
+                                        .prio(prio)
+                                        .autostart(false)));
+        deliverer.reset(new pvd::Thread(pvd::Thread::Config(this, &Collector::deliver)
+                                        .name("BSA Deliver")
+                                        .prio(prio)
+                                        .autostart(false)));
+        deliverer->start();
+        processor->start();
+    }
 }
 
 Collector::~Collector()
@@ -58,29 +281,374 @@ void Collector::close()
     for(size_t i=0, N=pvs.size(); i<N; i++) {
         pvs[i].sub->close();
     }
+    // no notEmpty() after return
+    ctxt.sync();
 
     {
         Guard G(mutex);
         run = false;
     }
-    wakeup.signal();
-    processor.exitWait();
+    if(executor) {
+        executor->cancel(process_task);
+    } else {
+        wakeup.signal();
+        processor->exitWait();
+    }
+
+    // processor is stopped, so no phase is running
+    stop_shards();
+
+    if(executor) {
+        executor->cancel(deliver_task);
+    } else {
+        deliver_wakeup.signal();
+        deliverer->exitWait();
+    }
 }
 
-void Collector::notEmpty(Subscription *sub)
+void Collector::layout()
 {
-    bool wakeme;
+    shards.clear();
+
+    // at least one column per shard
+    const size_t nshards = std::max(size_t(1u), std::min(nworkers, pvs.size()));
+    shard_width = std::max(size_t(1u), (pvs.size()+nshards-1u)/nshards);
+
+    for(size_t begin=0u, n=0u; n==0u || begin<pvs.size(); begin+=shard_width, n++) {
+        const size_t end = std::min(begin+shard_width, pvs.size());
+        shards.push_back(std::tr1::shared_ptr<Shard>(new Shard(*this, n, begin, end, prio)));
+    }
+
+    for(size_t s=0u; s<shards.size(); s++) {
+        Shard& shard = *shards[s];
+
+        for(size_t i=shard.begin; i<shard.end; i++) {
+            // visit all in the first dequeue(), in case a notEmpty() was skipped during setNames()
+            pvs[i].ready = 1;
+            shard.active.push_back(i);
+            shard.fill.expect(i - shard.begin, pvs[i].connected);
+        }
+
+        if(bsasRTMemLock) {
+            // allocate now for a full events buffer, instead of while running
+            shard.merger.reserve(max_events);
+            shard.batch.reserve(max_events);
+        }
+
+        if(shard.worker.get())
+            shard.worker->start();
+    }
+}
+
+void Collector::subscribe(pvs_t& list, const names_t& names, std::vector<char>& added)
+{
+    epicsAtomicSetSizeT(&connect_start, size_t(epicsMonotonicGet()/1000000u));
+
+    // attach once for all.  Flush each batch, so that searches are sent while the rest are created
+    CAContext::Attach A(ctxt);
+    size_t ncreated = 0u;
+
+    for(size_t i=0, N=names.size(); i<N; i++) {
+        if(list[i].sub)
+            continue;
+        list[i].sub.reset(new Subscription(ctxt, i, names[i], *this));
+        added[i] = 1;
+
+        if(collectorCaConnectBatch>0 && ++ncreated%size_t(collectorCaConnectBatch)==0u)
+            ctxt.flush();
+    }
+    ctxt.flush();
+}
+
+void Collector::stop_shards()
+{
+    phase = 0;
+    for(size_t s=1u; s<shards.size(); s++) {
+        shards[s]->start.signal();
+        shards[s]->worker->exitWait();
+    }
+}
+
+bool Collector::setNames(const names_t& names)
+{
+    std::vector<std::tr1::shared_ptr<Subscription> > removed;
+    std::vector<std::string> recvnames(names.begin(), names.end());
+    receivers_t recvs;
+
     {
+        // exclude deliverer, then processor.  Same order as deliver_pass()
+        Guard D(deliver_mutex);
         Guard G(mutex);
-        pvs[sub->column].ready = true;
-        wakeme = waiting;
+
+        if(!run)
+            return false;
+
+        for(size_t s=0; s<shards.size(); s++) {
+            if(!shards[s]->spill.empty())
+                return false; // spill logs refer to the current columns
+        }
+
+        // flush and deliver everything staged, with the current columns
+        flush_all = true;
+        process_test();
+        flush_all = false;
+
+        while(!completed.empty()) {
+            const size_t ncomplete = completed.size();
+            if(delivery.push(completed)) {
+                nComplete += ncomplete;
+                completed.clear();
+            } else {
+                deliver_pass(); // make room
+            }
+        }
+        while(deliver_pass()) {}
+
+        // stop notEmpty().  Any skipped are made up by layout()
+        epicsAtomicCmpAndSwapIntT(&relayout, 0, 1);
+        while(epicsAtomicGetIntT(&notifying))
+            epicsThreadSleep(0.0);
+
+        pvs_t next(names.size());
+        {
+            // first occurrence of each current name
+            std::map<std::string, size_t> current;
+            for(size_t j=0, J=pvs.size(); j<J; j++)
+                current.insert(std::make_pair(pvs[j].sub->pvname, j));
+
+            std::vector<char> kept(pvs.size(), 0);
+            for(size_t i=0, N=names.size(); i<N; i++) {
+                std::map<std::string, size_t>::const_iterator it(current.find(names[i]));
+                if(it==current.end() || kept[it->second])
+                    continue;
+                PV& pv = pvs[it->second];
+                kept[it->second] = 1;
+                next[i].sub = pv.sub;
+                next[i].connected = pv.connected;
+            }
+
+            for(size_t j=0, J=pvs.size(); j<J; j++) {
+                if(!kept[j])
+                    removed.push_back(pvs[j].sub);
+            }
+        }
+
+        std::vector<char> added(names.size(), 0);
+        try {
+            subscribe(next, names, added);
+        } catch(...) {
+            for(size_t i=0, N=names.size(); i<N; i++) {
+                if(added[i])
+                    next[i].sub->close();
+            }
+            ctxt.sync();
+            epicsAtomicCmpAndSwapIntT(&relayout, 1, 0);
+            for(size_t j=0, J=pvs.size(); j<J; j++)
+                notEmpty(pvs[j].sub.get());
+            throw;
+        }
+
+        for(size_t k=0; k<removed.size(); k++)
+            removed[k]->close();
+        // before columns change
+        ctxt.sync();
+
+        stop_shards();
+
+        pvs.swap(next);
+        for(size_t i=0, N=pvs.size(); i<N; i++)
+            pvs[i].sub->column = i;
+        pvnames = names;
+
+        layout();
+
+        // new shards need new spill logs
+        spill_enabled = false;
+        spill_changed = spill_bytes!=0u;
+
+        epicsAtomicCmpAndSwapIntT(&relayout, 1, 0);
+
+        recvs = receivers;
+
+        {
+            // Without the processor lock, as add_receiver().  The processor may complete slices
+            // of the new columns, but D keeps the deliverer from passing them on until after this.
+            UnGuard U(G);
+            for(receivers_t::iterator it(recvs.begin()), end(recvs.end()); it!=end; ++it)
+                (*it)->names(recvnames);
+        }
+
+        if(executor) {
+            executor->schedule(process_task);
+        } else {
+            wakeup.signal();
+        }
     }
+
+    // close()d above.  Free with locks released
+    removed.clear();
+
+    return true;
+}
+
+Collector::names_t Collector::currentNames() const
+{
+    Guard G(mutex);
+    return pvnames;
+}
+
+// on CA worker.  lock free so that CA callbacks never wait for the processor.
+void Collector::notEmpty(Subscription *sub)
+{
+    epicsAtomicIncrIntT(&notifying);
+    if(epicsAtomicGetIntT(&relayout)) {
+        // setNames() in progress.  pvs and shards may be changing.
+        epicsAtomicDecrIntT(&notifying);
+        return;
+    }
+    notify(sub);
+    epicsAtomicDecrIntT(&notifying);
+}
+
+void Collector::notEmpty(Subscription* const* subs, size_t n)
+{
+    epicsAtomicIncrIntT(&notifying);
+    if(epicsAtomicGetIntT(&relayout) || n==0u) {
+        epicsAtomicDecrIntT(&notifying);
+        return;
+    }
+
+    // chain those not already ready, until the shard changes
+    Shard *shard = 0;
+    PV *first = 0, *last = 0;
+    for(size_t i=0; i<n; i++) {
+        const size_t column = subs[i]->column;
+        PV& pv = pvs[column];
+        if(epicsAtomicCmpAndSwapIntT(&pv.ready, 0, 1)!=0)
+            continue;
+
+        Shard *S = shards[column/shard_width].get();
+        if(S!=shard) {
+            if(first)
+                splice(*shard, first, last);
+            shard = S;
+            first = last = 0;
+        }
+        pv.next_ready = first;
+        first = &pv;
+        if(!last)
+            last = &pv;
+    }
+    if(first)
+        splice(*shard, first, last);
+
+    epicsAtomicIncrSizeT(&nNotify);
+    wake(subs[0]->pvname.c_str());
+    epicsAtomicDecrIntT(&notifying);
+}
+
+void Collector::notify(Subscription *sub)
+{
+    PV& pv = pvs[sub->column];
+    if(epicsAtomicCmpAndSwapIntT(&pv.ready, 0, 1)==0) {
+        // not already ready.  push onto ready list of shard
+        splice(*shards[sub->column/shard_width], &pv, &pv);
+    }
+    epicsAtomicIncrSizeT(&nNotify);
+    wake(sub->pvname.c_str());
+}
+
+void Collector::splice(Shard& shard, PV* first, PV* last)
+{
+    EpicsAtomicPtrT head;
+    do {
+        head = epicsAtomicGetPtrT(&shard.ready_list);
+        last->next_ready = static_cast<PV*>(head);
+    } while(epicsAtomicCmpAndSwapPtrT(&shard.ready_list, head, first)!=head);
+}
+
+void Collector::wake(const char *what)
+{
+    // coalesce.  Only signal if the processor is waiting, and no one else has already done so.
+    bool wakeme = epicsAtomicCmpAndSwapIntT(&waiting, 1, 0)==1;
     if(collectorDebug>2)
-        errlogPrintf("## %s notEmpty %s\n", sub->pvname.c_str(), wakeme?" wakeup":"");
-    if(wakeme)
+        errlogPrintf("## %s notEmpty %s\n", what, wakeme?" wakeup":"");
+    if(!wakeme)
+        return;
+
+    epicsAtomicSetSizeT(&wake_request, size_t(epicsMonotonicGet()));
+
+    if(executor) {
+        executor->schedule(process_task);
+    } else {
         wakeup.signal();
+    }
+}
+
+
+void Collector::setLimits(const Limits& L)
+{
+    Guard G(mutex);
+    limits = L;
+    tuned = true;
+}
+
+Collector::Limits Collector::currentLimits() const
+{
+    Guard G(mutex);
+    return tuned ? limits : Limits();
+}
+
+void Collector::setEvictPolicy(const EvictPolicy& P)
+{
+    Guard G(mutex);
+    evict_policy = P;
+}
+
+EvictPolicy Collector::currentEvictPolicy() const
+{
+    Guard G(mutex);
+    return evict_policy;
+}
+
+void Collector::setSpill(const std::string& path, size_t bytes)
+{
+    Guard G(mutex);
+    spill_path = path;
+    spill_bytes = bytes;
+    spill_changed = true;
 }
 
+// on processor, with mutex locked
+void Collector::spill_open()
+{
+    for(size_t s=0; s<shards.size(); s++) {
+        if(!shards[s]->spill.empty())
+            return; // wait for replay to complete
+    }
+    spill_changed = false;
+
+    spill_enabled = false;
+    for(size_t s=0; s<shards.size(); s++)
+        shards[s]->spill.close();
+
+    if(!spill_bytes)
+        return;
+
+    try {
+        for(size_t s=0; s<shards.size(); s++) {
+            std::ostringstream name;
+            name<<spill_path<<"."<<s;
+            shards[s]->spill.open(name.str(), spill_bytes/shards.size());
+        }
+        spill_enabled = true;
+
+    } catch(std::exception& e) {
+        errlogPrintf("%s : spill disabled\n", e.what());
+        for(size_t s=0; s<shards.size(); s++)
+            shards[s]->spill.close();
+    }
+}
 
 void Collector::add_receiver(Receiver* recv)
 {
@@ -105,224 +673,731 @@ void Collector::remove_receiver(Receiver* recv)
     receivers_changed = true;
 }
 
+void Collector::run_phase(void (Shard::*fn)())
+{
+    phase = fn;
+    epicsAtomicSetSizeT(&pending, shards.size());
+
+    for(size_t s=1u; s<shards.size(); s++)
+        shards[s]->start.signal();
+
+    (shards[0].get()->*fn)();
+
+    // last to complete signals, unless that was us
+    if(epicsAtomicDecrSizeT(&pending)!=0u)
+        done.wait();
+}
+
 void Collector::process()
 {
+    RealTime::apply(RealTime::Processor);
+
     Guard G(mutex);
 
+    while(run) {
+        const size_t notified = epicsAtomicGetSizeT(&nNotify);
+
+        const bool willwait = process_pass();
+
+        UnGuard U(G);
+
+        if(willwait && prepare_wait(notified)) {
+            wakeup.wait();
+        }
+    }
+}
+
+// as Executor Task
+void Collector::process_step()
+{
+    Guard G(mutex);
+
+    if(!run)
+        return;
+
+    const size_t notified = epicsAtomicGetSizeT(&nNotify);
+
+    const bool willwait = process_pass();
+
+    UnGuard U(G);
+
+    if(!willwait || !prepare_wait(notified)) {
+        // more to do.  Requeue, after any other ready Tasks of our priority.
+        executor->schedule(process_task);
+    }
+}
+
+// One pass through dequeue, test, and handoff to deliverer.
+// Returns true if all input queues were emptied
+bool Collector::process_pass()
+{
+    // with mutex locked
+    pass_limits = tuned ? limits : Limits();
+    max_events = pass_limits.maxEvents();
+    pass_evict = evict_policy;
+    if(spill_changed)
+        spill_open();
+
+    const size_t request = epicsAtomicGetSizeT(&wake_request);
+    if(request && epicsAtomicCmpAndSwapSizeT(&wake_request, request, 0u)==request)
+        wake_latency.add(size_t(epicsMonotonicGet()) - request);
+
     epicsTimeGetCurrent(&now);
 
-    while(run) {
-        waiting = false; // set if input queues emptied
+    if(collectorDebug>2) {
+        char buf[30];
+        epicsTimeToStrftime(buf, sizeof(buf), "%H:%M:%S.%f", &now);
+        errlogPrintf("## processor wakeup %s\n", buf);
+    }
+
+    now_key = now.secPastEpoch;
+    now_key <<= 32;
+    now_key |= now.nsec;
 
-        if(collectorDebug>2) {
-            char buf[30];
-            epicsTimeToStrftime(buf, sizeof(buf), "%H:%M:%S.%f", &now);
-            errlogPrintf("## processor wakeup %s\n", buf);
+    // reclaim delivered slices
+    while(delivered.pop(recycle)) {
+        for(size_t i=0, N=recycle.size(); i<N; i++) {
+            give_slice(recycle[i].second);
         }
+    }
 
-        now_key = now.secPastEpoch;
-        now_key <<= 32;
-        now_key |= now.nsec;
+    process_dequeue();
+    process_test();
+
+    if(!completed.empty()) {
+        const size_t ncomplete = completed.size();
+        // Hand off to deliverer.  If it is still busy with previous slices, then hold
+        // these, and add to them, until it catches up.
+        if(delivery.push(completed)) {
+            nComplete += ncomplete;
+            wake_deliverer();
+            if(completed.capacity() < recycle.capacity())
+                completed.swap(recycle);
+            completed.clear();
+        }
+    }
 
-        process_dequeue();
-        process_test();
+    return idle;
+}
 
+// Called after emptying all input queues.  Returns true if the next notEmpty() will wake the processor,
+// or false if there has been a notEmpty() since 'notified', and so another pass is needed.
+bool Collector::prepare_wait(size_t notified)
+{
+    // CAS implies a full barrier, so our test of nNotify can't be reordered before setting 'waiting'
+    epicsAtomicCmpAndSwapIntT(&waiting, 0, 1);
+    // any notEmpty() during or since the last dequeue will be handled by the next pass.
+    if(epicsAtomicGetSizeT(&nNotify)==notified)
+        return true;
+    // If a notEmpty() has already cleared 'waiting', then it has also signaled/scheduled,
+    // so waiting consumes this and avoids a spurious wakeup.
+    return epicsAtomicCmpAndSwapIntT(&waiting, 1, 0)==0;
+}
+
+void Collector::process_dequeue()
+{
+    bool full, busy;
+    do {
+        run_phase(&Shard::dequeue);
+
+        // Shards drain concurrently, so an update may be queued to one which has already finished
+        // while another dequeues a newer update.  Repeat until no shard finds anything, so that
+        // all queues are seen to be empty together, as with a single shard.
+        full = busy = false;
+        idle = true;
+        for(size_t s=0; s<shards.size(); s++) {
+            full |= shards[s]->full;
+            idle &= shards[s]->idle;
+            busy |= shards[s]->ndequeued!=0u;
+            nLate += shards[s]->nlate;
+            nSpilled += shards[s]->nspilled;
+            nReplayed += shards[s]->nreplayed;
+            nSpillDrop += shards[s]->nspilldrop;
+        }
+    } while(busy && !full && shards.size()>1u);
+
+    if(full) {
+        if(collectorDebug>0) {
+            errlogPrintf("## Overflow process_dequeue() after staging %zu events\n", max_events);
+        }
+        nOverflow++;
+    }
+
+    // overflowed event buffer.
+
+    if(full && spill_enabled) {
+        // keep everything queued, to be replayed later
+        run_phase(&Shard::spill_queues);
+
+        for(size_t s=0; s<shards.size(); s++) {
+            nSpilled += shards[s]->nspilled;
+            nSpillDrop += shards[s]->nspilldrop;
+        }
+
+    } else if(full) {
+        // the policy chooses which queued updates of each PV are carried over
+
+        evict_keys.clear();
+        for(size_t s=0; s<shards.size(); s++)
+            evict_keys.insert(evict_keys.end(), shards[s]->keys.begin(), shards[s]->keys.end());
+        std::sort(evict_keys.begin(), evict_keys.end());
+        evict_keys.erase(std::unique(evict_keys.begin(), evict_keys.end()), evict_keys.end());
+
+        run_phase(&Shard::evict);
+
+        for(size_t s=0; s<shards.size(); s++) {
+            epicsAtomicAddSizeT(&nEvicted[pass_evict.kind], shards[s]->nevicted);
+            nLate += shards[s]->nlate;
+        }
+    }
+
+    spill_horizon = epicsUInt64(-1);
+    spill_used = 0u;
+    for(size_t s=0; s<shards.size(); s++) {
+        const SpillLog& spill = shards[s]->spill;
+        spill_used += spill.size();
+        if(!spill.empty()) {
+            spill_horizon = std::min(spill_horizon, spill.frontKey());
+            idle = false; // not until replay completes
+        }
+    }
+
+    if(spill_horizon!=epicsUInt64(-1) && now_key > spill_horizon) {
+        const epicsUInt64 lag = now_key - spill_horizon;
+        epicsAtomicSetSizeT(&replay_lag_ms, size_t((lag>>32)*1000u + (((lag&0xffffffff)*1000u)>>32)));
+    } else {
+        epicsAtomicSetSizeT(&replay_lag_ms, 0u);
+    }
+}
+
+void Collector::process_test()
+{
+    const double maxEventAge = pass_limits.maxEventAge;
+    epicsUInt64 max_age = maxEventAge;
+    max_age <<= 32;
+    max_age |= epicsUInt32(1000000000u * fmod(maxEventAge, 1.0));
+
+    // completed may already hold slices not yet accepted by the deliverer
+
+    // Emit slices in key order.  Flush all but the newest event,
+    // which is held until complete or too old.
+
+    bool staged = false;
+    epicsUInt64 newest = 0u;
+    for(size_t s=0; s<shards.size(); s++) {
+        staged |= !shards[s]->merger.empty();
+        newest = std::max(newest, shards[s]->merger.newest());
+    }
+
+    if(!staged) {
+        flush_keys.clear();
+        return;
+    }
+
+    flush_key = newest;
+
+    bool newest_staged = false;
+    for(size_t s=0; !newest_staged && s<shards.size(); s++)
+        newest_staged = !shards[s]->keys.empty() && shards[s]->keys.back()==newest;
+
+    if(flush_all) {
+        // setNames().  everything, complete or not
+
+    } else if(newest >= spill_horizon) {
+        // hold slices which may still have values in a spill log
+        flush_key = spill_horizon-1u;
+
+    } else if(newest_staged && newest > oldest_key) {
+        // flush if
+
+        // * slice key is too old
+        epicsInt64 key_age = epicsInt64(now_key) - epicsInt64(newest);
+
+        if(key_age >= epicsInt64(max_age)) {
+            if(collectorDebug > 0) {
+                errlogPrintf("## test slice %llx too old %llx >= %llx\n", newest, key_age, max_age);
+            }
+            nAged++;
+
+        } else {
+            // * all PVs are either disconnected or have data
+            size_t missing = 0u;
+            for(size_t s=0; s<shards.size(); s++) {
+                const SliceFill& fill = shards[s]->fill;
+                missing += fill.key()==newest ? fill.missing() : fill.expecting();
+            }
+
+            if(missing) {
+                if(collectorDebug > 1) {
+                    errlogPrintf("## test slice %llx found incomplete, missing %zu\n",
+                                 newest, missing);
+                }
+                flush_key--;
+            }
+        }
+    }
+
+    // union of keys to flush
+    flush_keys.clear();
+    for(size_t s=0; s<shards.size(); s++) {
+        const std::vector<epicsUInt64>& keys = shards[s]->keys;
+        for(size_t k=0, K=keys.size(); k<K && keys[k]<=flush_key; k++) {
+            if(keys[k] > oldest_key)
+                flush_keys.push_back(keys[k]);
+        }
+    }
+    std::sort(flush_keys.begin(), flush_keys.end());
+    flush_keys.erase(std::unique(flush_keys.begin(), flush_keys.end()), flush_keys.end());
+
+    for(size_t k=0, K=flush_keys.size(); k<K; k++) {
+        if(collectorDebug>4) {
+            errlogPrintf("## complete key %llx\n", flush_keys[k]);
+        }
+
+        completed.push_back(Receiver::slices_t::value_type(flush_keys[k], Receiver::slice_t()));
+        take_slice(completed.back().second);
+    }
+
+    // each shard fills in its columns
+    run_phase(&Shard::assemble);
+
+    if(!completed.empty())
+        oldest_key = completed.back().first;
+
+    if(collectorDebug>3) {
+        if(flush_keys.empty()) {
+            errlogPrintf("## No events complete\n");
+        } else {
+            errlogPrintf("## %zu events complete\n", flush_keys.size());
+        }
+    }
+}
+
+void Collector::wake_deliverer()
+{
+    if(executor) {
+        executor->schedule(deliver_task);
+    } else {
+        deliver_wakeup.signal();
+    }
+}
+
+void Collector::deliver()
+{
+    RealTime::apply(RealTime::Processor);
+
+    while(true) {
+        deliver_wakeup.wait();
+        double holdoff;
+        {
+            Guard G(mutex);
+            if(!run)
+                break;
+            holdoff = tuned ? limits.flushPeriod : bsasFlushPeriod;
+        }
+
+        bool delivered;
+        {
+            Guard D(deliver_mutex);
+            delivered = deliver_pass();
+        }
+        if(delivered)
+            epicsThreadSleep(holdoff);
+    }
+}
+
+// as Executor Task
+void Collector::deliver_step()
+{
+    double period;
+    {
+        Guard G(mutex);
+        if(!run)
+            return;
+        period = tuned ? limits.flushPeriod : bsasFlushPeriod;
+    }
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    double holdoff = epicsTimeDiffInSeconds(&deliver_after, &now);
+    if(holdoff > 0.0) {
+        // woken early.  wait out flush holdoff
+        executor->schedule(deliver_task, holdoff);
+
+    } else {
+        bool delivered;
+        {
+            Guard D(deliver_mutex);
+            delivered = deliver_pass();
+        }
+        if(!delivered)
+            return;
+        deliver_after = now;
+        epicsTimeAddSeconds(&deliver_after, period);
+        // deliver anything completed during holdoff
+        executor->schedule(deliver_task, period);
+    }
+}
+
+// Returns true if anything was delivered
+bool Collector::deliver_pass()
+{
+    Receiver::slices_t batch, more;
+
+    {
+        Guard G(mutex);
         if(receivers_changed) {
             // copy for use while unlocked
             receivers_shadow = receivers;
             receivers_changed = false;
         }
+    }
 
-        bool willwait = waiting;
-        {
-            nComplete += completed.size();
-            UnGuard U(G);
+    // combine everything completed since the last delivery
+    while(delivery.pop(more)) {
+        if(batch.empty()) {
+            batch.swap(more);
 
-            if(!completed.empty()) {
-                for(receivers_t::iterator it(receivers_shadow.begin()), end(receivers_shadow.end()); it!=end; ++it) {
-                    (*it)->slices(completed);
-                }
-                epicsThreadSleep(bsasFlushPeriod);
+        } else {
+            for(size_t i=0, N=more.size(); i<N; i++) {
+                batch.push_back(Receiver::slices_t::value_type(more[i].first, Receiver::slice_t()));
+                batch.back().second.swap(more[i].second);
             }
-
-            if(willwait)
-                wakeup.wait();
-            epicsTimeGetCurrent(&now);
         }
     }
+
+    if(batch.empty())
+        return false;
+
+    const epicsUInt64 start = epicsMonotonicGet();
+
+    for(receivers_t::iterator it(receivers_shadow.begin()), end(receivers_shadow.end()); it!=end; ++it) {
+        (*it)->slices(batch);
+    }
+
+    const size_t elapsed = size_t(epicsMonotonicGet() - start);
+    if(elapsed > epicsAtomicGetSizeT(&deliver_max_ns))
+        epicsAtomicSetSizeT(&deliver_max_ns, elapsed);
+
+    for(size_t i=0, N=batch.size(); i<N; i++) {
+        Receiver::slice_t& slice = batch[i].second;
+        for(size_t c=0, C=slice.size(); c<C; c++)
+            slice[c].reset();
+    }
+
+    // return for reuse.  If the processor is not keeping up, then just free.
+    delivered.push(batch);
+
+    return true;
 }
 
-void Collector::process_dequeue()
+Collector::Shard::Shard(Collector& collector, size_t index, size_t begin, size_t end, unsigned int prio)
+    :collector(collector)
+    ,begin(begin)
+    ,end(end)
+    ,ready_list(0)
+    ,merger(end-begin)
+    ,fill(end-begin)
+    ,idle(false)
+    ,full(false)
+    ,ndequeued(0u)
+    ,nlate(0u)
+    ,nevicted(0u)
+    ,nspilled(0u)
+    ,nreplayed(0u)
+    ,nspilldrop(0u)
+    ,to_spill(end-begin)
+    ,spill_slice(end-begin)
+{
+    active.reserve(end-begin);
+    if(index>0u) {
+        worker.reset(new pvd::Thread(pvd::Thread::Config(this, &Shard::work)
+                                     .prio(prio)
+                                     .autostart(false)
+                                     <<"BSA Shard "<<index));
+    }
+}
+
+void Collector::Shard::work()
+{
+    RealTime::apply(RealTime::Processor);
+
+    while(true) {
+        start.wait();
+
+        void (Shard::*fn)() = collector.phase;
+        if(!fn)
+            break;
+
+        (this->*fn)();
+
+        if(epicsAtomicDecrSizeT(&collector.pending)==0u)
+            collector.done.signal();
+    }
+}
+
+void Collector::Shard::dequeue()
 {
+    pvs_t& pvs = collector.pvs;
+
     // process input queues
     bool nothing = false; // true if all queues empty
+    full = false;
+    ndequeued = 0u;
+    nlate = 0u;
+    nspilled = nreplayed = nspilldrop = 0u;
+
+    // older than anything queued
+    replay();
+
     // break if:
     // * nothing to do
-    // * # of potentially complete events exceeds limit
-    unsigned maxEvents = std::max(10.0, std::min(maxEventRate*bsasFlushPeriod, 5000.0));
-    while(!nothing && events.size() < maxEvents) {
+    // * # of potentially complete events for some PV exceeds limit
+    const size_t nevents = collector.max_events;
+    while(!nothing && !full) {
         nothing = true;
 
-        for(size_t i=0, N=pvs.size(); i<N; i++) {
+        {
+            // take newly ready PVs
+            EpicsAtomicPtrT head;
+            do {
+                head = epicsAtomicGetPtrT(&ready_list);
+            } while(head && epicsAtomicCmpAndSwapPtrT(&ready_list, head, 0)!=head);
+
+            for(PV *pv = static_cast<PV*>(head); pv; pv = pv->next_ready) {
+                active.push_back(pv - &pvs[0]);
+            }
+        }
+
+        // visit only ready PVs.  Those found empty are removed.
+        size_t nactive = 0u;
+        for(size_t a=0, A=active.size(); a<A; a++) {
+            const size_t i = active[a];
+            const size_t col = i - begin;
             PV& pv = pvs[i];
 
-            if((i!=0 && !pv.ready) || !pv.sub) continue;
+            if(!pv.sub) continue;
+
+            // once anything is spilled, everything is until replay catches up
+            const bool spilling = !spill.empty();
 
-            DBRValue val(pv.sub->pop());
-            if(!val.valid()) {
-                pv.ready = false;
+            const size_t staged = merger.staged(col);
+            if(!spilling && staged >= nevents) {
+                full |= !pv.sub->values.empty();
+                active[nactive++] = i;
                 continue;
             }
-            pv.ready = true;
-
-            nothing = false; // we will do something
 
-            epicsUInt64 key = val->ts.secPastEpoch;
-            key <<= 32;
-            key |= val->ts.nsec;
+            batch.clear();
+            if(!pv.sub->pop(batch, spilling ? size_t(-1) : nevents - staged)) {
+                epicsAtomicSetIntT(&pv.ready, 0);
+                // raced with a push() ?  If so, keep unless a notEmpty() has already put it back on ready_list
+                if(!pv.sub->arm() && epicsAtomicCmpAndSwapIntT(&pv.ready, 0, 1)==0) {
+                    active[nactive++] = i;
+                    nothing = false;
+                }
+                continue;
+            }
 
-            pv.connected = val->sevr<=3;
+            active[nactive++] = i;
+            nothing = false; // we will do something
+            ndequeued += batch.size();
 
-            if(collectorDebug>3) {
-                errlogPrintf("## %s event:%llx sevr %u\n", pv.sub->pvname.c_str(), key, val->sevr);
+            for(size_t b=0, B=batch.size(); b<B; b++) {
+                if(spilling)
+                    spill_value(i, batch[b]);
+                else
+                    stage(i, batch[b]);
             }
+        }
+        active.resize(nactive);
 
-            if(!pv.connected || key > oldest_key) {
-                // data event
+        // something may have become ready while we were busy
+        nothing &= !epicsAtomicGetPtrT(&ready_list);
+    }
 
-                // create/update a slice
+    spill_flush();
 
-                events_t::mapped_type& slice = events[key]; // implicitly allocs new slice
-                slice.resize(pvs.size());
+    idle = nothing;
+}
 
-                if(slice[i].valid()) {
-                    if(collectorDebug>=0) {
-                        errlogPrintf("%s : ignore duplicate key %llx\n", pvs[i].sub->pvname.c_str(), key);
-                    }
+void Collector::Shard::stage(size_t i, DBRValue& val)
+{
+    PV& pv = collector.pvs[i];
+    const size_t col = i - begin;
 
-                } else {
-                    slice[i].swap(val);
-                }
+    const epicsUInt64 key = key_of(val);
 
-            } else if(pv.connected) {
-                // disconnect event
-            } else if(collectorDebug>0) {
-                errlogPrintf("## %s ignore leftovers of %llx\n", pvs[i].sub->pvname.c_str(), key);
-            }
-        }
+    pv.connected = val->sevr<=3;
+    fill.expect(col, pv.connected);
+
+    if(collectorDebug>3) {
+        errlogPrintf("## %s event:%llx sevr %u\n", pv.sub->pvname.c_str(), key, val->sevr);
     }
 
-    if(!nothing) {
-        if(collectorDebug>0) {
-            errlogPrintf("## Overflow process_dequeue() after building %zu events\n", events.size());
-        }
-        nOverflow++;
-        // overflowed event buffer.
-        // only carry over 4 events per PV
+    if(!pv.connected || key > collector.oldest_key) {
+        // data event
 
-        for(size_t i=0, N=pvs.size(); i<N; i++) {
-            PV& pv = pvs[i];
-            if(pv.sub) {
-                pv.sub->clear(4);
+        if(merger.push(col, key, val)) {
+            fill.fill(col, key);
+
+            if(keys.empty() || key > keys.back()) {
+                keys.push_back(key);
+            } else {
+                std::vector<epicsUInt64>::iterator it(std::lower_bound(keys.begin(), keys.end(), key));
+                if(*it!=key)
+                    keys.insert(it, key);
             }
+
+        } else if(collectorDebug>=0) {
+            errlogPrintf("%s : ignore duplicate key %llx\n", pv.sub->pvname.c_str(), key);
         }
 
+    } else if(pv.connected) {
+        // data for a slice already flushed.  arrived too late.
+        nlate++;
+    } else if(collectorDebug>0) {
+        errlogPrintf("## %s ignore leftovers of %llx\n", pv.sub->pvname.c_str(), key);
     }
-
-    waiting = nothing; // wait if we emptied all queues
 }
 
-void Collector::process_test()
+// after overflow.  Drain all input queues, staging only what the policy selects
+void Collector::Shard::evict()
 {
-    epicsUInt64 max_age = maxEventAge;
-    max_age <<= 32;
-    max_age |= epicsUInt32(1000000000u * fmod(maxEventAge, 1.0));
+    const EvictPolicy& policy = collector.pass_evict;
+    nevicted = 0u;
+    nlate = 0u;
 
-    events_t::iterator first_partial(events.end()); // first element _not_ to flush.
+    for(size_t i=begin; i<end; i++) {
+        PV& pv = collector.pvs[i];
+        if(!pv.sub) continue;
 
-    size_t e=events.size();
-    {
-        // iterate from newest.  Find most recent incomplete/partial event.
-        events_t::reverse_iterator it(events.rbegin()), end(events.rend());
-        for(; it!=end; ++it, e--) {
-            // flush if
+        batch.clear();
+        const size_t n = pv.sub->pop(batch, size_t(-1));
+        if(!n) continue;
 
-            // * slice key is too old
-            epicsInt64 key_age = epicsInt64(now_key) - epicsInt64(it->first);
+        policy.select(batch, collector.evict_keys);
 
-            if(key_age >= epicsInt64(max_age)) {
-                if(collectorDebug > (e<=4 && events.size()>4 ? 4 : 0)) {
-                    errlogPrintf("## test slice %llx too old %llx >= %llx\n", it->first, key_age, max_age);
-                }
-                // everything earlier is also too old.  We will flush all.
-                break;
-            }
+        nevicted += n - batch.size();
 
-            // * all PVs are either disconnected or have data
-            const events_t::mapped_type& slice = it->second;
-            // test if all data available or disconnected
-            bool complete = true;
-            for(size_t i=0, N=pvs.size(); complete && i<N; i++) {
-                complete = !pvs[i].connected || slice[i].valid();
-
-                if(!complete && collectorDebug > (e<=4 && events.size()>4 ? 4 : 1)) {
-                    errlogPrintf("## test slice %llx found incomplete %s %sconn %svalid\n",
-                                 it->first, pvs[i].sub->pvname.c_str(),
-                                 !pvs[i].connected?"dis":"",
-                                 slice[i].valid()?"":"in");
-                }
-            }
+        for(size_t b=0, B=batch.size(); b<B; b++) {
+            stage(i, batch[b]);
+        }
+    }
+}
 
-            if(!complete) {
-                // found it
-                first_partial = --it.base();
-                assert(it->first==first_partial->first);
-                break;
+void Collector::Shard::spill_value(size_t i, DBRValue& val)
+{
+    if(!to_spill.push(i - begin, key_of(val), val) && collectorDebug>=0) {
+        errlogPrintf("%s : ignore duplicate key %llx\n", collector.pvs[i].sub->pvname.c_str(), key_of(val));
+    }
+}
+
+// In key order, as one run of the spill log.  Runs are merged by key on replay, so
+// that the front of the spill log is the flush horizon for process_test()
+void Collector::Shard::spill_flush()
+{
+    if(!to_spill.empty())
+        spill.mark();
+    while(!to_spill.empty()) {
+        to_spill.pop(&spill_slice);
+
+        for(size_t c=0, C=spill_slice.size(); c<C; c++) {
+            if(!spill_slice[c].valid())
+                continue;
+
+            if(spill.push(begin+c, spill_slice[c])) {
+                nspilled++;
+            } else {
+                // spill log full
+                nspilldrop++;
+                epicsAtomicIncrSizeT(&collector.pvs[begin+c].sub->counters.nOverflows);
             }
+            spill_slice[c].reset();
         }
     }
+}
 
-    completed.clear(); // paranoia, should already be empty
+void Collector::Shard::replay()
+{
+    const size_t nevents = collector.max_events;
 
-    // 'it' points to first element _not_ to remove
+    while(!spill.empty()) {
+        const size_t i = spill.frontColumn();
+        if(merger.staged(i - begin) >= nevents)
+            break; // wait for this column to be flushed
 
-    if(collectorDebug>3) {
-        if(first_partial==events.begin() || events.empty()) {
-            errlogPrintf("## No events complete\n");
-        } else {
-            errlogPrintf("## %zu events complete\n", events.size()-e);
-        }
+        DBRValue val(spill.pop(collector.pvs[i].sub->pool));
+        stage(i, val);
+        nreplayed++;
     }
+}
 
-    // flush all events before the most recent incomplete/partial event
-    events_t::iterator it(events.begin()), end(first_partial);
+// after overflow.  Drain all input queues into spill log
+void Collector::Shard::spill_queues()
+{
+    nspilled = nspilldrop = 0u;
 
-    completed.reserve(events.size()-e);
-    while(it!=end) {
-        events_t::iterator cur = it++;
+    for(size_t i=begin; i<end; i++) {
+        PV& pv = collector.pvs[i];
+        if(!pv.sub) continue;
 
-        if(collectorDebug>4) {
-            errlogPrintf("## complete key %llx\n", cur->first);
+        batch.clear();
+        pv.sub->pop(batch, size_t(-1));
+
+        for(size_t b=0, B=batch.size(); b<B; b++) {
+            spill_value(i, batch[b]);
         }
-        assert(cur->first > oldest_key);
-        oldest_key = cur->first;
+    }
 
-        completed.push_back(*cur);
+    spill_flush();
+}
 
-        events.erase(cur);
-    }
+void Collector::Shard::assemble()
+{
+    const epicsUInt64 flush_key = collector.flush_key,
+                      oldest_key = collector.oldest_key;
+    Receiver::slices_t& completed = collector.completed;
+
+    size_t n = 0u;
+    while(!merger.empty() && merger.oldest() <= flush_key) {
+        const epicsUInt64 key = merger.oldest();
+
+        if(key <= oldest_key) {
+            // disconnect event older than last flush
+            if(collectorDebug>0) {
+                errlogPrintf("## ignore leftovers of %llx\n", key);
+            }
+            merger.pop(0);
+            continue;
+        }
+
+        // completed[] has all flushed keys, in order
+        while(completed[n].first < key)
+            n++;
 
-    if(collectorDebug>0 && events.size()>4) {
-        errlogPrintf("## Overflow process_test() drop %zu after completing %zu events\n",
-                     events.size(), completed.size());
+        merger.pop(&completed[n].second, begin);
     }
 
-    while(events.size()>4) {
-        // only carry over 4 partials
+    keys.erase(keys.begin(), std::upper_bound(keys.begin(), keys.end(), flush_key));
+}
 
-        events.erase(events.begin());
-        nOverflow++;
+void Collector::take_slice(Receiver::slice_t& slice)
+{
+    if(!slice_arena.empty()) {
+        slice.swap(slice_arena.back());
+        slice_arena.pop_back();
     }
+    // arena exhausted, or # of columns changed by setNames()
+    slice.resize(pvs.size());
+}
+
+// slice must already be cleared
+void Collector::give_slice(Receiver::slice_t& slice)
+{
+    slice_arena.push_back(Receiver::slice_t());
+    slice_arena.back().swap(slice);
 }
 
 extern "C" {
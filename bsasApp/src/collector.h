@@ -2,8 +2,8 @@
 #define COLLECTOR_H
 
 #include <vector>
-#include <map>
 #include <set>
+#include <string>
 
 #include <epicsTypes.h>
 #include <epicsEvent.h>
@@ -11,34 +11,109 @@
 #include <pv/sharedPtr.h>
 
 #include "collect_ca.h"
+#include "merger.h"
+#include "executor.h"
+#include "realtime.h"
+#include "spill.h"
 
 struct Receiver {
-    typedef std::vector<std::pair<epicsUInt64, std::vector<DBRValue> > > slices_t;
+    typedef std::vector<DBRValue> slice_t;
+    typedef std::vector<std::pair<epicsUInt64, slice_t> > slices_t;
     virtual ~Receiver() {}
     virtual void names(const std::vector<std::string>& n) =0;
     virtual void slices(const slices_t& s) =0;
 };
 
+/* Which columns have a value for the newest key, and which are expected to (connected).
+ * Updated as values are staged, so that testing completeness doesn't depend on # of columns.
+ */
+struct SliceFill {
+    explicit SliceFill(size_t ncolumns);
+
+    // column has a value for key.  Starts a new slice if key is newer.
+    void fill(size_t column, epicsUInt64 key);
+    // change whether column is expected to have a value
+    void expect(size_t column, bool expected);
+
+    // key of slice being tracked
+    epicsUInt64 key() const { return current; }
+    // # of expected columns without a value
+    size_t missing() const { return nmissing; }
+    // # of expected columns
+    size_t expecting() const { return nexpected; }
+
+private:
+    typedef epicsUInt64 word_t;
+    enum {wbits = 64};
+    // bit-packed column masks
+    std::vector<word_t> present, expected;
+    // columns set in 'present', to clear it without a full scan
+    std::vector<size_t> filled;
+    epicsUInt64 current;
+    size_t nexpected, nmissing;
+
+    static bool test(const std::vector<word_t>& mask, size_t column) {
+        return (mask[column/wbits] >> (column%wbits)) & 1u;
+    }
+    static void set(std::vector<word_t>& mask, size_t column, bool val) {
+        const word_t bit = word_t(1u) << (column%wbits);
+        if(val)
+            mask[column/wbits] |= bit;
+        else
+            mask[column/wbits] &= ~bit;
+    }
+};
+
+/* Which queued values of one PV survive when the Collector events buffer overflows.
+ * Survivors are staged immediately, the others are dropped.
+ */
+struct EvictPolicy {
+    enum Kind {
+        DropOldest, // keep the newest 'keep' values
+        DropNewest, // keep the oldest 'keep' values
+        KeepNth,    // keep every 'nth' value, ending with the newest.  At most 'keep'
+        KeepLikely, // prefer values whose keys are already staged by other columns.  Then the newest.
+        nKinds
+    };
+    Kind kind;
+    size_t keep, nth;
+
+    EvictPolicy() :kind(DropOldest), keep(4u), nth(4u) {}
+
+    static const char* name(Kind kind);
+    // returns nKinds if unknown
+    static Kind parse(const char *name);
+
+    // values of one column, in increasing key order.  'staged' is the sorted set of keys staged for other columns.
+    // Removes those evicted.
+    void select(std::vector<DBRValue>& values, const std::vector<epicsUInt64>& staged) const;
+};
+
 struct Collector
 {
     static size_t num_instances;
 
     typedef epics::pvData::shared_vector<const std::string> names_t;
 
+    // columns are divided between 'nworkers' threads for dequeue and assembly.
+    // If executor!=NULL, then processing and delivery are Tasks run by it, instead of dedicated threads.
     explicit Collector(CAContext &ctxt,
                        const names_t& names,
-                       unsigned int prio);
+                       unsigned int prio,
+                       size_t nworkers = 1u,
+                       Executor *executor = 0);
     ~Collector();
 
     CAContext& ctxt;
 
-    epicsMutex mutex;
+    mutable epicsMutex mutex;
 
     struct PV {
         std::tr1::shared_ptr<Subscription> sub;
-        bool ready;
+        int volatile ready; // set by notEmpty() when added to ready list, cleared by processor
+        PV *next_ready; // ready list link.  Only valid while in ready list
         bool connected;
-        PV() :ready(false), connected(false) {}
+        PV() :ready(0), next_ready(0), connected(false) {}
     };
     typedef std::vector<PV> pvs_t;
     pvs_t pvs;
@@ -48,17 +123,81 @@ struct Collector
     bool receivers_changed;
 
     size_t nComplete, nOverflow;
+    // updates which arrived after their slice was flushed, and newest slices flushed incomplete after maxEventAge
+    size_t nLate, nAged;
+    // values dropped by each EvictPolicy.  Never cleared
+    size_t nEvicted[EvictPolicy::nKinds];
+    // baseline of nEvicted for bsas_report.  Guarded by mutex
+    size_t nEvictedBase[EvictPolicy::nKinds];
+    // values written to spill logs, replayed from them, and dropped because the spill logs were full
+    size_t nSpilled, nReplayed, nSpillDrop;
+    // bytes in spill logs.  Updated each pass
+    size_t spill_used;
+    // age (ms) of oldest value not yet replayed.  0 if none.  Updated each pass
+    size_t replay_lag_ms;
+    // bytes held by DBRValues of this table
+    const std::tr1::shared_ptr<MemAccount> mem;
+    // epicsMonotonicGet() as ms when channels of the current PV list were created.  cf. Subscription::connectedAt
+    size_t volatile connect_start;
+    // longest time (ns) spent in Receivers by one delivery.  Reset by reader
+    size_t volatile deliver_max_ns;
+    // from notEmpty() to start of processing
+    LatencyHistogram wake_latency;
 
     epicsEvent wakeup;
 
-    bool waiting;
+    // set while processor is (about to be) blocked on wakeup.  Only the notEmpty() which clears it will signal.
+    int volatile waiting;
+    // incremented by each notEmpty()
+    size_t volatile nNotify;
+    // epicsMonotonicGet(), truncated, when notEmpty() wakes processor.  0 when not waiting.
+    // Access with epicsAtomic*().  Differences are exact for latencies below 2**32 ns even if size_t is 32 bits.
+    size_t volatile wake_request;
     bool run;
 
-    epics::pvData::Thread processor;
+    Executor * const executor;
+
+    // dequeue and assembly.  Thread or Task
+    epics::auto_ptr<epics::pvData::Thread> processor;
+    MemberTask<Collector> process_task;
+    // delivery to Receivers.  Thread or Task
+    epics::auto_ptr<epics::pvData::Thread> deliverer;
+    MemberTask<Collector> deliver_task;
+
+    // Tunables.  Global defaults, unless overridden by setLimits()
+    struct Limits {
+        double maxEventRate, // with flushPeriod, bounds the # of events staged for each PV
+               maxEventAge,  // timeout to flush partial events
+               flushPeriod;  // holdoff after delivering events
+        // from global defaults
+        Limits();
+        size_t maxEvents() const;
+    };
+    // Override global defaults for this table
+    void setLimits(const Limits& L);
+    Limits currentLimits() const;
+
+    void setEvictPolicy(const EvictPolicy& P);
+    EvictPolicy currentEvictPolicy() const;
+
+    // On overflow, spill queued updates to files "<path>.<shard#>", totaling at most 'bytes',
+    // instead of applying the EvictPolicy.  bytes==0 disables.
+    // Takes effect once any current spill logs are empty.
+    void setSpill(const std::string& path, size_t bytes);
 
     void close();
 
+    /* Change the PV list in place.  PVs in both lists keep their Subscription and queued updates.
+     * Staged events are flushed and delivered first, possibly incomplete.  Receivers then see names().
+     * Returns false, changing nothing, while spilled updates remain to be replayed.  Retry later.
+     */
+    bool setNames(const names_t& names);
+    names_t currentNames() const;
+
     void notEmpty(Subscription* sub);
+    // notEmpty() of several Subscriptions of this Collector.  Splices each run of one shard onto its ready list at once,
+    // and wakes the processor at most once.  Best ordered by column.
+    void notEmpty(Subscription* const* subs, size_t n);
 
     void add_receiver(Receiver*);
     void remove_receiver(Receiver*);
@@ -67,21 +206,162 @@ struct Collector
     inline Subscription* subscription(size_t column) { return pvs[column].sub.get(); }
 
 private:
+    /* A contiguous range of columns, dequeued and partially assembled by one thread.
+     * Shard 0 runs on the processor thread, others have a worker which the processor
+     * starts for each phase, and waits for.
+     */
+    struct Shard {
+        Collector& collector;
+        const size_t begin, end; // columns [begin, end)
+
+        // stack of PVs which notEmpty() has made ready.  PV* pushed by notEmpty(), taken in full by dequeue()
+        EpicsAtomicPtrT volatile ready_list;
+
+        // columns to visit in dequeue().  Those taken from ready_list, until found empty.
+        std::vector<size_t> active;
+        // scratch for bulk dequeue
+        std::vector<DBRValue> batch;
+
+        // values staged for assembly into slices.  Indexed by column-begin
+        Merger merger;
+        // completeness of newest staged slice
+        SliceFill fill;
+        // distinct keys staged in merger, in increasing order
+        std::vector<epicsUInt64> keys;
+
+        bool idle; // set if all input queues emptied
+        bool full; // set if some column has more than we can stage
+        size_t ndequeued; // # of values dequeued by last dequeue()
+        size_t nlate; // # of values too late for their slice by last dequeue()
+        size_t nevicted; // # of values dropped by last evict()
+        size_t nspilled, nreplayed, nspilldrop; // by last dequeue() or spill_queues()
+
+        // While not empty, all dequeued values are appended, and replayed in order as the merger has room.
+        SpillLog spill;
+        // values to be spilled, sorted by key before appending
+        Merger to_spill;
+        std::vector<DBRValue> spill_slice;
+
+        epicsEvent start;
+        epics::auto_ptr<epics::pvData::Thread> worker; // NULL for shard 0
+
+        Shard(Collector& collector, size_t index, size_t begin, size_t end, unsigned int prio);
+
+        // phases
+        void dequeue();
+        void evict();
+        void spill_queues();
+        void assemble();
+
+        // stage one value of column i
+        void stage(size_t i, DBRValue& val);
+        // queue one value of column i to be spilled
+        void spill_value(size_t i, DBRValue& val);
+        // append queued values to spill log, in key order
+        void spill_flush();
+        // stage from spill log until empty, or some column is full
+        void replay();
+
+        void work();
+
+        EPICS_NOT_COPYABLE(Shard)
+    };
+    // guarded by mutex
+    Limits limits;
+    bool tuned; // use limits instead of defaults
+    EvictPolicy evict_policy;
+    std::string spill_path;
+    size_t spill_bytes;
+    bool spill_changed;
+
+    // locals for processor thread.  Latched at start of each pass
+    Limits pass_limits;
+    size_t max_events;
+    EvictPolicy pass_evict;
+    // union of keys staged by all shards, for EvictPolicy::select()
+    std::vector<epicsUInt64> evict_keys;
+    // some shard has an open spill log
+    bool spill_enabled;
+    // slices with keys >= this may still have values in a spill log
+    epicsUInt64 spill_horizon;
+    void spill_open();
+
+    std::vector<std::tr1::shared_ptr<Shard> > shards;
+    size_t shard_width; // # of columns in each shard, except the last
+    const size_t nworkers;
+    const unsigned int prio;
+    // guarded by mutex
+    names_t pvnames;
+
+    // create Subscriptions for entries of list without one, marking them in 'added'
+    void subscribe(pvs_t& list, const names_t& names, std::vector<char>& added);
+    // (re)create shards for pvs.  With processor stopped
+    void layout();
+    void notify(Subscription* sub);
+    // push the chain first -> ... -> last onto the ready list of shard
+    static void splice(Shard& shard, PV* first, PV* last);
+    void wake(const char *what);
+    // stop shard workers.  With processor stopped
+    void stop_shards();
+
+    // # of notEmpty() in progress
+    int volatile notifying;
+    // set while setNames() changes pvs or shards.  notEmpty() does nothing.
+    int volatile relayout;
+    // serializes deliver_pass()
+    epicsMutex deliver_mutex;
+
+    // current phase, or NULL to stop workers
+    void (Shard::*phase)();
+    // # of shards yet to complete phase
+    size_t volatile pending;
+    epicsEvent done;
+    // run phase on all shards, and wait for completion
+    void run_phase(void (Shard::*phase)());
+
     // locals for processor thread
 
-    typedef std::map<epicsUInt64, Receiver::slices_t::value_type::second_type> events_t;
-    events_t events;
+    // values with keys <= flush_key are moved to completed slices by Shard::assemble()
+    epicsUInt64 flush_key;
+    // set by setNames() to flush all staged events, complete or not
+    bool flush_all;
+    std::vector<epicsUInt64> flush_keys;
 
-    receivers_t receivers_shadow;
+    // cleared slices, each pvs.size() long.  Allocated when the signal list is set, reused thereafter.
+    // Returned by deliverer through 'delivered'
+    std::vector<Receiver::slice_t> slice_arena;
+    void take_slice(Receiver::slice_t& slice);
+    void give_slice(Receiver::slice_t& slice);
+
+    bool idle; // set if all input queues emptied
 
     epicsTimeStamp now;
     epicsUInt64 now_key,
                 oldest_key; // oldest key sent to Receviers
     Receiver::slices_t completed;
+    // returned by deliverer
+    Receiver::slices_t recycle;
+
+    // completed slices, passed from processor to deliverer
+    SPSCRing<Receiver::slices_t> delivery;
+    // delivered and cleared slices, returned for reuse
+    SPSCRing<Receiver::slices_t> delivered;
+    epicsEvent deliver_wakeup;
+
+    // locals for deliverer thread
+    receivers_t receivers_shadow;
+    epicsTimeStamp deliver_after; // end of flush holdoff
 
     void process();
+    void process_step();
+    bool process_pass();
+    bool prepare_wait(size_t notified);
     void process_dequeue();
     void process_test();
+    void wake_deliverer();
+    void deliver();
+    void deliver_step();
+    bool deliver_pass();
 
     EPICS_NOT_COPYABLE(Collector)
 };
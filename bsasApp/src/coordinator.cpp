@@ -1,5 +1,8 @@
 
 #include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsAtomic.h>
+#include <errlog.h>
 
 #include <pv/reftrack.h>
 #include <pv/standardField.h>
@@ -17,64 +20,60 @@ pvd::StructureConstPtr type_signals(pvd::getFieldCreate()->createFieldBuilder()
                                     ->add("timeStamp", pvd::getStandardField()->timeStamp())
                                     ->createStructure());
 
-pvd::StructureConstPtr type_status(pvd::getFieldCreate()->createFieldBuilder()
-                                   ->setId("epics:nt/NTTable:1.0")
-                                   ->addArray("labels", pvd::pvString)
-                                   ->addNestedStructure("value")
-                                       ->addArray("PV", pvd::pvString)
-                                       ->addArray("connected", pvd::pvBoolean)
-                                       ->addArray("nEvent", pvd::pvULong)
-                                       ->addArray("nBytes", pvd::pvULong)
-                                       ->addArray("nDiscon", pvd::pvULong)
-                                       ->addArray("nError", pvd::pvULong)
-                                       ->addArray("nOFlow", pvd::pvULong)
-                                   ->endNested()
-                                   ->add("alarm", pvd::getStandardField()->alarm())
-                                   ->add("timeStamp", pvd::getStandardField()->timeStamp())
-                                   ->createStructure());
+pvd::StructureConstPtr type_tune(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->add("enable", pvd::pvBoolean)
+                                 ->add("maxEventRate", pvd::pvDouble)
+                                 ->add("maxEventAge", pvd::pvDouble)
+                                 ->add("flushPeriod", pvd::pvDouble)
+                                 ->add("deliverTime", pvd::pvDouble)
+                                 ->add("nOverflow", pvd::pvULong)
+                                 ->add("nLate", pvd::pvULong)
+                                 ->add("nAged", pvd::pvULong)
+                                 ->add("message", pvd::pvString)
+                                 ->add("timeStamp", pvd::getStandardField()->timeStamp())
+                                 ->createStructure());
 
 } // namespace
 
 size_t Coordinator::num_instances;
 
-Coordinator::Coordinator(CAContext &ctxt, pvas::StaticProvider &provider, const std::string &prefix)
+Coordinator::Coordinator(CAContext &ctxt, pvas::StaticProvider &provider, const std::string &prefix,
+                         const Config &config, Executor *executor)
     :ctxt(ctxt)
     ,provider(provider)
     ,prefix(prefix)
+    ,config(config)
+    ,executor(executor)
     ,pv_signals(pvas::SharedPV::buildReadOnly())
-    ,pv_status(pvas::SharedPV::buildReadOnly())
-    ,handler(pvd::Thread::Config(this, &Coordinator::handle)
-             .prio(epicsThreadPriorityLow)
-             .autostart(false)
-             <<"BSAS "<<prefix)
+    ,tuner(config.tune)
+    ,limits(tuner.initial())
+    ,pv_tune(pvas::SharedPV::buildReadOnly())
+    ,root_tune(pvd::getPVDataCreate()->createPVStructure(type_tune))
+    ,handler_task(*this, &Coordinator::handle_step, epicsThreadPriorityLow)
     ,signals_changed(true)
     ,running(true)
 {
     REFTRACE_INCREMENT(num_instances);
     pv_signals->open(type_signals);
 
-    root_status = pvd::getPVDataCreate()->createPVStructure(type_status);
-    pvd::BitSet changed;
-    {
-        pvd::shared_vector<std::string> labels;
-        labels.push_back("PV");
-        labels.push_back("connected");
-        labels.push_back("#Event");
-        labels.push_back("#Bytes");
-        labels.push_back("#Discon");
-        labels.push_back("#Error");
-        labels.push_back("#OFlow");
-
-        pvd::PVStringArrayPtr flabel(root_status->getSubFieldT<pvd::PVStringArray>("labels"));
-        flabel->replace(pvd::freeze(labels));
-        changed.set(flabel->getFieldOffset());
-    }
-    pv_status->open(*root_status, changed);
+    status.reset(new StatusPublisher(provider, prefix));
+    std::tr1::shared_ptr<pvas::SharedPV::Handler> H(new StatusPublisher::RPCHandler(status));
+    status->pv_status->setHandler(H);
 
-    provider.add(prefix+"SIG", pv_signals);
-    provider.add(prefix+"STS", pv_status);
+    pv_tune->open(*root_tune);
 
-    handler.start();
+    provider.add(prefix+"SIG", pv_signals);
+    provider.add(prefix+"TUNE", pv_tune);
+
+    if(executor) {
+        executor->schedule(handler_task);
+    } else {
+        handler.reset(new pvd::Thread(pvd::Thread::Config(this, &Coordinator::handle)
+                                      .prio(epicsThreadPriorityLow)
+                                      .autostart(false)
+                                      <<"BSAS "<<prefix));
+        handler->start();
+    }
 }
 
 Coordinator::~Coordinator()
@@ -84,8 +83,18 @@ Coordinator::~Coordinator()
         Guard G(mutex);
         running = false;
     }
-    wakeup.signal();
-    handler.exitWait();
+    if(executor) {
+        executor->cancel(handler_task);
+    } else {
+        wakeup.signal();
+        handler->exitWait();
+    }
+
+    // table may be removed at runtime.  disconnects any clients
+    provider.remove(prefix+"SIG");
+    provider.remove(prefix+"TUNE");
+    if(table_receiver.get())
+        provider.remove(prefix+"TBL");
 
     table_receiver.reset();
     collector.reset(); // joins collector worker and cancels CA subscriptions
@@ -93,131 +102,181 @@ Coordinator::~Coordinator()
 
 void Coordinator::handle()
 {
+    RealTime::apply(RealTime::Coordinator);
+
     Guard G(mutex);
 
     bool expire = false;
 
     while(running) {
-        bool changing = signals_changed;
-        signals_changed = false;
-
-        if(changing) {
-            // handle change of PV list
-            Collector::names_t temp(signals);
+        handle_once(G, expire);
 
+        {
             UnGuard U(G);
-
-            provider.remove(prefix+"TBL");
-
-            table_receiver.reset();
-            collector.reset();
-
-            collector.reset(new Collector(ctxt, temp, epicsThreadPriorityMedium+5));
-            table_receiver.reset(new PVAReceiver(*collector));
-
-            provider.add(prefix+"TBL", table_receiver->pv);
-            std::cerr<<"Add "<<prefix<<"TBL\n";
-
+            expire = !wakeup.wait(1.0);
         }
+    }
+}
 
-        if(expire || changing) {
-            // update status table
-
-            Collector::names_t pvnames(signals);
-
-            {
-                UnGuard U(G);
-
-                epicsTimeStamp now;
-                epicsTimeGetCurrent(&now);
+// as Executor Task
+void Coordinator::handle_step()
+{
+    Guard G(mutex);
 
-                pvd::shared_vector<pvd::boolean> conn(pvnames.size());
-                pvd::shared_vector<pvd::uint64> events(pvnames.size()),
-                                                bytes(pvnames.size()),
-                                                discons(pvnames.size()),
-                                                errors(pvnames.size()),
-                                                oflows(pvnames.size());
+    if(!running)
+        return;
 
-                assert(pvnames.size()==collector->pvs.size());
+    // run early only for a change of signal list
+    handle_once(G, !signals_changed);
 
-                for(size_t i=0, N=collector->pvs.size(); i<N; i++) {
-                    const Collector::PV& pv = collector->pvs[i];
-                    if(!pv.sub) {
-                        conn[i] = 0;
+    executor->schedule(handler_task, 1.0);
+}
 
-                    } else {
-                        Subscription& sub = *pv.sub;
+void Coordinator::wake()
+{
+    if(executor) {
+        executor->schedule(handler_task);
+    } else {
+        wakeup.signal();
+    }
+}
 
-                        Guard G2(sub.mutex);
+void Coordinator::handle_once(Guard& G, bool expire)
+{
+    bool changing = signals_changed;
+    signals_changed = false;
 
-                        conn[i] = sub.connected;
+    if(changing && collector.get()) {
+        // change PV list in place.  Unchanged PVs keep their Subscriptions, and TBL stays open.
+        Collector::names_t temp(signals);
+        bool done;
+        {
+            UnGuard U(G);
 
-                        events[i] = sub.nUpdates - sub.lUpdates;
-                        bytes[i] = sub.nUpdateBytes - sub.lUpdateBytes;
-                        discons[i] = sub.nDisconnects - sub.lDisconnects;
-                        errors[i] = sub.nErrors - sub.lErrors;
-                        oflows[i] = sub.nOverflows - sub.lOverflows;
+            done = collector->setNames(temp);
+            if(done) {
+                apply_tiers();
+                // retype now, instead of with the next slices
+                table_receiver->update_type();
+            }
+        }
+        if(!done) {
+            // spilled updates are still being replayed.  retry
+            signals_changed = true;
+            changing = false;
+        }
 
-                        sub.lUpdates = sub.nUpdates;
-                        sub.lUpdateBytes = sub.nUpdateBytes;
-                        sub.lDisconnects = sub.nDisconnects;
-                        sub.lErrors = sub.nErrors;
-                        sub.lOverflows = sub.nOverflows;
-                    }
-                }
+    } else if(changing) {
+        // initial PV list
+        Collector::names_t temp(signals);
 
-                pvd::BitSet changed;
+        UnGuard U(G);
 
-                pvd::PVScalarArrayPtr farr;
+        table_receiver.reset();
+        collector.reset();
 
-                if(changing) {
-                    farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.PV");
-                    farr->putFrom(pvnames);
-                    changed.set(farr->getFieldOffset());
-                }
+        collector.reset(new Collector(ctxt, temp, config.prio, config.nworkers, executor));
+        if(config.tune.enable)
+            collector->setLimits(limits);
+        collector->setEvictPolicy(config.evict);
+        if(config.spill_bytes)
+            collector->setSpill(config.spill_dir+"/"+prefix+"spill", config.spill_bytes);
+        apply_tiers();
+        // with types cached by a previous run, if any
+        table_receiver.reset(new PVAReceiver(*collector, config.schema_dir.empty() ? std::string()
+                                                         : config.schema_dir+"/"+prefix+"schema"));
 
-                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.connected");
-                farr->putFrom(pvd::freeze(conn));
-                changed.set(farr->getFieldOffset());
+        provider.add(prefix+"TBL", table_receiver->pv);
+        std::cerr<<"Add "<<prefix<<"TBL\n";
 
-                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nEvent");
-                farr->putFrom(pvd::freeze(events));
-                changed.set(farr->getFieldOffset());
+    }
 
-                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nBytes");
-                farr->putFrom(pvd::freeze(bytes));
-                changed.set(farr->getFieldOffset());
+    if(expire || changing) {
+        // update status PVs
 
-                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nDiscon");
-                farr->putFrom(pvd::freeze(discons));
-                changed.set(farr->getFieldOffset());
+        UnGuard U(G);
 
-                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nError");
-                farr->putFrom(pvd::freeze(errors));
-                changed.set(farr->getFieldOffset());
+        // what the Collector has, which lags signals while a change is retried
+        Collector::names_t pvnames(collector->currentNames());
 
-                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nOFlow");
-                farr->putFrom(pvd::freeze(oflows));
-                changed.set(farr->getFieldOffset());
+        {
+            // rates are otherwise only estimated on update
+            Guard C(collector->mutex);
+            for(size_t i=0, N=collector->pvs.size(); i<N; i++) {
+                if(collector->pvs[i].sub)
+                    collector->pvs[i].sub->channel->decay();
+            }
+        }
 
-                pvd::PVScalarPtr fscale;
-                fscale = root_status->getSubFieldT<pvd::PVScalar>("timeStamp.secondsPastEpoch");
-                fscale->putFrom<pvd::uint32>(now.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
-                changed.set(fscale->getFieldOffset());
-                fscale = root_status->getSubFieldT<pvd::PVScalar>("timeStamp.nanoseconds");
-                fscale->putFrom<pvd::uint32>(now.nsec);
-                changed.set(fscale->getFieldOffset());
+        status->update(*collector, pvnames, changing, epicsAtomicGetSizeT(&table_receiver->nRetype));
+        if(table_receiver->type_connected())
+            table_receiver->update_type();
+        table_receiver->save_schema();
+        tune();
+        MemBudget::step();
+    }
+}
 
-                pv_status->post(*root_status, changed);
+// on handler, with mutex unlocked.  First matching pattern wins
+void Coordinator::apply_tiers()
+{
+    Guard G(collector->mutex);
+    for(size_t i=0, N=collector->pvs.size(); i<N; i++) {
+        Subscription& sub = *collector->pvs[i].sub;
+        unsigned tier = MemBudget::DefaultTier;
+        for(size_t t=0; t<config.tiers.size(); t++) {
+            if(epicsStrGlobMatch(sub.pvname.c_str(), config.tiers[t].first.c_str())) {
+                tier = config.tiers[t].second;
+                break;
             }
-
         }
+        sub.tier = tier;
+    }
+}
 
-        {
-            UnGuard U(G);
-            expire = !wakeup.wait(1.0);
+// on handler, with mutex unlocked
+void Coordinator::tune()
+{
+    AutoTuner::Sample sample;
+    sample.nOverflow = epicsAtomicGetSizeT(&collector->nOverflow);
+    sample.nLate = epicsAtomicGetSizeT(&collector->nLate);
+    sample.nAged = epicsAtomicGetSizeT(&collector->nAged);
+    {
+        // take and reset
+        size_t ns = epicsAtomicGetSizeT(&collector->deliver_max_ns);
+        epicsAtomicCmpAndSwapSizeT(&collector->deliver_max_ns, ns, 0u);
+        sample.deliverTime = ns*1e-9;
+    }
+
+    if(config.tune.enable) {
+        std::string reason;
+        if(tuner.step(sample, limits, reason)) {
+            collector->setLimits(limits);
+            tune_message = reason;
+            errlogPrintf("%s autotune: %s\n", prefix.c_str(), reason.c_str());
         }
+    } else {
+        limits = collector->currentLimits();
     }
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    root_tune->getSubFieldT<pvd::PVScalar>("enable")->putFrom<pvd::boolean>(config.tune.enable);
+    root_tune->getSubFieldT<pvd::PVScalar>("maxEventRate")->putFrom(limits.maxEventRate);
+    root_tune->getSubFieldT<pvd::PVScalar>("maxEventAge")->putFrom(limits.maxEventAge);
+    root_tune->getSubFieldT<pvd::PVScalar>("flushPeriod")->putFrom(limits.flushPeriod);
+    root_tune->getSubFieldT<pvd::PVScalar>("deliverTime")->putFrom(sample.deliverTime);
+    root_tune->getSubFieldT<pvd::PVScalar>("nOverflow")->putFrom<pvd::uint64>(sample.nOverflow);
+    root_tune->getSubFieldT<pvd::PVScalar>("nLate")->putFrom<pvd::uint64>(sample.nLate);
+    root_tune->getSubFieldT<pvd::PVScalar>("nAged")->putFrom<pvd::uint64>(sample.nAged);
+    root_tune->getSubFieldT<pvd::PVScalar>("message")->putFrom(tune_message);
+    root_tune->getSubFieldT<pvd::PVScalar>("timeStamp.secondsPastEpoch")->putFrom<pvd::uint32>(now.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
+    root_tune->getSubFieldT<pvd::PVScalar>("timeStamp.nanoseconds")->putFrom<pvd::uint32>(now.nsec);
+
+    pvd::BitSet changed;
+    changed.set(0); // whole structure
+    pv_tune->post(*root_tune, changed);
 }
 
 void Coordinator::SignalsHandler::onPut(const pvas::SharedPV::shared_pointer& pv, pvas::Operation& op)
@@ -233,7 +292,7 @@ void Coordinator::SignalsHandler::onPut(const pvas::SharedPV::shared_pointer& pv
             self->signals = value->view();
             self->signals_changed = true;
         }
-        self->wakeup.signal();
+        self->wake();
     }
 
     pv->post(op.value(), op.changed());
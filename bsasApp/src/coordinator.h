@@ -3,6 +3,8 @@
 
 #include "coordinator.h"
 #include "receiver_pva.h"
+#include "status.h"
+#include "autotune.h"
 
 struct Coordinator
 {
@@ -10,22 +12,52 @@ struct Coordinator
 
     static Coordinator* lookup(const std::string&);
 
-    Coordinator(CAContext& ctxt, pvas::StaticProvider& provider, const std::string& prefix);
+    // per table settings, from bsasTableAdd()
+    struct Config {
+        size_t nworkers; // # of Collector threads
+        unsigned prio; // Collector thread or Task priority
+        AutoTuner::Config tune; // from bsasTableTune()
+        EvictPolicy evict; // from bsasTableEvict()
+        // from bsasTableSpill().  spill_bytes==0 to disable
+        std::string spill_dir;
+        size_t spill_bytes;
+        // MemBudget tier of PVs matching each glob pattern, from bsasTableTier().  First match wins.
+        std::vector<std::pair<std::string, unsigned> > tiers;
+        // from bsasTableSchema().  Directory of cached column types.  Empty to disable
+        std::string schema_dir;
+        Config() :nworkers(1u), prio(epicsThreadPriorityMedium+5), spill_bytes(0u) {}
+    };
+
+    // if executor!=NULL, then run as Tasks instead of with dedicated threads
+    Coordinator(CAContext& ctxt, pvas::StaticProvider& provider, const std::string& prefix,
+                const Config& config = Config(), Executor *executor = 0);
     ~Coordinator();
 
     CAContext& ctxt;
     pvas::StaticProvider& provider;
     const std::string prefix;
+    const Config config;
+    Executor * const executor;
 
     epics::auto_ptr<Collector> collector;
     epics::auto_ptr<PVAReceiver> table_receiver;
 
-    pvas::SharedPV::shared_pointer pv_signals,
-                                   pv_status;
+    pvas::SharedPV::shared_pointer pv_signals;
+
+    // <prefix>STS, SUM, and TOP
+    std::tr1::shared_ptr<StatusPublisher> status;
 
-    epics::pvData::PVStructurePtr root_status;
+    // only accessed from handler
+    AutoTuner tuner;
+    Collector::Limits limits;
+    std::string tune_message;
+    // <prefix>TUNE
+    pvas::SharedPV::shared_pointer pv_tune;
+    epics::pvData::PVStructurePtr root_tune;
 
-    epics::pvData::Thread handler;
+    // Thread or Task
+    epics::auto_ptr<epics::pvData::Thread> handler;
+    MemberTask<Coordinator> handler_task;
 
     Collector::names_t signals;
     bool signals_changed;
@@ -35,6 +67,11 @@ struct Coordinator
     epicsEvent wakeup;
 
     void handle();
+    void handle_step();
+    void handle_once(Guard& G, bool expire);
+    void tune();
+    void apply_tiers();
+    void wake();
 
     struct SignalsHandler : public pvas::SharedPV::Handler {
         const std::tr1::weak_ptr<Coordinator> coordinator;
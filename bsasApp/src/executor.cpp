@@ -0,0 +1,233 @@
+
+#include <algorithm>
+
+#include <errlog.h>
+#include <epicsTime.h>
+#include <pv/reftrack.h>
+
+#include "collect_ca.h"
+#include "executor.h"
+#include "realtime.h"
+
+namespace pvd = epics::pvData;
+
+size_t Executor::num_instances;
+
+Executor::Task::Task(unsigned prio)
+    :prio(prio)
+    ,state(Idle)
+    ,again(false)
+    ,cancelled(false)
+    ,due(0u)
+    ,runner(0)
+{}
+
+Executor::Executor(int nworkers, unsigned prio)
+    :running(true)
+    ,nsequence(0u)
+{
+    REFTRACE_INCREMENT(num_instances);
+
+    if(nworkers<=0)
+        nworkers = epicsThreadGetCPUs();
+    if(nworkers<=0)
+        nworkers = 1;
+
+    threads.resize(nworkers);
+    for(size_t i=0; i<threads.size(); i++) {
+        threads[i].reset(new pvd::Thread(pvd::Thread::Config(this, &Executor::work)
+                                         .prio(prio)
+                                         .autostart(false)
+                                         <<"BSA Pool "<<i));
+    }
+    for(size_t i=0; i<threads.size(); i++) {
+        threads[i]->start();
+    }
+}
+
+Executor::~Executor()
+{
+    REFTRACE_DECREMENT(num_instances);
+    {
+        Guard G(mutex);
+        running = false;
+    }
+    for(size_t i=0; i<threads.size(); i++) {
+        wakeup.signal();
+    }
+    for(size_t i=0; i<threads.size(); i++) {
+        threads[i]->exitWait();
+    }
+}
+
+epicsUInt64 Executor::now_key()
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    epicsUInt64 key = now.secPastEpoch;
+    key <<= 32;
+    key |= now.nsec;
+    return key;
+}
+
+// with mutex locked
+void Executor::enqueue(Task& task)
+{
+    if(task.due) {
+        task.state = Task::Delayed;
+        delayed.insert(delayed_t::value_type(task.due, &task));
+    } else {
+        task.state = Task::Ready;
+        ready[std::make_pair(-epicsInt64(task.prio), nsequence++)] = &task;
+    }
+    wakeup.signal();
+}
+
+// with mutex locked.  Remove from ready or delayed
+void Executor::dequeue(Task& task)
+{
+    if(task.state==Task::Delayed) {
+        std::pair<delayed_t::iterator, delayed_t::iterator> range(delayed.equal_range(task.due));
+        for(; range.first!=range.second; ++range.first) {
+            if(range.first->second==&task) {
+                delayed.erase(range.first);
+                break;
+            }
+        }
+
+    } else if(task.state==Task::Ready) {
+        for(ready_t::iterator it(ready.begin()), end(ready.end()); it!=end; ++it) {
+            if(it->second==&task) {
+                ready.erase(it);
+                break;
+            }
+        }
+    }
+    task.state = Task::Idle;
+}
+
+void Executor::schedule(Task& task, double delay)
+{
+    epicsUInt64 due = 0u;
+    if(delay>0.0) {
+        epicsUInt64 offset = epicsUInt64(delay);
+        offset <<= 32;
+        offset |= epicsUInt32(1e9*(delay-epicsUInt64(delay)));
+        due = now_key() + offset;
+    }
+
+    Guard G(mutex);
+
+    if(task.cancelled)
+        return;
+
+    switch(task.state) {
+    case Task::Idle:
+        task.due = due;
+        enqueue(task);
+        break;
+    case Task::Delayed:
+        if(due < task.due) {
+            dequeue(task);
+            task.due = due;
+            enqueue(task);
+        }
+        break;
+    case Task::Ready:
+        break; // will run soon anyway
+    case Task::Running:
+        if(!task.again || due < task.due)
+            task.due = due;
+        task.again = true;
+        break;
+    }
+}
+
+void Executor::cancel(Task& task)
+{
+    Guard G(mutex);
+
+    task.cancelled = true;
+    task.again = false;
+
+    if(task.state==Task::Running) {
+        if(task.runner==epicsThreadGetIdSelf())
+            return; // from run().  Will not be re-queued
+
+        while(task.state==Task::Running) {
+            UnGuard U(G);
+            task.finished.wait();
+        }
+
+    } else {
+        dequeue(task);
+    }
+}
+
+void Executor::work()
+{
+    RealTime::apply(RealTime::Processor);
+
+    Guard G(mutex);
+
+    while(running) {
+        if(!delayed.empty()) {
+            // promote delayed Tasks which are now due
+            const epicsUInt64 now = now_key();
+            while(!delayed.empty() && delayed.begin()->first <= now) {
+                Task& task = *delayed.begin()->second;
+                delayed.erase(delayed.begin());
+                task.due = 0u;
+                task.state = Task::Ready;
+                ready[std::make_pair(-epicsInt64(task.prio), nsequence++)] = &task;
+            }
+        }
+
+        if(ready.empty()) {
+            double timeout = -1.0;
+            if(!delayed.empty()) {
+                epicsInt64 wait = epicsInt64(delayed.begin()->first - now_key());
+                timeout = std::max(0.0, double(wait>>32) + double(wait&0xffffffff)*1e-9);
+            }
+
+            UnGuard U(G);
+            if(timeout<0.0)
+                wakeup.wait();
+            else
+                wakeup.wait(timeout);
+            continue;
+        }
+
+        Task& task = *ready.begin()->second;
+        ready.erase(ready.begin());
+
+        if(!ready.empty())
+            wakeup.signal(); // more for another worker
+
+        task.state = Task::Running;
+        task.runner = epicsThreadGetIdSelf();
+        task.again = false;
+
+        {
+            UnGuard U(G);
+            try {
+                task.run();
+            } catch(std::exception& e) {
+                errlogPrintf("Unhandled exception in Executor Task: %s\n", e.what());
+            }
+        }
+
+        task.state = Task::Idle;
+        task.runner = 0;
+
+        if(task.cancelled) {
+            task.finished.signal();
+
+        } else if(task.again) {
+            task.again = false;
+            enqueue(task);
+        }
+    }
+
+    wakeup.signal(); // pass on exit
+}
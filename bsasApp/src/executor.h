@@ -0,0 +1,99 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <vector>
+#include <map>
+
+#include <epicsTypes.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <pv/thread.h>
+#include <pv/sharedPtr.h>
+
+/* Fixed pool of worker threads shared by many Tasks, in place of a thread per Task.
+ *
+ * Ready Tasks are run in order of decreasing priority, then in the order scheduled.
+ * A Task is never run concurrently with itself, so the same Task scheduled again
+ * while running is re-run afterwards.
+ */
+struct Executor {
+    static size_t num_instances;
+
+    struct Task {
+        explicit Task(unsigned prio);
+        virtual ~Task() {}
+
+        // called from a worker
+        virtual void run() =0;
+
+        // higher runs first.  Same scale as epicsThreadPriority*
+        const unsigned prio;
+
+    private:
+        friend struct Executor;
+
+        enum state_t {
+            Idle,
+            Delayed,
+            Ready,
+            Running,
+        } state;
+        bool again; // schedule()'d while Running
+        bool cancelled;
+        epicsUInt64 due; // when Delayed, or when to run again
+        epicsThreadId runner; // while Running
+        epicsEvent finished; // cancel() waiting for run() to return
+
+        EPICS_NOT_COPYABLE(Task)
+    };
+
+    // nworkers<=0 selects the # of CPUs
+    Executor(int nworkers, unsigned prio);
+    ~Executor();
+
+    size_t workers() const { return threads.size(); }
+
+    // run task after delay (seconds).  If already scheduled, then runs at the earlier of the two times.
+    void schedule(Task& task, double delay = 0.0);
+
+    // Prevent a Task from running again, and wait for any run() in progress to return.
+    // Must be called before a scheduled Task is destroyed.
+    void cancel(Task& task);
+
+private:
+    mutable epicsMutex mutex;
+    bool running;
+    epicsEvent wakeup;
+
+    // ready queue ordered by (-prio, sequence)
+    typedef std::map<std::pair<epicsInt64, epicsUInt64>, Task*> ready_t;
+    ready_t ready;
+    epicsUInt64 nsequence;
+
+    typedef std::multimap<epicsUInt64, Task*> delayed_t;
+    delayed_t delayed;
+
+    std::vector<std::tr1::shared_ptr<epics::pvData::Thread> > threads;
+
+    static epicsUInt64 now_key();
+
+    void enqueue(Task& task);
+    void dequeue(Task& task);
+
+    void work();
+
+    EPICS_NOT_COPYABLE(Executor)
+};
+
+// Task which calls a member function
+template<typename C>
+struct MemberTask : public Executor::Task {
+    C& self;
+    void (C::*const fn)();
+    MemberTask(C& self, void (C::*fn)(), unsigned prio) :Task(prio), self(self), fn(fn) {}
+    virtual ~MemberTask() {}
+    virtual void run() { (self.*fn)(); }
+};
+
+#endif // EXECUTOR_H
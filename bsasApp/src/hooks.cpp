@@ -1,38 +1,204 @@
 
 #include <fstream>
+#include <map>
 
 #include <initHooks.h>
 #include <iocsh.h>
 #include <epicsExit.h>
 #include <drvSup.h>
 #include <epicsStdio.h>
+#include <errlog.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
 
 #include <pv/pvAccess.h>
 #include <pva/client.h>
 #include <pv/reftrack.h>
+#include <pv/standardField.h>
 
 #include "collect_ca.h"
 #include "collector.h"
 #include "receiver_pva.h"
 #include "coordinator.h"
+#include "realtime.h"
 
 #include <epicsExport.h>
 
 namespace pvd = epics::pvData;
 namespace pva = epics::pvAccess;
 
+// # of threads in worker pool shared by all tables.  0 for dedicated threads for each table.  <0 for # of CPUs
+int bsasWorkerPool;
+// non-zero for polled CA contexts.  cf. collectorCaPollPeriod
+int bsasCAPolled;
+
 namespace {
 
 std::tr1::shared_ptr<CAContext> cactxt;
 
-// static after iocInit()
+// from bsasCAContext().  empty for one context at epicsThreadPriorityMedium, w/ RealTime::CA
+struct CAConfig {
+    unsigned prio;
+    RealTime::Config rt;
+};
+std::vector<CAConfig> caconfigs;
+// from bsasCAAssign()
+CAContext::Assign caassign = CAContext::Hash;
+
+std::tr1::shared_ptr<Executor> executor;
+
+// guards coordinators, which may change after iocInit() through bsasTableAdd(), bsasTableRemove(), or the control PV
+epicsMutex tables_mutex;
 typedef std::map<std::string, std::tr1::shared_ptr<Coordinator> > coordinators_t;
 coordinators_t coordinators;
+// from bsasTableAdd()
+typedef std::map<std::string, Coordinator::Config> configs_t;
+configs_t configs;
 
 pvas::StaticProvider::shared_pointer provider;
 
 bool locked;
 
+// from bsasTableControl().  empty for none
+std::string control_name;
+pvas::SharedPV::shared_pointer pv_control;
+
+pvd::StructureConstPtr type_control(pvd::getFieldCreate()->createFieldBuilder()
+                                    ->setId("epics:nt/NTScalar:1.0")
+                                    ->addArray("value", pvd::pvString)
+                                    ->add("timeStamp", pvd::getStandardField()->timeStamp())
+                                    ->createStructure());
+
+// with tables_mutex locked
+std::tr1::shared_ptr<Coordinator> create_table(const std::string& prefix)
+{
+    std::tr1::shared_ptr<Coordinator> C(new Coordinator(*cactxt, *provider, prefix, configs[prefix], executor.get()));
+    std::tr1::shared_ptr<Coordinator::SignalsHandler> H(new Coordinator::SignalsHandler(C));
+    C->pv_signals->setHandler(H);
+    return C;
+}
+
+// with tables_mutex locked
+pvd::shared_vector<const std::string> table_names()
+{
+    pvd::shared_vector<std::string> names;
+    for(coordinators_t::const_iterator it(coordinators.begin()), end(coordinators.end()); it!=end; ++it)
+        names.push_back(it->first);
+    return pvd::freeze(names);
+}
+
+// with tables_mutex locked.  post names of current tables
+void post_control()
+{
+    if(!pv_control)
+        return;
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    pvd::PVStructurePtr root(pvd::getPVDataCreate()->createPVStructure(type_control));
+    root->getSubFieldT<pvd::PVStringArray>("value")->replace(table_names());
+    root->getSubFieldT<pvd::PVScalar>("timeStamp.secondsPastEpoch")->putFrom<pvd::uint32>(now.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
+    root->getSubFieldT<pvd::PVScalar>("timeStamp.nanoseconds")->putFrom<pvd::uint32>(now.nsec);
+
+    pvd::BitSet changed;
+    changed.set(0);
+    pv_control->post(*root, changed);
+}
+
+// after iocInit().  Returns an error message, or empty on success
+std::string add_table(const std::string& prefix, int nworkers, int prio)
+{
+    Guard G(tables_mutex);
+    if(!cactxt)
+        return "Not running";
+    else if(prefix.empty())
+        return "Expect table prefix";
+    else if(coordinators.find(prefix)!=coordinators.end())
+        return "Table "+prefix+" already exists";
+
+    Coordinator::Config& conf = configs[prefix];
+    if(nworkers>0)
+        conf.nworkers = nworkers;
+    if(prio>0)
+        conf.prio = std::min(prio, int(epicsThreadPriorityMax));
+
+    coordinators[prefix] = create_table(prefix);
+    post_control();
+    return std::string();
+}
+
+std::string remove_table(const std::string& prefix)
+{
+    std::tr1::shared_ptr<Coordinator> C;
+    {
+        Guard G(tables_mutex);
+        coordinators_t::iterator it(coordinators.find(prefix));
+        if(it==coordinators.end())
+            return "No table "+prefix;
+        C.swap(it->second);
+        coordinators.erase(it);
+        post_control();
+        // configs[] retained, so that a table added again has the same settings
+    }
+    // joins workers and cancels CA subscriptions.  Without tables_mutex, which bsas_report() holds while printing
+    C.reset();
+    return std::string();
+}
+
+std::string rpc_arg(const pvd::PVStructure& args, const std::string& name)
+{
+    pvd::PVScalar::const_shared_pointer fld(args.getSubField<pvd::PVScalar>("query."+name));
+    if(!fld)
+        fld = args.getSubField<pvd::PVScalar>(name);
+    return fld ? fld->getAs<std::string>() : std::string();
+}
+
+// RPC to control PV.  op=add or remove, prefix=, and optionally nworkers= and prio=
+struct ControlHandler : public pvas::SharedPV::Handler {
+    virtual ~ControlHandler() {}
+    virtual void onRPC(const pvas::SharedPV::shared_pointer& pv, pvas::Operation& op)
+    {
+        try {
+            const std::string action(rpc_arg(op.value(), "op")),
+                              prefix(rpc_arg(op.value(), "prefix")),
+                              nworkers(rpc_arg(op.value(), "nworkers")),
+                              prio(rpc_arg(op.value(), "prio"));
+
+            std::string err;
+            if(action=="add") {
+                err = add_table(prefix, atoi(nworkers.c_str()), atoi(prio.c_str()));
+            } else if(action=="remove") {
+                err = remove_table(prefix);
+            } else {
+                err = "op must be one of: add, remove";
+            }
+
+            if(!err.empty()) {
+                op.complete(pvd::Status::error(err));
+                return;
+            }
+
+            errlogPrintf("BSAS %s table %s\n", action=="add" ? "added" : "removed", prefix.c_str());
+
+            pvd::PVStructurePtr root(pvd::getPVDataCreate()->createPVStructure(type_control));
+            pvd::BitSet changed;
+            {
+                Guard G(tables_mutex);
+                pvd::PVStringArrayPtr value(root->getSubFieldT<pvd::PVStringArray>("value"));
+                value->replace(table_names());
+                changed.set(value->getFieldOffset());
+            }
+            op.complete(*root, changed);
+
+        } catch(std::exception& e) {
+            op.complete(pvd::Status::error(e.what()));
+        }
+    }
+};
+
 void bsasExit(void *)
 {
     // enforce shutdown order
@@ -40,7 +206,15 @@ void bsasExit(void *)
 
     provider->close(true); // disconnect any PVA clients
 
-    coordinators.clear(); // joins workers, cancels CA subscriptions
+    coordinators_t temp;
+    {
+        Guard G(tables_mutex);
+        temp.swap(coordinators);
+        pv_control.reset();
+    }
+    temp.clear(); // joins workers, cancels CA subscriptions
+
+    executor.reset(); // joins pool workers
 
     provider.reset(); // server may still be holding a ref., but drop this one anyway
 
@@ -53,15 +227,41 @@ void bsasHook(initHookState state)
     if(state!=initHookAfterIocRunning) return;
     epicsAtExit(bsasExit, 0);
 
-    // our private CA context
+    // With MCL_FUTURE, memory mapped later, eg. the stacks and buffers of threads created below, is also locked
+    RealTime::lockMemory();
+
+    // our private CA context(s)
     // place a lower prio than the Collector workers
-    cactxt.reset(new CAContext(epicsThreadPriorityMedium));
+    if(caconfigs.empty()) {
+        cactxt.reset(new CAContext(epicsThreadPriorityMedium, false, 0, bsasCAPolled!=0));
+    } else {
+        cactxt.reset(new CAContext(caconfigs[0].prio, false, &caconfigs[0].rt, bsasCAPolled!=0));
+        for(size_t i=1; i<caconfigs.size(); i++)
+            cactxt->addShard(caconfigs[i].prio, caconfigs[i].rt);
+    }
+    cactxt->assign = caassign;
+
+    if(bsasWorkerPool) {
+        executor.reset(new Executor(bsasWorkerPool, epicsThreadPriorityMedium+5));
+
+        const RealTime::Config& coord = RealTime::roles[RealTime::Coordinator];
+        if(!coord.cpus.empty() || coord.prio)
+            errlogPrintf("bsasRTThread coordinator is ignored with bsasWorkerPool.  Handlers run on pool workers\n");
+    }
+
+    Guard G(tables_mutex);
 
     for(coordinators_t::iterator it(coordinators.begin()), end(coordinators.end()); it!=end; ++it) {
-        std::tr1::shared_ptr<Coordinator> C(new Coordinator(*cactxt, *provider, it->first));
-        std::tr1::shared_ptr<Coordinator::SignalsHandler> H(new Coordinator::SignalsHandler(C));
-        C->pv_signals->setHandler(H);
-        it->second = C;
+        it->second = create_table(it->first);
+    }
+
+    if(!control_name.empty()) {
+        pv_control = pvas::SharedPV::buildReadOnly();
+        std::tr1::shared_ptr<pvas::SharedPV::Handler> H(new ControlHandler);
+        pv_control->setHandler(H);
+        pv_control->open(type_control);
+        provider->add(control_name, pv_control);
+        post_control();
     }
 }
 
@@ -69,44 +269,87 @@ void bsas_report(int lvl)
 {
     try {
         /* lvl<=0 shows only table names
-         * lvl==1 shows only PV w/ overflows
-         * lvl==2 shows only PV w/ overflows or disconnected
+         * lvl==1 shows only PV w/ overflows or shed
+         * lvl==2 shows only PV w/ overflows, shed, or disconnected
          * lvl>=3 shows all
          *
          */
+        epicsStdoutPrintf("Memory %.1f MB", epicsAtomicGetSizeT(&MemAccount::process)/1048576.0);
+        if(bsasMemBudget>0.0)
+            epicsStdoutPrintf(" of %.1f MB.  Shed level %u", bsasMemBudget, MemBudget::level());
+        epicsStdoutPrintf("\n");
+
+        if(cactxt) {
+            for(size_t i=0, N=cactxt->nshards(); i<N; i++) {
+                const CAContext& ctxt = cactxt->shard(i);
+                epicsStdoutPrintf("CA context %zu #channels=%zu #callbacks=%zu busy=%.3f s\n", i,
+                                  epicsAtomicGetSizeT(&ctxt.nCreated) - epicsAtomicGetSizeT(&ctxt.nCleared),
+                                  epicsAtomicGetSizeT(&ctxt.nCallbacks),
+                                  epicsAtomicGetSizeT(&ctxt.callbackUs)*1e-6);
+            }
+        }
+
+        Guard T(tables_mutex);
         for(coordinators_t::const_iterator it(coordinators.begin()), end(coordinators.end()); it!=end; ++it) {
             epicsStdoutPrintf("Table %s\n", it->first.c_str());
 
             std::tr1::shared_ptr<const Coordinator> coord(it->second);
 
-            Guard G(coord->mutex);
             if(!coord.get()) continue;
 
-            epicsStdoutPrintf("    Overflows=%zu Complete=%zu\n", coord->collector->nOverflow, coord->collector->nComplete);
+            Guard G(coord->mutex);
+            // until the first PV list is set
+            if(!coord->collector.get()) continue;
+
+            epicsStdoutPrintf("    Overflows=%zu Complete=%zu Memory=%.1f MB\n", coord->collector->nOverflow, coord->collector->nComplete,
+                              epicsAtomicGetSizeT(&coord->collector->mem->bytes)/1048576.0);
+            epicsStdoutPrintf("    Evict=%s", EvictPolicy::name(coord->config.evict.kind));
+            {
+                Guard C(coord->collector->mutex);
+                for(unsigned k=0; k<EvictPolicy::nKinds; k++)
+                    epicsStdoutPrintf(" #%s=%zu", EvictPolicy::name(EvictPolicy::Kind(k)),
+                                      epicsAtomicGetSizeT(&coord->collector->nEvicted[k]) - coord->collector->nEvictedBase[k]);
+            }
+            epicsStdoutPrintf("\n");
+            if(coord->config.spill_bytes) {
+                epicsStdoutPrintf("    Spill=%zu/%zu bytes #spilled=%zu #replayed=%zu #dropped=%zu replay lag=%.3f s\n",
+                                  coord->collector->spill_used, coord->config.spill_bytes,
+                                  coord->collector->nSpilled, coord->collector->nReplayed,
+                                  coord->collector->nSpillDrop, coord->collector->replay_lag_ms*1e-3);
+            }
             if(lvl<1) continue;
 
-            // holding Coordinator::mutex prevents signal list change.
+            // holding Collector::mutex prevents signal list change, and excludes wake_latency.add()
+            Guard C(coord->collector->mutex);
+
+            epicsStdoutPrintf("    Wakeup latency\n");
+            coord->collector->wake_latency.show("      ");
 
             for(size_t i=0, N=coord->collector->pvs.size(); i<N; i++) {
                 if(!coord->collector->pvs[i].sub) continue;
 
                 const Subscription* sub = coord->collector->pvs[i].sub.get();
 
-                Guard G2(sub->mutex); // mutex order: Coordinator::mutex -> Subscription::mutex
+                Subscription::Stats cur;
+                sub->snapshot(cur);
+                cur = cur - sub->base;
+                const bool connected = epicsAtomicGetIntT(&sub->connected);
 
-                if(lvl<2 && sub->nOverflows==0) continue;
-                if(lvl<3 && !sub->connected) continue;
+                if(lvl<2 && cur.nOverflows==0 && cur.nShed==0) continue;
+                if(lvl<3 && !connected) continue;
 
-                epicsStdoutPrintf("  %s\t %zu/%zu conn=%c #dis=%zu #err=%zu #up=%zu #MB=%.1f #oflow=%zu\n",
+                epicsStdoutPrintf("  %s\t %zu/%zu conn=%c #dis=%zu #err=%zu #up=%zu #MB=%.1f #oflow=%zu #shed=%zu tier=%u\n",
                                   sub->pvname.c_str(),
                                   sub->values.size(),
-                                  sub->limit,
-                                  sub->connected?'Y':'_',
-                                  sub->nDisconnects,
-                                  sub->nErrors,
-                                  sub->nUpdates,
-                                  sub->nUpdateBytes/1048576.0,
-                                  sub->nOverflows);
+                                  sub->values.limit(),
+                                  connected?'Y':'_',
+                                  cur.nDisconnects,
+                                  cur.nErrors,
+                                  cur.nUpdates,
+                                  cur.nUpdateBytes/1048576.0,
+                                  cur.nOverflows,
+                                  cur.nShed,
+                                  unsigned(sub->tier));
             }
         }
 
@@ -125,56 +368,294 @@ drvet bsas = {
 
 Coordinator* Coordinator::lookup(const std::string& name)
 {
+    Guard G(tables_mutex);
     coordinators_t::iterator it(coordinators.find(name));
     return it==coordinators.end() ? 0 : it->second.get();
 }
 
 extern "C"
-void bsasTableAdd(const char *prefix)
+void bsasTableAdd(const char *prefix, int nworkers, int prio)
 {
     if(locked) {
-        printf("Not allowed after iocInit()\n");
+        // create now.  with settings of any earlier table of this prefix
+        try {
+            std::string err(add_table(prefix ? prefix : "", nworkers, prio));
+            if(!err.empty())
+                printf("%s\n", err.c_str());
+        } catch(std::exception& e) {
+            fprintf(stderr, "Error: %s\n", e.what());
+        }
     } else {
         coordinators[prefix] = std::tr1::shared_ptr<Coordinator>();
+
+        Coordinator::Config& conf = configs[prefix];
+        if(nworkers>0)
+            conf.nworkers = nworkers;
+        if(prio>0)
+            conf.prio = std::min(prio, int(epicsThreadPriorityMax));
     }
 }
 
 /* bsasTableAdd */
 static const iocshArg bsasTableAddArg0 = { "prefix", iocshArgString};
-static const iocshArg * const bsasTableAddArgs[] = {&bsasTableAddArg0};
+static const iocshArg bsasTableAddArg1 = { "nworkers", iocshArgInt};
+static const iocshArg bsasTableAddArg2 = { "prio", iocshArgInt};
+static const iocshArg * const bsasTableAddArgs[] = {&bsasTableAddArg0, &bsasTableAddArg1, &bsasTableAddArg2};
 static const iocshFuncDef bsasTableAddFuncDef = {
-    "bsasTableAdd",1,bsasTableAddArgs};
+    "bsasTableAdd",3,bsasTableAddArgs};
 static void bsasTableAddCallFunc(const iocshArgBuf *args)
 {
-    bsasTableAdd(args[0].sval);
+    bsasTableAdd(args[0].sval, args[1].ival, args[2].ival);
+}
+
+extern "C"
+void bsasTableRemove(const char *prefix)
+{
+    if(!locked) {
+        Guard G(tables_mutex);
+        if(prefix)
+            coordinators.erase(prefix);
+        return;
+    }
+    std::string err(remove_table(prefix ? prefix : ""));
+    if(!err.empty())
+        printf("%s\n", err.c_str());
+}
+
+/* bsasTableRemove */
+static const iocshArg bsasTableRemoveArg0 = { "prefix", iocshArgString};
+static const iocshArg * const bsasTableRemoveArgs[] = {&bsasTableRemoveArg0};
+static const iocshFuncDef bsasTableRemoveFuncDef = {
+    "bsasTableRemove",1,bsasTableRemoveArgs};
+static void bsasTableRemoveCallFunc(const iocshArgBuf *args)
+{
+    bsasTableRemove(args[0].sval);
+}
+
+extern "C"
+void bsasTableControl(const char *name)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    }
+    control_name = name ? name : "";
+}
+
+/* bsasTableControl */
+static const iocshArg bsasTableControlArg0 = { "pvname", iocshArgString};
+static const iocshArg * const bsasTableControlArgs[] = {&bsasTableControlArg0};
+static const iocshFuncDef bsasTableControlFuncDef = {
+    "bsasTableControl",1,bsasTableControlArgs};
+static void bsasTableControlCallFunc(const iocshArgBuf *args)
+{
+    bsasTableControl(args[0].sval);
+}
+
+extern "C"
+void bsasTableTune(const char *prefix, const char *param, double min, double max)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    } else if(!prefix || coordinators.find(prefix)==coordinators.end()) {
+        printf("Unknown table.  Call bsasTableAdd() first\n");
+        return;
+    } else if(min > max) {
+        printf("min > max\n");
+        return;
+    }
+
+    AutoTuner::Config& conf = configs[prefix].tune;
+
+    if(!param || !*param) {
+        // enable with default bounds
+    } else if(strcmp(param, "maxEventRate")==0) {
+        conf.maxEventRate = AutoTuner::Bounds(min, max);
+    } else if(strcmp(param, "maxEventAge")==0) {
+        conf.maxEventAge = AutoTuner::Bounds(min, max);
+    } else if(strcmp(param, "bsasFlushPeriod")==0) {
+        conf.flushPeriod = AutoTuner::Bounds(min, max);
+    } else {
+        printf("Unknown parameter.  Must be one of: maxEventRate, maxEventAge, bsasFlushPeriod\n");
+        return;
+    }
+    conf.enable = true;
+}
+
+/* bsasTableTune */
+static const iocshArg bsasTableTuneArg0 = { "prefix", iocshArgString};
+static const iocshArg bsasTableTuneArg1 = { "param", iocshArgString};
+static const iocshArg bsasTableTuneArg2 = { "min", iocshArgDouble};
+static const iocshArg bsasTableTuneArg3 = { "max", iocshArgDouble};
+static const iocshArg * const bsasTableTuneArgs[] = {&bsasTableTuneArg0, &bsasTableTuneArg1, &bsasTableTuneArg2, &bsasTableTuneArg3};
+static const iocshFuncDef bsasTableTuneFuncDef = {
+    "bsasTableTune",4,bsasTableTuneArgs};
+static void bsasTableTuneCallFunc(const iocshArgBuf *args)
+{
+    bsasTableTune(args[0].sval, args[1].sval, args[2].dval, args[3].dval);
+}
+
+extern "C"
+void bsasTableEvict(const char *prefix, const char *policy, int n)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    } else if(!prefix || coordinators.find(prefix)==coordinators.end()) {
+        printf("Unknown table.  Call bsasTableAdd() first\n");
+        return;
+    }
+
+    EvictPolicy::Kind kind = EvictPolicy::parse(policy);
+    if(kind==EvictPolicy::nKinds) {
+        printf("Unknown policy.  Must be one of: oldest, newest, nth, likely\n");
+        return;
+    }
+
+    EvictPolicy& evict = configs[prefix].evict;
+    evict.kind = kind;
+    if(n>0) {
+        if(kind==EvictPolicy::KeepNth)
+            evict.nth = n;
+        else
+            evict.keep = n;
+    }
+}
+
+/* bsasTableEvict */
+static const iocshArg bsasTableEvictArg0 = { "prefix", iocshArgString};
+static const iocshArg bsasTableEvictArg1 = { "policy", iocshArgString};
+static const iocshArg bsasTableEvictArg2 = { "n", iocshArgInt};
+static const iocshArg * const bsasTableEvictArgs[] = {&bsasTableEvictArg0, &bsasTableEvictArg1, &bsasTableEvictArg2};
+static const iocshFuncDef bsasTableEvictFuncDef = {
+    "bsasTableEvict",3,bsasTableEvictArgs};
+static void bsasTableEvictCallFunc(const iocshArgBuf *args)
+{
+    bsasTableEvict(args[0].sval, args[1].sval, args[2].ival);
+}
+
+extern "C"
+void bsasTableSpill(const char *prefix, const char *dir, double MB)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    } else if(!prefix || coordinators.find(prefix)==coordinators.end()) {
+        printf("Unknown table.  Call bsasTableAdd() first\n");
+        return;
+    }
+
+    Coordinator::Config& conf = configs[prefix];
+    if(!dir || !*dir || MB<=0.0) {
+        conf.spill_bytes = 0u; // disable
+    } else {
+        conf.spill_dir = dir;
+        conf.spill_bytes = size_t(MB*1048576.0);
+    }
+}
+
+/* bsasTableSpill */
+static const iocshArg bsasTableSpillArg0 = { "prefix", iocshArgString};
+static const iocshArg bsasTableSpillArg1 = { "dir", iocshArgString};
+static const iocshArg bsasTableSpillArg2 = { "MB", iocshArgDouble};
+static const iocshArg * const bsasTableSpillArgs[] = {&bsasTableSpillArg0, &bsasTableSpillArg1, &bsasTableSpillArg2};
+static const iocshFuncDef bsasTableSpillFuncDef = {
+    "bsasTableSpill",3,bsasTableSpillArgs};
+static void bsasTableSpillCallFunc(const iocshArgBuf *args)
+{
+    bsasTableSpill(args[0].sval, args[1].sval, args[2].dval);
+}
+
+extern "C"
+void bsasTableTier(const char *prefix, const char *pattern, int tier)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    } else if(!prefix || coordinators.find(prefix)==coordinators.end()) {
+        printf("Unknown table.  Call bsasTableAdd() first\n");
+        return;
+    } else if(!pattern || !*pattern || tier<0 || tier>=MemBudget::nTiers) {
+        printf("Expect PV name pattern, and tier in [0, %d].  0 is never shed.\n", MemBudget::nTiers-1);
+        return;
+    }
+
+    configs[prefix].tiers.push_back(std::make_pair(std::string(pattern), unsigned(tier)));
+}
+
+/* bsasTableTier */
+static const iocshArg bsasTableTierArg0 = { "prefix", iocshArgString};
+static const iocshArg bsasTableTierArg1 = { "pattern", iocshArgString};
+static const iocshArg bsasTableTierArg2 = { "tier", iocshArgInt};
+static const iocshArg * const bsasTableTierArgs[] = {&bsasTableTierArg0, &bsasTableTierArg1, &bsasTableTierArg2};
+static const iocshFuncDef bsasTableTierFuncDef = {
+    "bsasTableTier",3,bsasTableTierArgs};
+static void bsasTableTierCallFunc(const iocshArgBuf *args)
+{
+    bsasTableTier(args[0].sval, args[1].sval, args[2].ival);
+}
+
+extern "C"
+void bsasTableSchema(const char *prefix, const char *dir)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    } else if(!prefix || coordinators.find(prefix)==coordinators.end()) {
+        printf("Unknown table.  Call bsasTableAdd() first\n");
+        return;
+    }
+
+    configs[prefix].schema_dir = dir ? dir : "";
+}
+
+/* bsasTableSchema */
+static const iocshArg bsasTableSchemaArg0 = { "prefix", iocshArgString};
+static const iocshArg bsasTableSchemaArg1 = { "dir", iocshArgString};
+static const iocshArg * const bsasTableSchemaArgs[] = {&bsasTableSchemaArg0, &bsasTableSchemaArg1};
+static const iocshFuncDef bsasTableSchemaFuncDef = {
+    "bsasTableSchema",2,bsasTableSchemaArgs};
+static void bsasTableSchemaCallFunc(const iocshArgBuf *args)
+{
+    bsasTableSchema(args[0].sval, args[1].sval);
 }
 
 extern "C"
 void bsasStatReset(const char *name)
 {
     try {
+        Guard T(tables_mutex);
         for(coordinators_t::const_iterator it(coordinators.begin()), end(coordinators.end()); it!=end; ++it) {
             if(name && it->first!=name) continue;
             std::tr1::shared_ptr<const Coordinator> coord(it->second);
 
-            Guard G(coord->mutex);
             if(!coord.get()) continue;
 
+            Guard G(coord->mutex);
+            // until the first PV list is set
+            if(!coord->collector.get()) continue;
+
+            // the processor counts with the Collector mutex locked
+            Guard C(coord->collector->mutex);
+            coord->collector->wake_latency.reset();
             coord->collector->nOverflow = 0u;
             coord->collector->nComplete = 0u;
+            coord->collector->nSpilled = 0u;
+            coord->collector->nReplayed = 0u;
+            coord->collector->nSpillDrop = 0u;
+
+            // nEvicted is counted by the processing thread.  Only move the baseline
+            for(unsigned k=0; k<EvictPolicy::nKinds; k++)
+                coord->collector->nEvictedBase[k] = epicsAtomicGetSizeT(&coord->collector->nEvicted[k]);
 
             for(size_t i=0, N=coord->collector->pvs.size(); i<N; i++) {
                 if(!coord->collector->pvs[i].sub) continue;
 
                 Subscription* sub = coord->collector->pvs[i].sub.get();
 
-                Guard G2(sub->mutex); // establishes mutex order Coordinator::mutex -> Subscription::mutex
-
-                sub->nDisconnects = sub->lDisconnects = 0u;
-                sub->nErrors = sub->lErrors = 0u;
-                sub->nUpdates = sub->lUpdates = 0u;
-                sub->nUpdateBytes = sub->lUpdateBytes = 0u;
-                sub->nOverflows = sub->lOverflows = 0u;
+                // counters are never cleared, only the baseline for bsas_report
+                sub->snapshot(sub->base);
             }
         }
 
@@ -193,6 +674,88 @@ static void bsasStatResetCallFunc(const iocshArgBuf *args)
     bsasStatReset(args[0].sval);
 }
 
+extern "C"
+void bsasRTThread(const char *role, const char *cpus, int prio)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    }
+    for(unsigned i=0; i<RealTime::nRoles; i++) {
+        RealTime::Role R = RealTime::Role(i);
+        if(!role || strcmp(role, RealTime::name(R))!=0) continue;
+
+        RealTime::roles[R].cpus = cpus ? cpus : "";
+        RealTime::roles[R].prio = std::max(0, std::min(prio, 99));
+        return;
+    }
+    printf("Unknown role.  Must be one of: ca, processor, coordinator\n");
+}
+
+/* bsasRTThread */
+static const iocshArg bsasRTThreadArg0 = { "role", iocshArgString};
+static const iocshArg bsasRTThreadArg1 = { "cpus", iocshArgString};
+static const iocshArg bsasRTThreadArg2 = { "prio", iocshArgInt};
+static const iocshArg * const bsasRTThreadArgs[] = {&bsasRTThreadArg0, &bsasRTThreadArg1, &bsasRTThreadArg2};
+static const iocshFuncDef bsasRTThreadFuncDef = {
+    "bsasRTThread",3,bsasRTThreadArgs};
+static void bsasRTThreadCallFunc(const iocshArgBuf *args)
+{
+    bsasRTThread(args[0].sval, args[1].sval, args[2].ival);
+}
+
+extern "C"
+void bsasCAContext(int prio, const char *cpus, int rtprio)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    }
+    CAConfig conf;
+    conf.prio = prio>0 ? unsigned(std::min(prio, 99)) : epicsThreadPriorityMedium;
+    conf.rt.cpus = cpus ? cpus : "";
+    conf.rt.prio = std::max(0, std::min(rtprio, 99));
+    caconfigs.push_back(conf);
+}
+
+/* bsasCAContext */
+static const iocshArg bsasCAContextArg0 = { "prio", iocshArgInt};
+static const iocshArg bsasCAContextArg1 = { "cpus", iocshArgString};
+static const iocshArg bsasCAContextArg2 = { "rtprio", iocshArgInt};
+static const iocshArg * const bsasCAContextArgs[] = {&bsasCAContextArg0, &bsasCAContextArg1, &bsasCAContextArg2};
+static const iocshFuncDef bsasCAContextFuncDef = {
+    "bsasCAContext",3,bsasCAContextArgs};
+static void bsasCAContextCallFunc(const iocshArgBuf *args)
+{
+    bsasCAContext(args[0].ival, args[1].sval, args[2].ival);
+}
+
+extern "C"
+void bsasCAAssign(const char *how)
+{
+    if(locked) {
+        printf("Not allowed after iocInit()\n");
+        return;
+    }
+    if(how && strcmp(how, "hash")==0) {
+        caassign = CAContext::Hash;
+    } else if(how && strcmp(how, "prefix")==0) {
+        caassign = CAContext::Prefix;
+    } else {
+        printf("Unknown assignment.  Must be one of: hash, prefix\n");
+    }
+}
+
+/* bsasCAAssign */
+static const iocshArg bsasCAAssignArg0 = { "how", iocshArgString};
+static const iocshArg * const bsasCAAssignArgs[] = {&bsasCAAssignArg0};
+static const iocshFuncDef bsasCAAssignFuncDef = {
+    "bsasCAAssign",1,bsasCAAssignArgs};
+static void bsasCAAssignCallFunc(const iocshArgBuf *args)
+{
+    bsasCAAssign(args[0].sval);
+}
+
 extern "C"
 void bsasTableSet(const char *name, const char *filename)
 {
@@ -252,11 +815,17 @@ static void bsasTableSetCallFunc(const iocshArgBuf *args)
 static void bsasRegistrar()
 {
     epics::registerRefCounter("DBRValue", &DBRValue::Holder::num_instances);
+    epics::registerRefCounter("DBRValuePool", &DBRValue::Pool::num_instances);
+    epics::registerRefCounter("DBRValuePoolHit", &DBRValue::Pool::num_hits);
+    epics::registerRefCounter("DBRValuePoolMiss", &DBRValue::Pool::num_misses);
     epics::registerRefCounter("CAContext", &CAContext::num_instances);
+    epics::registerRefCounter("Channel", &Channel::num_instances);
     epics::registerRefCounter("Subscription", &Subscription::num_instances);
     epics::registerRefCounter("Collector", &Collector::num_instances);
     epics::registerRefCounter("Coordinator", &Coordinator::num_instances);
     epics::registerRefCounter("PVAReceiver", &PVAReceiver::num_instances);
+    epics::registerRefCounter("Executor", &Executor::num_instances);
+    epics::registerRefCounter("StatusPublisher", &StatusPublisher::num_instances);
 
     // register our (empty) provider before the PVA server is started
 
@@ -265,12 +834,24 @@ static void bsasRegistrar()
     pva::ChannelProviderRegistry::servers()->addSingleton(provider->provider());
 
     iocshRegister(&bsasTableAddFuncDef, bsasTableAddCallFunc);
+    iocshRegister(&bsasTableRemoveFuncDef, bsasTableRemoveCallFunc);
+    iocshRegister(&bsasTableControlFuncDef, bsasTableControlCallFunc);
+    iocshRegister(&bsasTableTuneFuncDef, bsasTableTuneCallFunc);
+    iocshRegister(&bsasTableEvictFuncDef, bsasTableEvictCallFunc);
+    iocshRegister(&bsasTableSpillFuncDef, bsasTableSpillCallFunc);
+    iocshRegister(&bsasTableTierFuncDef, bsasTableTierCallFunc);
+    iocshRegister(&bsasTableSchemaFuncDef, bsasTableSchemaCallFunc);
     iocshRegister(&bsasStatResetFuncDef, bsasStatResetCallFunc);
     iocshRegister(&bsasTableSetFuncDef, bsasTableSetCallFunc);
+    iocshRegister(&bsasRTThreadFuncDef, bsasRTThreadCallFunc);
+    iocshRegister(&bsasCAContextFuncDef, bsasCAContextCallFunc);
+    iocshRegister(&bsasCAAssignFuncDef, bsasCAAssignCallFunc);
     initHookRegister(&bsasHook);
 }
 
 extern "C" {
 epicsExportRegistrar(bsasRegistrar);
 epicsExportAddress(drvet, bsas);
+epicsExportAddress(int, bsasWorkerPool);
+epicsExportAddress(int, bsasCAPolled);
 }
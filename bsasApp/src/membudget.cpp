@@ -0,0 +1,83 @@
+
+#include <epicsTime.h>
+#include <errlog.h>
+
+#include "membudget.h"
+
+#include <epicsExport.h>
+
+double bsasMemBudget;
+int bsasMemLargeBytes = 65536;
+
+size_t volatile MemAccount::process;
+int volatile MemBudget::current;
+
+namespace {
+// epicsMonotonicGet() seconds of last step()
+size_t volatile last_step;
+// consecutive step()s below low water mark.  Only accessed by the step() which wins last_step
+unsigned quiet;
+} // namespace
+
+bool MemBudget::sheds(unsigned level, unsigned tier, bool large)
+{
+    if(tier==0u)
+        return false;
+    if(tier >= unsigned(nTiers))
+        tier = nTiers-1u;
+
+    // # of levels which shed higher tiers
+    const unsigned before = 2u*(nTiers-1u-tier);
+    return large ? level > before : level > before+1u;
+}
+
+unsigned MemBudget::next(unsigned level, size_t total, size_t budget, unsigned& quiet, unsigned holdoff)
+{
+    if(!budget) {
+        quiet = 0u;
+        return 0u;
+
+    } else if(total > budget + budget/2u) {
+        quiet = 0u;
+        return maxLevel;
+
+    } else if(total > budget) {
+        quiet = 0u;
+        return level < unsigned(maxLevel) ? level+1u : level;
+
+    } else if(level && total < budget - budget/5u) {
+        if(++quiet >= holdoff) {
+            quiet = 0u;
+            return level-1u;
+        }
+        return level;
+
+    } else {
+        quiet = 0u;
+        return level;
+    }
+}
+
+bool MemBudget::step(double holdoff)
+{
+    const size_t now = size_t(epicsMonotonicGet()/1000000000u),
+                 prev = epicsAtomicGetSizeT(&last_step);
+    if(now - prev < size_t(holdoff) || epicsAtomicCmpAndSwapSizeT(&last_step, prev, now)!=prev)
+        return false; // too soon, or another table got here first
+
+    const size_t budget = size_t(bsasMemBudget*1048576.0);
+    const unsigned prevLevel = level(),
+                   L = next(prevLevel, epicsAtomicGetSizeT(&MemAccount::process), budget, quiet, 5u);
+    if(L==prevLevel)
+        return false;
+
+    epicsAtomicSetIntT(&current, L);
+    errlogPrintf("BSAS memory %.1f MB of %.1f MB.  Shed level %u -> %u\n",
+                 epicsAtomicGetSizeT(&MemAccount::process)/1048576.0, bsasMemBudget, prevLevel, L);
+    return true;
+}
+
+extern "C" {
+epicsExportAddress(double, bsasMemBudget);
+epicsExportAddress(int, bsasMemLargeBytes);
+}
@@ -0,0 +1,73 @@
+#ifndef MEMBUDGET_H
+#define MEMBUDGET_H
+
+#include <epicsTypes.h>
+#include <epicsAtomic.h>
+
+extern "C" {
+// bytes held by all tables (MB) before shedding begins.  0 for unlimited
+extern double bsasMemBudget;
+// updates of at least this many bytes are "large" arrays, shed before others of the same tier
+extern int bsasMemLargeBytes;
+}
+
+/* Bytes held by DBRValue storage of one table, wherever the values are:
+ * Subscription queue, Collector events, or referenced by a Receiver table.
+ * Also accumulated into a process total.
+ */
+struct MemAccount {
+    size_t volatile bytes;
+
+    MemAccount() :bytes(0u) {}
+
+    void add(size_t n) {
+        epicsAtomicAddSizeT(&bytes, n);
+        epicsAtomicAddSizeT(&process, n);
+    }
+    void sub(size_t n) {
+        epicsAtomicSubSizeT(&bytes, n);
+        epicsAtomicSubSizeT(&process, n);
+    }
+
+    // all tables
+    static size_t volatile process;
+};
+
+/* Load shedding when the process total exceeds bsasMemBudget.
+ *
+ * Columns have a priority tier.  Tier 0 is never shed.  Higher tiers are shed first.
+ * Each increase of level sheds more: the large arrays of the highest tier not yet shed, then the rest of that tier.
+ *
+ * Updates of shed columns are dropped on arrival (counted as Subscription::Stats::nShed).
+ */
+struct MemBudget {
+    enum {
+        nTiers = 4,
+        DefaultTier = 1,
+        maxLevel = 2*(nTiers-1)
+    };
+
+    // current level.  0 sheds nothing.  Read from any thread.
+    static unsigned level() { return epicsAtomicGetIntT(&current); }
+
+    static bool sheds(unsigned level, unsigned tier, bool large);
+    // on CA worker, for each update
+    static bool sheds(unsigned tier, size_t nbytes) {
+        const unsigned L = level();
+        return L && sheds(L, tier, nbytes >= size_t(bsasMemLargeBytes));
+    }
+
+    /* Adjust level from process total.  Called periodically by each table.  Acts at most once per
+     * 'holdoff' seconds.  Raised when over budget, or directly to maxLevel when 50% over.
+     * Lowered after 5 consecutive steps below 80% of budget.  Returns true if level changed.
+     */
+    static bool step(double holdoff = 1.0);
+
+    // decision of step(), without side effects.  Exposed for unittest
+    static unsigned next(unsigned level, size_t total, size_t budget, unsigned& quiet, unsigned holdoff);
+
+private:
+    static int volatile current;
+};
+
+#endif // MEMBUDGET_H
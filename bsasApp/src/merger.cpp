@@ -0,0 +1,120 @@
+
+#include <algorithm>
+
+#include "merger.h"
+
+Merger::Merger(size_t ncolumns)
+    :streams(ncolumns)
+    ,newest_key(0u)
+{}
+
+void Merger::reserve(size_t n)
+{
+    for(size_t i=0; i<streams.size(); i++) {
+        streams[i].values.reserve(n);
+        streams[i].keys.reserve(n);
+    }
+}
+
+void Merger::enqueue(size_t column, epicsUInt64 key)
+{
+    // binary search for first group with key <= ours
+    size_t lo = 0u, hi = order.size();
+    while(lo < hi) {
+        const size_t mid = lo + (hi-lo)/2u;
+        if(groups[order[mid]].key > key)
+            lo = mid+1u;
+        else
+            hi = mid;
+    }
+
+    if(lo==order.size() || groups[order[lo]].key!=key) {
+        // new group
+        size_t idx;
+        if(free_groups.empty()) {
+            idx = groups.size();
+            groups.push_back(Group());
+        } else {
+            idx = free_groups.back();
+            free_groups.pop_back();
+        }
+        groups[idx].key = key;
+        order.insert(order.begin()+lo, idx);
+    }
+
+    groups[order[lo]].columns.push_back(column);
+}
+
+bool Merger::push(size_t column, epicsUInt64 key, DBRValue& val)
+{
+    Stream& S = streams[column];
+
+    if(key <= S.last)
+        return false;
+    S.last = key;
+
+    if(S.head==S.values.size()) {
+        // was empty.  start from beginning of buffer
+        S.values.clear();
+        S.keys.clear();
+        S.head = 0u;
+
+        enqueue(column, key);
+    }
+
+    S.values.push_back(DBRValue());
+    S.values.back().swap(val);
+    S.keys.push_back(key);
+
+    if(key > newest_key)
+        newest_key = key;
+
+    return true;
+}
+
+epicsUInt64 Merger::pop(slice_t* slice, size_t offset)
+{
+    const size_t idx = order.back();
+    order.pop_back();
+
+    const epicsUInt64 key = groups[idx].key;
+
+    // enqueue() may reallocate groups[], so index each time
+    for(size_t i=0; i<groups[idx].columns.size(); i++) {
+        const size_t column = groups[idx].columns[i];
+
+        Stream& S = streams[column];
+
+        if(slice)
+            (*slice)[offset+column].swap(S.values[S.head]);
+        S.values[S.head].reset();
+        S.head++;
+
+        if(S.head==S.values.size()) {
+            // drained.  keep capacity
+            S.values.clear();
+            S.keys.clear();
+            S.head = 0u;
+
+        } else {
+            if(S.head >= 32u && 2u*S.head >= S.values.size()) {
+                // compact to bound growth while never fully drained
+                const size_t N = S.values.size() - S.head;
+                for(size_t n=0; n<N; n++) {
+                    S.values[n].swap(S.values[S.head+n]);
+                    S.keys[n] = S.keys[S.head+n];
+                }
+                S.values.resize(N);
+                S.keys.resize(N);
+                S.head = 0u;
+            }
+
+            enqueue(column, S.keys[S.head]);
+        }
+    }
+
+    groups[idx].columns.clear(); // keep capacity
+    free_groups.push_back(idx);
+
+    return key;
+}
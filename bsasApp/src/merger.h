@@ -0,0 +1,76 @@
+#ifndef MERGER_H
+#define MERGER_H
+
+#include <vector>
+
+#include <epicsTypes.h>
+
+#include "collect_ca.h"
+
+/* k-way merge of per-column streams of DBRValue, each increasing in key,
+ * into slices of values having equal keys.
+ *
+ * The priority queue holds the distinct keys found at the heads of the
+ * columns, each with the list of columns having that key.  As columns
+ * tend to share keys, there are few distinct keys, and finding the
+ * place of a column in the queue is cheaper than an O(log(# columns)) heap.
+ * Not thread safe.
+ */
+struct Merger {
+    typedef std::vector<DBRValue> slice_t;
+
+    explicit Merger(size_t ncolumns);
+
+    size_t columns() const { return streams.size(); }
+
+    // pre-allocate for n values per column
+    void reserve(size_t n);
+
+    // # of values queued for column
+    size_t staged(size_t column) const {
+        const Stream& S = streams[column];
+        return S.values.size() - S.head;
+    }
+
+    bool empty() const { return order.empty(); }
+
+    // key of oldest queued value.  Only if !empty()
+    epicsUInt64 oldest() const { return groups[order.back()].key; }
+    // greatest key ever pushed.  Which is the newest queued value, unless
+    // a value older than previously pop()'d values is pushed.
+    epicsUInt64 newest() const { return newest_key; }
+
+    // queue value for column.  On success val is swapped with an empty value.
+    // Returns false, and ignores val, if key is not greater than the previous key for column (or is zero).
+    bool push(size_t column, epicsUInt64 key, DBRValue& val);
+
+    // remove all values with the oldest key.  Moved to slice[offset+column] if slice!=NULL.
+    // slice must have at least offset+columns() elements.  Returns key.  Only if !empty()
+    epicsUInt64 pop(slice_t* slice, size_t offset = 0u);
+
+private:
+    struct Stream {
+        std::vector<DBRValue> values;
+        std::vector<epicsUInt64> keys;
+        size_t head; // index of first queued value
+        epicsUInt64 last; // most recently pushed key
+        Stream() :head(0u), last(0u) {}
+    };
+    std::vector<Stream> streams;
+
+    struct Group {
+        epicsUInt64 key;
+        std::vector<size_t> columns; // whose next value has key
+    };
+    // storage for Groups, including free ones.  Never shrinks.
+    std::vector<Group> groups;
+    std::vector<size_t> free_groups;
+    // indices into groups[] of active groups, in order of decreasing key.  oldest at back
+    std::vector<size_t> order;
+
+    void enqueue(size_t column, epicsUInt64 key);
+
+    epicsUInt64 newest_key;
+};
+
+#endif // MERGER_H
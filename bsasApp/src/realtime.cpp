@@ -0,0 +1,157 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __linux__
+#  include <pthread.h>
+#  include <sched.h>
+#  include <sys/mman.h>
+#endif
+
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <errlog.h>
+
+#include "realtime.h"
+
+#include <epicsExport.h>
+
+RealTime::Config RealTime::roles[RealTime::nRoles];
+int bsasRTMemLock;
+
+namespace {
+
+epicsThreadOnceId applied_once = EPICS_THREAD_ONCE_INIT;
+epicsThreadPrivateId applied;
+
+void applied_init(void *)
+{
+    applied = epicsThreadPrivateCreate();
+}
+
+} // namespace
+
+const char* RealTime::name(Role role)
+{
+    switch(role) {
+    case CA: return "ca";
+    case Processor: return "processor";
+    case Coordinator: return "coordinator";
+    default: return "???";
+    }
+}
+
+void RealTime::apply(const Config& conf, const char *what)
+{
+    if(conf.cpus.empty() && conf.prio<=0)
+        return;
+
+#ifdef __linux__
+    pthread_t self = pthread_self();
+
+    if(!conf.cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+
+        // comma separated list of CPU numbers and ranges
+        const char *s = conf.cpus.c_str();
+        while(*s) {
+            char *end;
+            long first = strtol(s, &end, 10), last = first;
+            if(end==s) break;
+            s = end;
+            if(*s=='-') {
+                last = strtol(s+1, &end, 10);
+                s = end;
+            }
+            for(long c=first; c>=0 && c<=last && c<CPU_SETSIZE; c++)
+                CPU_SET(c, &cpus);
+            if(*s==',') s++;
+            else break;
+        }
+
+        int err = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+        if(err)
+            errlogPrintf("%s : unable to pin %s thread to CPUs %s : %s\n",
+                         epicsThreadGetNameSelf(), what, conf.cpus.c_str(), strerror(err));
+    }
+
+    if(conf.prio>0) {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = conf.prio;
+
+        int err = pthread_setschedparam(self, SCHED_FIFO, &param);
+        if(err)
+            errlogPrintf("%s : unable to set SCHED_FIFO %d for %s thread : %s\n",
+                         epicsThreadGetNameSelf(), conf.prio, what, strerror(err));
+    }
+#else
+    errlogPrintf("Real-time thread configuration not supported on this target\n");
+#endif
+}
+
+void RealTime::applyOnce(const Config& conf, const char *what)
+{
+    epicsThreadOnce(&applied_once, &applied_init, 0);
+
+    if(!epicsThreadPrivateGet(applied)) {
+        epicsThreadPrivateSet(applied, &applied); // any non-NULL
+        apply(conf, what);
+    }
+}
+
+void RealTime::lockMemory()
+{
+    if(!bsasRTMemLock)
+        return;
+#ifdef __linux__
+    if(mlockall(MCL_CURRENT|MCL_FUTURE))
+        errlogPrintf("Unable to lock memory : %s\n", strerror(errno));
+#else
+    errlogPrintf("Memory locking not supported on this target\n");
+#endif
+}
+
+void LatencyHistogram::reset()
+{
+    for(size_t i=0; i<nBins; i++)
+        bins[i] = 0u;
+    count = total = max = 0u;
+}
+
+void LatencyHistogram::add(epicsUInt64 ns)
+{
+    epicsUInt64 us = ns/1000u;
+    size_t bin = 0u;
+    while(us && bin<nBins-1u) {
+        us >>= 1u;
+        bin++;
+    }
+    bins[bin]++;
+    count++;
+    total += ns;
+    if(max < ns)
+        max = ns;
+}
+
+void LatencyHistogram::show(const char *indent) const
+{
+    epicsStdoutPrintf("%s#=%llu mean=%.1f us max=%.1f us\n", indent,
+                      (unsigned long long)count, count ? total/1e3/count : 0.0, max/1e3);
+
+    for(size_t i=0; i<nBins; i++) {
+        if(!bins[i]) continue;
+        if(i==0u)
+            epicsStdoutPrintf("%s  [0, 1) us\t%zu\n", indent, bins[i]);
+        else if(i==nBins-1u)
+            epicsStdoutPrintf("%s  [%lu, inf) us\t%zu\n", indent, 1ul<<(i-1u), bins[i]);
+        else
+            epicsStdoutPrintf("%s  [%lu, %lu) us\t%zu\n", indent, 1ul<<(i-1u), 1ul<<i, bins[i]);
+    }
+}
+
+extern "C" {
+epicsExportAddress(int, bsasRTMemLock);
+}
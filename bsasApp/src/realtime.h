@@ -0,0 +1,60 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <string>
+
+#include <epicsTypes.h>
+
+// lock process memory, and prefault buffers where possible
+extern "C"
+int bsasRTMemLock;
+
+/* Optional real-time operation.  Configured from iocsh before iocInit().
+ *
+ * Each thread Role may be pinned to a set of CPUs, and/or run with SCHED_FIFO.
+ * Currently only implemented for Linux.
+ */
+struct RealTime {
+    enum Role {
+        CA,          // CA worker threads which run Subscription callbacks
+        Processor,   // Collector processor, shard, and deliverer threads.  Also pool workers.
+        Coordinator, // Coordinator handler thread.  Ignored with an Executor, whose workers have the Processor role
+        nRoles
+    };
+
+    struct Config {
+        std::string cpus; // eg. "2,4-5".  Empty for any
+        int prio; // SCHED_FIFO priority [1, 99].  0 leaves scheduling unchanged
+        Config() :prio(0) {}
+    };
+
+    static Config roles[nRoles];
+
+    // apply configuration for role to the calling thread
+    static void apply(Role role) { apply(roles[role], name(role)); }
+    static void apply(const Config& conf, const char *what);
+    // apply() once per thread
+    static void applyOnce(Role role) { applyOnce(roles[role], name(role)); }
+    static void applyOnce(const Config& conf, const char *what);
+
+    // lock all current and future process memory, if configured
+    static void lockMemory();
+
+    static const char* name(Role role);
+};
+
+// log2 histogram of latencies
+struct LatencyHistogram {
+    enum {nBins = 24}; // [0, 1us) [1, 2us) [2, 4us) ... [2**22 us, inf)
+
+    size_t bins[nBins];
+    epicsUInt64 count, total, max; // ns
+
+    LatencyHistogram() { reset(); }
+
+    void reset();
+    void add(epicsUInt64 ns);
+    void show(const char *indent) const;
+};
+
+#endif // REALTIME_H
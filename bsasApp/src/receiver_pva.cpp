@@ -1,5 +1,12 @@
 
+#include <stdio.h>
+
+#include <map>
+#include <fstream>
+#include <sstream>
+
 #include <epicsMath.h>
+#include <epicsStdio.h>
 #include <errlog.h>
 
 #include <pv/reftrack.h>
@@ -34,12 +41,128 @@ void mangleName(std::string& name)
     }
 }
 
+// identifies a PV list in a schema file.  FNV-1a
+std::string schema_key(const std::vector<std::string>& pvs)
+{
+    epicsUInt64 H = 14695981039346656037ull;
+    for(size_t i=0, N=pvs.size(); i<N; i++) {
+        const std::string& name = pvs[i];
+        for(size_t c=0, C=name.size(); c<=C; c++) {
+            H ^= c<C ? (unsigned char)name[c] : '\n';
+            H *= 1099511628211ull;
+        }
+    }
+    char buf[32];
+    epicsSnprintf(buf, sizeof(buf), "hash %016llx", (unsigned long long)H);
+    return buf;
+}
+
+/* Apply types from a schema file written by PVAReceiver::save_schema(), if for the same PV list.
+ * One line per column: PV name, field name, ScalarType, isarray.
+ */
+void load_schema(const std::string& fname, const std::vector<std::string>& pvs, PVAReceiver::columns_t& cols)
+{
+    std::ifstream strm(fname.c_str());
+    std::string line;
+    if(!strm.is_open() || !std::getline(strm, line))
+        return;
+
+    if(line!=schema_key(pvs)) {
+        if(receiverPVADebug>0)
+            errlogPrintf("%s is for a different PV list.  ignored\n", fname.c_str());
+        return;
+    }
+
+    size_t c=0;
+    for(; c<cols.size() && std::getline(strm, line); c++) {
+        std::istringstream parse(line);
+        std::string name, field;
+        int ftype = -1, isarray = 0;
+        if(!(parse>>name>>field>>ftype>>isarray)
+                || name!=pvs[c] || field!=cols[c].fname // field name mangling changed?
+                || ftype<0 || ftype>=int(pvd::pvString))
+            break;
+
+        cols[c].ftype = pvd::ScalarType(ftype);
+        cols[c].isarray = isarray!=0;
+        cols[c].cached = true;
+    }
+
+    if(receiverPVADebug>0)
+        errlogPrintf("%s provides types of %zu of %zu columns\n", fname.c_str(), c, cols.size());
+}
+
 template<typename T>
 struct default_value { static inline T is() { return 0; } };
 template<> struct default_value<float>  { static inline float is() { return epicsNAN; } };
 template<> struct default_value<double>  { static inline double is() { return epicsNAN; } };
 template<> struct default_value<std::string>  { static inline std::string is() { return ""; } };
 
+// storage type of a scalar column.  Integers up to 32 bits as int, all else as double
+pvd::ScalarType scalarColumnType(pvd::ScalarType type)
+{
+    switch(type) {
+    case pvd::pvByte:
+    case pvd::pvUByte:
+    case pvd::pvShort:
+    case pvd::pvUShort:
+    case pvd::pvInt:
+        return pvd::pvInt;
+    case pvd::pvUInt:
+        return pvd::pvUInt;
+    default:
+        return pvd::pvDouble;
+    }
+}
+
+/* Widen column type to also hold 'type'/'isarray'.  Returns true if changed.
+ *
+ * Column types form a lattice, and only move up.  So a PV alternating between types settles after one retype.
+ *   scalar -> array
+ *   element types: same, or integers -> int, anything else -> double
+ */
+bool widenColumn(PVAReceiver::Column& col, pvd::ScalarType type, bool isarray)
+{
+    pvd::ScalarType ftype = type;
+
+    if(col.typed) { // otherwise replace default or cached type
+        isarray |= col.isarray;
+        if(type!=col.ftype)
+            ftype = scalarColumnType(type)==scalarColumnType(col.ftype) ? scalarColumnType(type) : pvd::pvDouble;
+    }
+    if(!isarray)
+        ftype = scalarColumnType(ftype);
+
+    const bool change = ftype!=col.ftype || isarray!=col.isarray;
+    if(change && receiverPVADebug>1) {
+        errlogPrintf("%s type change from %s %d to %s %d\n", col.fname.c_str(),
+                     col.isarray?"array":"scalar", col.ftype, isarray?"array":"scalar", ftype);
+    }
+    col.typed = true;
+    col.cached = false;
+    col.ftype = ftype;
+    col.isarray = isarray;
+    return change;
+}
+
+// value of a scalar cell, converted
+template<typename T>
+T cellValue(const DBRValue& cell)
+{
+    const void *raw = cell->data();
+    switch(cell->type) {
+    case pvd::pvByte:   return T(*static_cast<const pvd::int8*>(raw));
+    case pvd::pvUByte:  return T(*static_cast<const pvd::uint8*>(raw));
+    case pvd::pvShort:  return T(*static_cast<const pvd::int16*>(raw));
+    case pvd::pvUShort: return T(*static_cast<const pvd::uint16*>(raw));
+    case pvd::pvInt:    return T(*static_cast<const pvd::int32*>(raw));
+    case pvd::pvUInt:   return T(*static_cast<const pvd::uint32*>(raw));
+    case pvd::pvFloat:  return T(*static_cast<const float*>(raw));
+    case pvd::pvDouble: return T(*static_cast<const double*>(raw));
+    default:            return default_value<T>::is();
+    }
+}
+
 // scalar types other than string
 template<typename T>
 struct NumericScalarCopier : public PVAReceiver::ColCopy
@@ -55,7 +178,7 @@ struct NumericScalarCopier : public PVAReceiver::ColCopy
     }
     virtual ~NumericScalarCopier() {}
 
-    virtual void copy(const PVAReceiver::slices_t &s, size_t coln)
+    virtual size_t copy(const PVAReceiver::slices_t &s, size_t coln)
     {
         pvd::shared_vector<value_type> scratch(s.size(), default_value<value_type>::is());
         PVAReceiver::Column& column = receiver.columns.at(coln);
@@ -73,31 +196,17 @@ struct NumericScalarCopier : public PVAReceiver::ColCopy
                 column.last.swap(cell);
                 continue;
 
-            } else if(cell->count!=1 || cell->buffer.original_type()!=column.ftype) {
-                column.ftype = cell->buffer.original_type();
-                column.isarray = cell->count!=1;
-                receiver.state = PVAReceiver::NeedRetype;
-                column.last.reset();
-                if(receiverPVADebug>1) {
-                    errlogPrintf("%s triggers type change from scalar %d to %s %d\n",
-                                 column.fname.c_str(), column.ftype,
-                                 cell->count==1?"scalar":"array", cell->buffer.original_type());
-                }
-                return;
+            } else if(cell->count==1) {
+                // column already widened to hold this type without loss
+                scratch[r] = cellValue<value_type>(cell);
             }
-            assert(column.ftype==(pvd::ScalarType)pvd::ScalarTypeID<value_type>::value);
-
-            // could just alias cell->buffer.data()
-            const pvd::shared_vector<const value_type>& elem(pvd::static_shared_vector_cast<const value_type>(cell->buffer));
-            assert(elem.size()==1);
-
-            scratch[r] = elem[0];
 
             column.last.swap(cell);
         }
 
         field->replace(pvd::freeze(scratch));
         receiver.changed.set(field->getFieldOffset());
+        return s.size()*sizeof(value_type);
     }
 };
 
@@ -120,10 +229,13 @@ struct NumericArrayCopier : public PVAReceiver::ColCopy
     }
     virtual ~NumericArrayCopier() {}
 
-    virtual void copy(const PVAReceiver::slices_t &s, size_t coln)
+    virtual size_t copy(const PVAReceiver::slices_t &s, size_t coln)
     {
         pvd::PVUnionArray::svector scratch(s.size()); // initialized with NULLs
         PVAReceiver::Column& column = receiver.columns.at(coln);
+        // elements only.  Not the PVUnion and PVScalarArray of each cell
+        size_t nbytes = s.size()*sizeof(pvd::PVUnionPtr);
+        const size_t esize = pvd::ScalarTypeFunc::elementSize(arrtype->getElementType());
 
         pvd::PVDataCreatePtr create(pvd::getPVDataCreate());
 
@@ -139,22 +251,12 @@ struct NumericArrayCopier : public PVAReceiver::ColCopy
                 // disconnected
                 column.last.swap(cell);
                 continue;
-
-            } else if(cell->buffer.original_type()!=column.ftype) {
-                column.ftype = arrtype->getElementType();
-                // always an array.  never switches (back) to scalar
-                receiver.state = PVAReceiver::NeedRetype;
-                column.last.reset();
-                if(receiverPVADebug>1) {
-                    errlogPrintf("%s triggers type change from array %d to array %d\n",
-                                 column.fname.c_str(), column.ftype,
-                                 cell->buffer.original_type());
-                }
-                return;
             }
 
+            // converts narrower element types, and scalars
             pvd::PVScalarArrayPtr arr(create->createPVScalarArray(arrtype));
-            arr->putFrom(cell->buffer);
+            arr->putFrom(cell->buffer());
+            nbytes += arr->getLength()*esize;
 
             pvd::PVUnionPtr U(create->createPVUnion(utype));
             U->set(0, arr);
@@ -165,6 +267,7 @@ struct NumericArrayCopier : public PVAReceiver::ColCopy
 
         field->replace(pvd::freeze(scratch));
         receiver.changed.set(field->getFieldOffset());
+        return nbytes;
     }
 };
 
@@ -172,21 +275,29 @@ struct NumericArrayCopier : public PVAReceiver::ColCopy
 
 size_t PVAReceiver::num_instances;
 
-PVAReceiver::PVAReceiver(Collector& collector)
+PVAReceiver::PVAReceiver(Collector& collector, const std::string& schema_file)
     :collector(collector)
     ,pv(pvas::SharedPV::buildReadOnly())
+    ,schema_file(schema_file)
     ,state(NeedRetype)
+    ,nRetype(0u)
+    ,schema_changed(false)
+    ,posted_bytes(0u)
 {
     REFTRACE_INCREMENT(num_instances);
     collector.add_receiver(this); // calls our names()
     // populate initial type
-    slices(slices_t());
+    update_type();
 }
 
 PVAReceiver::~PVAReceiver()
 {
     REFTRACE_DECREMENT(num_instances);
     close();
+    // any change since the last save_schema()
+    save_schema();
+    Guard G(mutex);
+    charge(0u);
 }
 
 void PVAReceiver::close()
@@ -214,13 +325,37 @@ void PVAReceiver::names(const std::vector<std::string>& pvs)
     Ls.push_back("secondsPastEpoch");
     Ls.push_back("nanoseconds");
 
+    if(!schema_file.empty())
+        load_schema(schema_file, pvs, cols);
+
     {
         Guard G(mutex);
+
+        {
+            // PVs kept by Collector::setNames() keep their learned type, and last value for backfill
+            std::map<std::string, size_t> prev;
+            for(size_t c=0, C=std::min(columns.size(), labels.size()); c<C; c++)
+                prev.insert(std::make_pair(labels[c], c));
+
+            for(size_t i=0, N=pvs.size(); i<N; i++) {
+                std::map<std::string, size_t>::const_iterator it(prev.find(pvs[i]));
+                if(it==prev.end())
+                    continue;
+                const Column& old = columns[it->second];
+                cols[i].ftype = old.ftype;
+                cols[i].isarray = old.isarray;
+                cols[i].last = old.last;
+                cols[i].typed = old.typed;
+                cols[i].cached = old.cached;
+            }
+        }
+
         columns.swap(cols);
         labels = pvd::freeze(Ls);
 
         root.reset();
         changed.clear();
+        charge(0u);
 
         state = NeedRetype;
     }
@@ -228,84 +363,213 @@ void PVAReceiver::names(const std::vector<std::string>& pvs)
     pv->close(); // paranoia?
 }
 
-void PVAReceiver::slices(const slices_t& s)
+// with mutex locked, and state==NeedRetype.  Rebuild structure from columns, and (re)open pv
+void PVAReceiver::retype(Guard& G)
 {
+    state = RetypeInProg;
+    if(receiverPVADebug>0) {
+        errlogPrintf("PVAReceiver type change\n");
+    }
+    if(root) // not the first type for the current PV list
+        epicsAtomicIncrSizeT(&nRetype);
+
+    pvd::FieldBuilderPtr builder(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->setId("epics:nt/NTTable:1.0")
+                                 ->addArray("labels", pvd::pvString)
+                                 ->addNestedStructure("value"));
+
+    for(size_t i=0, N=columns.size(); i<N; i++) {
+        Column& col = columns[i];
+        if(!col.isarray) {
+            builder = builder->addArray(col.fname, col.ftype);
+        } else {
+            builder = builder->addNestedUnionArray(col.fname)
+                                ->addArray("arr", col.ftype)
+                             ->endNested();
+        }
+    }
+
+    pvd::StructureConstPtr type(builder
+                                    ->addArray("secondsPastEpoch", pvd::pvUInt)
+                                    ->addArray("nanoseconds", pvd::pvUInt)
+                                ->endNested() // end of .value
+                                //->add("alarm", pvd::getStandardField()->alarm())
+                                //->add("timeStamp", pvd::getStandardField()->timeStamp())
+                                ->createStructure());
+    root = pvd::getPVDataCreate()->createPVStructure(type);
+    changed.clear();
+    charge(0u);
+
+    fsec = root->getSubFieldT<pvd::PVUIntArray>("value.secondsPastEpoch");
+    fnsec = root->getSubFieldT<pvd::PVUIntArray>("value.nanoseconds");
+
     {
-        Guard G(mutex);
+        pvd::PVStringArrayPtr flabels(root->getSubFieldT<pvd::PVStringArray>("labels"));
+        flabels->replace(labels);
+        changed.set(flabels->getFieldOffset());
+    }
 
-        if(state == NeedRetype) {
-            state = RetypeInProg;
-            if(receiverPVADebug>0) {
-                errlogPrintf("PVAReceiver type change\n");
-            }
+    pvd::PVStructurePtr value(root->getSubFieldT<pvd::PVStructure>("value"));
 
-            pvd::FieldBuilderPtr builder(pvd::getFieldCreate()->createFieldBuilder()
-                                         ->setId("epics:nt/NTTable:1.0")
-                                         ->addArray("labels", pvd::pvString)
-                                         ->addNestedStructure("value"));
-
-            for(size_t i=0, N=columns.size(); i<N; i++) {
-                Column& col = columns[i];
-                if(!col.isarray) {
-                    builder = builder->addArray(col.fname, col.ftype);
-                } else {
-                    builder = builder->addNestedUnionArray(col.fname)
-                                        ->addArray("arr", col.ftype)
-                                     ->endNested();
-                }
-            }
+    for(size_t c=0, C=columns.size(); c<C; c++) {
+        Column& col = columns[c];
 
-            pvd::StructureConstPtr type(builder
-                                            ->addArray("secondsPastEpoch", pvd::pvUInt)
-                                            ->addArray("nanoseconds", pvd::pvUInt)
-                                        ->endNested() // end of .value
-                                        //->add("alarm", pvd::getStandardField()->alarm())
-                                        //->add("timeStamp", pvd::getStandardField()->timeStamp())
-                                        ->createStructure());
-            root = pvd::getPVDataCreate()->createPVStructure(type);
-            changed.clear();
-
-            fsec = root->getSubFieldT<pvd::PVUIntArray>("value.secondsPastEpoch");
-            fnsec = root->getSubFieldT<pvd::PVUIntArray>("value.nanoseconds");
-
-            {
-                pvd::PVStringArrayPtr flabels(root->getSubFieldT<pvd::PVStringArray>("labels"));
-                flabels->replace(labels);
-                changed.set(flabels->getFieldOffset());
-            }
+        if(col.isarray) {
+            col.copier.reset(new NumericArrayCopier(*this, c));
+        } else if(col.ftype==pvd::pvInt) {
+            col.copier.reset(new NumericScalarCopier<pvd::PVIntArray>(*this, c));
+        } else if(col.ftype==pvd::pvUInt) {
+            col.copier.reset(new NumericScalarCopier<pvd::PVUIntArray>(*this, c));
+        } else {
+            // scalarColumnType()
+            col.copier.reset(new NumericScalarCopier<pvd::PVDoubleArray>(*this, c));
+        }
+    }
 
-            pvd::PVStructurePtr value(root->getSubFieldT<pvd::PVStructure>("value"));
-
-            for(size_t c=0, C=columns.size(); c<C; c++) {
-                Column& col = columns[c];
-
-                if(!col.isarray && col.ftype==pvd::pvDouble) {
-                    col.copier.reset(new NumericScalarCopier<pvd::PVDoubleArray>(*this, c));
-                } else if(!col.isarray && col.ftype==pvd::pvInt) {
-                    col.copier.reset(new NumericScalarCopier<pvd::PVIntArray>(*this, c));
-                } else if(!col.isarray && col.ftype==pvd::pvUInt) {
-                    col.copier.reset(new NumericScalarCopier<pvd::PVUIntArray>(*this, c));
-                } else if(col.isarray) {
-                    col.copier.reset(new NumericArrayCopier(*this, c));
-                } else {
-                    // TODO: not supported
-                }
-            }
+    {
+        UnGuard U(G);
+        pv->close();
+        pv->open(*root, changed);
+    }
 
-            {
-                UnGuard U(G);
-                pv->close();
-                pv->open(*root, changed);
-            }
+    state = Run;
+    stateRun.signal();
+
+    schema_changed = true;
+}
 
-            state = Run;
-            stateRun.signal();
+void PVAReceiver::save_schema()
+{
+    if(schema_file.empty())
+        return;
 
+    std::ostringstream content;
+    {
+        Guard G(mutex);
+        if(!schema_changed)
+            return;
+        schema_changed = false;
+
+        std::vector<std::string> pvs(columns.size());
+        for(size_t c=0; c<pvs.size(); c++)
+            pvs[c] = labels[c];
+
+        content<<schema_key(pvs)<<"\n";
+        for(size_t c=0; c<columns.size(); c++) {
+            const Column& col = columns[c];
+            content<<pvs[c]<<" "<<col.fname<<" "<<int(col.ftype)<<" "<<int(col.isarray)<<"\n";
         }
+    }
 
-        while(state!=Run) {
-            UnGuard U(G);
-            stateRun.wait();
+    // replace atomically, so that a crash leaves the previous
+    const std::string temp(schema_file+".tmp");
+    {
+        std::ofstream strm(temp.c_str());
+        strm<<content.str();
+        strm.close();
+        if(strm.fail()) {
+            errlogPrintf("Unable to write %s\n", temp.c_str());
+            return;
+        }
+    }
+    if(rename(temp.c_str(), schema_file.c_str()))
+        errlogPrintf("Unable to replace %s\n", schema_file.c_str());
+}
+
+// Counted while held by our pv.  A client may briefly hold an older value while it is sent.
+void PVAReceiver::charge(size_t bytes)
+{
+    collector.mem->add(bytes);
+    collector.mem->sub(posted_bytes);
+    posted_bytes = bytes;
+}
+
+bool PVAReceiver::apply_native()
+{
+    bool need = false;
+    for(size_t c=0, C=std::min(columns.size(), collector.pvs.size()); c<C; c++) {
+        Column& col = columns[c];
+        const Subscription *sub = collector.pvs[c].sub.get();
+        if(col.typed || !sub || !epicsAtomicGetIntT(&sub->connected))
+            continue;
+
+        const int ftype = epicsAtomicGetIntT(&sub->nativeType);
+        const bool isarray = epicsAtomicGetIntT(&sub->nativeArray)!=0;
+        if(ftype<0 || sub->pvname!=labels[c])
+            continue; // between Collector::setNames() and our names()
+
+        if(col.cached && receiverPVADebug>0 && (scalarColumnType(pvd::ScalarType(ftype))!=scalarColumnType(col.ftype) || isarray!=col.isarray)) {
+            errlogPrintf("%s cached as %s %d, but connected as %s %d\n", col.fname.c_str(),
+                         col.isarray ? "array" : "scalar", col.ftype, isarray ? "array" : "scalar", ftype);
+        }
+        // replaces default or cached type
+        if(widenColumn(col, pvd::ScalarType(ftype), isarray)) {
+            col.last.reset();
+            need = true;
+        }
+    }
+    return need;
+}
+
+bool PVAReceiver::widen(const slices_t& s)
+{
+    bool need = false;
+    for(size_t c=0, C=columns.size(); c<C; c++) {
+        Column& col = columns[c];
+        // compare only the result for the whole batch.  eg. an untyped double column given int then double
+        const pvd::ScalarType ftype = col.ftype;
+        const bool isarray = col.isarray;
+
+        for(size_t r=0, R=s.size(); r<R; r++) {
+            const DBRValue& cell = s[r].second.at(c);
+            if(cell.valid() && cell->sevr <= 3)
+                widenColumn(col, cell->type, cell->count!=1);
+        }
+
+        need |= col.ftype!=ftype || col.isarray!=isarray;
+    }
+    return need;
+}
+
+bool PVAReceiver::type_connected()
+{
+    Guard G(mutex);
+    if(state==RetypeInProg)
+        return false; // try again later
+
+    const bool need = apply_native();
+    if(need)
+        state = NeedRetype;
+    return need;
+}
+
+void PVAReceiver::update_type()
+{
+    Guard G(mutex);
+    if(state == NeedRetype)
+        retype(G);
+}
+
+void PVAReceiver::slices(const slices_t& s)
+{
+    {
+        Guard G(mutex);
+
+        for(;;) {
+            if(state == NeedRetype) {
+                retype(G);
+
+            } else if(state!=Run) {
+                UnGuard U(G);
+                stateRun.wait();
+
+            } else if(apply_native() | widen(s)) {
+                // before copying, so that no value of this batch is dropped
+                state = NeedRetype;
+
+            } else {
+                break;
+            }
         }
 
         pvd::shared_vector<pvd::uint32> sec(s.size()), nsec(s.size());
@@ -321,12 +585,14 @@ void PVAReceiver::slices(const slices_t& s)
         changed.set(fsec->getFieldOffset());
         changed.set(fnsec->getFieldOffset());
 
+        size_t nbytes = 2u*s.size()*sizeof(pvd::uint32);
         for(size_t c=0, C=columns.size(); c<C; c++) { // for each column
             Column& col = columns[c];
 
             if(col.copier)
-                col.copier->copy(s, c);
+                nbytes += col.copier->copy(s, c);
         }
+        charge(nbytes);
 
         {
             UnGuard U(G);
@@ -12,11 +12,13 @@ struct PVAReceiver : public Receiver
 {
     static size_t num_instances;
 
-    PVAReceiver(Collector& collector);
+    // schema_file caches learned column types across restarts.  Empty to disable.
+    PVAReceiver(Collector& collector, const std::string& schema_file = std::string());
     virtual ~PVAReceiver();
 
     Collector& collector;
     const pvas::SharedPV::shared_pointer pv;
+    const std::string schema_file;
 
     epicsMutex mutex;
 
@@ -28,11 +30,15 @@ struct PVAReceiver : public Receiver
 
     epicsEvent stateRun;
 
+    // # of structure changes to fit a wider column type
+    size_t volatile nRetype;
+
     struct ColCopy {
         PVAReceiver& receiver;
         explicit ColCopy(PVAReceiver& receiver) :receiver(receiver) {}
         virtual ~ColCopy() {}
-        virtual void copy(const slices_t& s, size_t coln) =0;
+        // returns bytes allocated for the new column array
+        virtual size_t copy(const slices_t& s, size_t coln) =0;
     };
 
     struct Column {
@@ -43,8 +49,12 @@ struct PVAReceiver : public Receiver
 
         // last populated value, used to backfill
         DBRValue last;
+        // type from connected channel, or an update.  Afterwards only widened
+        bool typed;
+        // type loaded from schema_file, not yet checked against the connected channel
+        bool cached;
 
-        Column() :isarray(false), ftype(epics::pvData::pvDouble) {}
+        Column() :isarray(false), ftype(epics::pvData::pvDouble), typed(false), cached(false) {}
     };
 
     typedef std::vector<Column> columns_t;
@@ -60,6 +70,29 @@ struct PVAReceiver : public Receiver
 
     virtual void names(const std::vector<std::string>& n);
     virtual void slices(const slices_t& s);
+
+    // Type columns from newly connected channels (ca_field_type() and ca_element_count()),
+    // replacing default or cached types.  Returns true if a retype is needed.
+    bool type_connected();
+    // retype now if needed, instead of with the next slices()
+    void update_type();
+    // write schema_file if column types changed since the last call.
+    // Not on the deliverer, which would otherwise do file I/O with mutex locked.
+    void save_schema();
+
+private:
+    // with mutex locked.  Return true if any column type changed.
+    bool apply_native();
+    bool widen(const slices_t& s);
+    void retype(Guard& G);
+
+    // guarded by mutex.  Set by retype()
+    bool schema_changed;
+
+    // with mutex locked.  Charge the arrays of the current value of pv, in place of the previous
+    void charge(size_t bytes);
+    // bytes charged to collector.mem by the last charge()
+    size_t posted_bytes;
 };
 
 #endif // RECEIVER_PVA_H
@@ -0,0 +1,203 @@
+#include <string.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <unistd.h>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  define SPILL_MMAP
+#endif
+
+#include <stdexcept>
+
+#include "spill.h"
+
+namespace pvd = epics::pvData;
+
+SpillLog::SpillLog()
+    :base(0)
+    ,cap(0u)
+    ,head(0u)
+    ,tail(0u)
+    ,used(0u)
+    ,nrecords(0u)
+    ,marked(true)
+{}
+
+SpillLog::~SpillLog()
+{
+    close();
+}
+
+void SpillLog::open(const std::string& path, size_t bytes)
+{
+    close();
+
+    bytes &= ~size_t(7u);
+    if(bytes < 4096u)
+        throw std::runtime_error("Spill log must be at least 4096 bytes");
+
+#ifdef SPILL_MMAP
+    int fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if(fd<0)
+        throw std::runtime_error(std::string("Unable to open spill log ")+path+" : "+strerror(errno));
+
+    void *raw = MAP_FAILED;
+    int err = 0;
+    // sparse.  Disk blocks are allocated as pages are first written
+    if(ftruncate(fd, off_t(bytes))) {
+        err = errno;
+    } else {
+        raw = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if(raw==MAP_FAILED)
+            err = errno;
+    }
+    ::close(fd); // mapping holds a reference
+
+    if(raw==MAP_FAILED) {
+        unlink(path.c_str());
+        throw std::runtime_error(std::string("Unable to map spill log ")+path+" : "+strerror(err));
+    }
+
+    this->path = path;
+    base = static_cast<char*>(raw);
+    cap = bytes;
+    head = tail = used = nrecords = 0u;
+    runs.clear();
+    marked = true;
+#else
+    (void)path;
+    throw std::runtime_error("Spill log not supported on this target");
+#endif
+}
+
+void SpillLog::close()
+{
+    if(!base)
+        return;
+#ifdef SPILL_MMAP
+    munmap(base, cap);
+    unlink(path.c_str());
+#endif
+    base = 0;
+    cap = head = tail = used = nrecords = 0u;
+    runs.clear();
+    marked = true;
+}
+
+bool SpillLog::push(size_t column, const DBRValue& val)
+{
+    if(!base)
+        return false;
+
+    const size_t bytes = val->count*pvd::ScalarTypeFunc::elementSize(val->type),
+                 need = (sizeof(Record) + bytes + 7u) & ~size_t(7u);
+
+    if(nrecords==0u)
+        head = tail = used = 0u;
+
+    // records are contiguous.  skip the end if too short
+    size_t pos = tail, waste = 0u;
+    if(cap - pos < need) {
+        waste = cap - pos;
+        pos = 0u;
+    }
+    if(used + waste + need > cap)
+        return false;
+
+    if(waste >= sizeof(Record))
+        reinterpret_cast<Record*>(base+tail)->size = 0u;
+
+    Record *R = reinterpret_cast<Record*>(base+pos);
+    R->key = val->ts.secPastEpoch;
+    R->key <<= 32;
+    R->key |= val->ts.nsec;
+    R->size = need;
+    R->column = column;
+    R->secPastEpoch = val->ts.secPastEpoch;
+    R->nsec = val->ts.nsec;
+    R->count = val->count;
+    R->sevr = val->sevr;
+    R->stat = val->stat;
+    R->type = val->type;
+    R->popped = 0u;
+    memcpy(R+1, val->data(), bytes);
+
+    if(marked || runs.empty()) {
+        Run run = {pos, 0u};
+        runs.push_back(run);
+        marked = false;
+    }
+    runs.back().remaining++;
+
+    tail = pos + need;
+    used += waste + need;
+    nrecords++;
+    return true;
+}
+
+DBRValue SpillLog::pop(DBRValue::Pool *pool)
+{
+    const size_t r = least();
+    Run& run = runs[r];
+    Record *R = at(run.pos);
+    const pvd::ScalarType type = pvd::ScalarType(R->type);
+
+    // we are not the allocating thread of a Subscription Pool
+    DBRValue val(DBRValue::alloc(pool, type, R->count, false));
+    val->ts.secPastEpoch = R->secPastEpoch;
+    val->ts.nsec = R->nsec;
+    val->sevr = R->sevr;
+    val->stat = R->stat;
+    memcpy(val->data(), R+1, R->count*pvd::ScalarTypeFunc::elementSize(type));
+
+    R->popped = 1u;
+    nrecords--;
+    if(--run.remaining==0u) {
+        // the next push() can't extend a run which is no longer contiguous
+        marked |= r+1u==runs.size();
+        runs.erase(runs.begin()+r);
+    } else
+        run.pos = advance(run.pos);
+
+    if(nrecords==0u) {
+        head = tail = used = 0u;
+        runs.clear();
+        return val;
+    }
+
+    // reclaim removed values from the oldest
+    while(front()->popped) {
+        used -= front()->size;
+        head += front()->size;
+        skip();
+    }
+
+    return val;
+}
+
+size_t SpillLog::least() const
+{
+    size_t ret = 0u;
+    for(size_t r=1u, N=runs.size(); r<N; r++) {
+        if(at(runs[r].pos)->key < at(runs[ret].pos)->key)
+            ret = r;
+    }
+    return ret;
+}
+
+size_t SpillLog::advance(size_t pos) const
+{
+    pos += at(pos)->size;
+    if(cap - pos < sizeof(Record) || at(pos)->size==0u)
+        pos = 0u;
+    return pos;
+}
+
+void SpillLog::skip()
+{
+    if(cap - head < sizeof(Record) || front()->size==0u) {
+        used -= cap - head;
+        head = 0u;
+    }
+}
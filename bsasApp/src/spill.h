@@ -0,0 +1,90 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <string>
+#include <vector>
+
+#include <epicsTypes.h>
+
+#include "collect_ca.h"
+
+/* Bounded log of DBRValue in a memory mapped file, used as a ring.
+ * Holds updates which overflowed the Collector events buffer until they can be replayed.
+ * Contents are not preserved across restarts.  The file is removed by close().
+ * Not thread safe.
+ *
+ * Values are appended in runs, each begun by mark(), and each in increasing key order.
+ * Values are removed in key order, merging runs.  Space is reclaimed from the oldest run.
+ */
+struct SpillLog {
+    SpillLog();
+    ~SpillLog();
+
+    // Create (or truncate) and map a file of 'bytes'.  Throws std::runtime_error
+    void open(const std::string& path, size_t bytes);
+    // Discards contents
+    void close();
+
+    bool isOpen() const { return !!base; }
+    bool empty() const { return nrecords==0u; }
+    // # of values
+    size_t count() const { return nrecords; }
+    // bytes in use, and mapped
+    size_t size() const { return used; }
+    size_t capacity() const { return cap; }
+
+    // begin a new run with the next push()
+    void mark() { marked = true; }
+    // append one value of column.  Returns false if there is no room.
+    bool push(size_t column, const DBRValue& val);
+
+    // key and column of the value with the least key.  Only if !empty()
+    epicsUInt64 frontKey() const { return next()->key; }
+    size_t frontColumn() const { return next()->column; }
+
+    // remove the value with the least key, copied into storage charged to 'pool' (may be NULL).  Only if !empty()
+    DBRValue pop(DBRValue::Pool *pool = 0);
+
+private:
+    // precedes value bytes.  Padded to 8 bytes.
+    struct Record {
+        epicsUInt64 key;
+        epicsUInt32 size; // of record, including this header.  0 marks a skip to the start
+        epicsUInt32 column;
+        epicsUInt32 secPastEpoch, nsec;
+        epicsUInt32 count;
+        epicsUInt16 sevr, stat;
+        epicsUInt32 type;
+        epicsUInt32 popped; // removed, but not yet reclaimed
+    };
+    // values not yet removed, of a run
+    struct Run {
+        size_t pos; // offset of first Record not yet removed
+        size_t remaining;
+    };
+
+    std::string path;
+    char *base;
+    size_t cap,  // mapped bytes
+           head, // offset of oldest Record
+           tail, // offset of next Record
+           used, // bytes in use, including any skipped at the end
+           nrecords;
+    // oldest first.  Few, as each spilling pass of the Collector adds one
+    std::vector<Run> runs;
+    bool marked;
+
+    Record* at(size_t pos) const { return reinterpret_cast<Record*>(base+pos); }
+    const Record* front() const { return at(head); }
+    // Run with the least key
+    size_t least() const;
+    const Record* next() const { return at(runs[least()].pos); }
+    // offset of the Record after the one at pos, wrapping to the start
+    size_t advance(size_t pos) const;
+    // move head to the start if nothing more fits before the end
+    void skip();
+
+    EPICS_NOT_COPYABLE(SpillLog)
+};
+
+#endif // SPILL_H
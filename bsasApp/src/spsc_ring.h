@@ -0,0 +1,153 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <vector>
+
+#include <epicsAtomic.h>
+#include <pv/noDefaultMethods.h>
+
+/* Bounded FIFO for exactly one producer thread and one consumer thread.
+ *
+ * Storage is a chain of power of 2 sized segments.  The producer may
+ * switch to a new segment (eg. when the limit changes) at any time.
+ * The consumer frees a segment after draining it.
+ *
+ * Elements are moved in and out with swap(), so T must be
+ * default constructible and cheap to swap.
+ */
+template<typename T>
+class SPSCRing {
+    struct Segment {
+        std::vector<T> slots;
+        const size_t mask;
+        size_t end; // index of first element _not_ in this segment.  Valid once next!=0
+        EpicsAtomicPtrT volatile next;
+
+        explicit Segment(size_t cap) :slots(cap), mask(cap-1u), end(0u), next(0) {}
+    };
+
+    static size_t round_up(size_t n) {
+        size_t cap = 2u;
+        while(cap < n)
+            cap <<= 1u;
+        return cap;
+    }
+
+    // written by producer only
+    size_t volatile nPushed;
+    size_t _limit;
+    Segment *wr;
+    char pad[64];
+    // written by consumer only
+    size_t volatile nPopped;
+    Segment *rd;
+
+    // consumer side.  Find segment containing index n
+    Segment* seek(size_t n) {
+        for(;;) {
+            Segment *next = static_cast<Segment*>(epicsAtomicGetPtrT(&rd->next));
+            if(!next) break;
+            epicsAtomicReadMemoryBarrier(); // next before end
+            if(n!=rd->end) break;
+            delete rd;
+            rd = next;
+        }
+        return rd;
+    }
+
+public:
+    explicit SPSCRing(size_t limit)
+        :nPushed(0u)
+        ,_limit(limit)
+        ,wr(new Segment(round_up(limit)))
+        ,nPopped(0u)
+        ,rd(wr)
+    {}
+    ~SPSCRing() {
+        while(rd) {
+            Segment *next = static_cast<Segment*>(rd->next);
+            delete rd;
+            rd = next;
+        }
+    }
+
+    // approximate when called from a thread other than the producer or consumer
+    size_t size() const {
+        return epicsAtomicGetSizeT(&nPushed) - epicsAtomicGetSizeT(&nPopped);
+    }
+    bool empty() const { return size()==0u; }
+
+    size_t limit() const { return _limit; }
+
+    // producer side.  Change maximum number of queued elements.
+    void setLimit(size_t limit) {
+        const size_t cap = wr->mask+1u;
+        const size_t want = round_up(limit);
+        if(want > cap || want*4u <= cap) {
+            // switch to a new segment.  The consumer will free the current one when drained.
+            Segment *next = new Segment(want);
+            wr->end = nPushed;
+            epicsAtomicWriteMemoryBarrier();
+            epicsAtomicSetPtrT(&wr->next, next);
+            wr = next;
+        }
+        _limit = limit;
+    }
+
+    // producer side.  On success, v is swapped with an empty element.
+    // Returns false if full, in which case v is unchanged.
+    bool push(T& v) {
+        const size_t n = nPushed;
+        if(n - epicsAtomicGetSizeT(&nPopped) >= _limit)
+            return false;
+        epicsAtomicReadMemoryBarrier(); // consumer done with slot
+
+        wr->slots[n & wr->mask].swap(v);
+
+        epicsAtomicWriteMemoryBarrier(); // slot before index
+        epicsAtomicSetSizeT(&nPushed, n+1u);
+        return true;
+    }
+
+    // consumer side.  Move up to max elements onto the end of 'out'.
+    // Returns the number moved.
+    size_t pop(std::vector<T>& out, size_t max) {
+        size_t n = nPopped;
+        const size_t avail = epicsAtomicGetSizeT(&nPushed) - n;
+        if(max > avail)
+            max = avail;
+        if(!max)
+            return 0u;
+        epicsAtomicReadMemoryBarrier(); // index before slot
+
+        for(size_t i=0; i<max; i++, n++) {
+            Segment *seg = seek(n);
+            out.push_back(T());
+            out.back().swap(seg->slots[n & seg->mask]);
+        }
+
+        epicsAtomicWriteMemoryBarrier(); // slot before index
+        epicsAtomicSetSizeT(&nPopped, n);
+        return max;
+    }
+
+    // consumer side.  Returns false if empty
+    bool pop(T& out) {
+        const size_t n = nPopped;
+        if(epicsAtomicGetSizeT(&nPushed)==n)
+            return false;
+        epicsAtomicReadMemoryBarrier();
+
+        Segment *seg = seek(n);
+        out.swap(seg->slots[n & seg->mask]);
+        T().swap(seg->slots[n & seg->mask]);
+
+        epicsAtomicWriteMemoryBarrier();
+        epicsAtomicSetSizeT(&nPopped, n+1u);
+        return true;
+    }
+
+    EPICS_NOT_COPYABLE(SPSCRing)
+};
+
+#endif // SPSC_RING_H
@@ -0,0 +1,550 @@
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <epicsString.h>
+#include <epicsAtomic.h>
+#include <epicsMath.h>
+#include <errlog.h>
+
+#include <pv/reftrack.h>
+#include <pv/standardField.h>
+
+#include "status.h"
+
+#include <epicsExport.h>
+
+namespace pvd = epics::pvData;
+
+double bsasStatusPeriod = 10.0;
+int bsasStatusTopN = 20;
+
+namespace {
+
+pvd::StructureConstPtr type_status(pvd::getFieldCreate()->createFieldBuilder()
+                                   ->setId("epics:nt/NTTable:1.0")
+                                   ->addArray("labels", pvd::pvString)
+                                   ->addNestedStructure("value")
+                                       ->addArray("PV", pvd::pvString)
+                                       ->addArray("connected", pvd::pvBoolean)
+                                       ->addArray("nEvent", pvd::pvULong)
+                                       ->addArray("nBytes", pvd::pvULong)
+                                       ->addArray("nDiscon", pvd::pvULong)
+                                       ->addArray("nError", pvd::pvULong)
+                                       ->addArray("nOFlow", pvd::pvULong)
+                                       ->addArray("rate", pvd::pvDouble)
+                                       ->addArray("byteRate", pvd::pvDouble)
+                                       ->addArray("qLimit", pvd::pvULong)
+                                       ->addArray("nShed", pvd::pvULong)
+                                       ->addArray("memBytes", pvd::pvULong)
+                                       ->addArray("tier", pvd::pvUInt)
+                                       ->addArray("connectTime", pvd::pvDouble)
+                                       ->addArray("caContext", pvd::pvUInt)
+                                   ->endNested()
+                                   ->add("alarm", pvd::getStandardField()->alarm())
+                                   ->add("timeStamp", pvd::getStandardField()->timeStamp())
+                                   ->createStructure());
+
+pvd::StructureConstPtr type_summary(pvd::getFieldCreate()->createFieldBuilder()
+                                    ->add("nPV", pvd::pvULong)
+                                    ->add("nConnected", pvd::pvULong)
+                                    ->add("nEvent", pvd::pvULong)
+                                    ->add("nBytes", pvd::pvULong)
+                                    ->add("nDiscon", pvd::pvULong)
+                                    ->add("nError", pvd::pvULong)
+                                    ->add("nOFlow", pvd::pvULong)
+                                    ->add("nComplete", pvd::pvULong)  // Collector totals
+                                    ->add("nCollectorOFlow", pvd::pvULong)
+                                    ->add("nEvicted", pvd::pvULong)
+                                    ->add("nSpilled", pvd::pvULong)
+                                    ->add("nReplayed", pvd::pvULong)
+                                    ->add("nSpillDrop", pvd::pvULong)
+                                    ->add("spillBytes", pvd::pvULong)
+                                    ->add("replayLag", pvd::pvDouble) // seconds
+                                    ->add("nShed", pvd::pvULong)
+                                    ->add("memBytes", pvd::pvULong) // this table
+                                    ->add("memProcess", pvd::pvULong) // all tables
+                                    ->add("shedLevel", pvd::pvUInt)
+                                    ->add("connect50", pvd::pvDouble) // seconds.  NaN until reached
+                                    ->add("connect90", pvd::pvDouble)
+                                    ->add("connect100", pvd::pvDouble)
+                                    ->add("nRetype", pvd::pvULong)
+                                    ->addArray("caRate", pvd::pvDouble) // callbacks/sec of each CA context
+                                    ->addArray("caLoad", pvd::pvDouble) // callback busy sec/sec of each CA context
+                                    ->add("alarm", pvd::getStandardField()->alarm())
+                                    ->add("timeStamp", pvd::getStandardField()->timeStamp())
+                                    ->createStructure());
+
+pvd::PVStructurePtr build_table()
+{
+    pvd::PVStructurePtr root(pvd::getPVDataCreate()->createPVStructure(type_status));
+
+    pvd::shared_vector<std::string> labels;
+    labels.push_back("PV");
+    labels.push_back("connected");
+    labels.push_back("#Event");
+    labels.push_back("#Bytes");
+    labels.push_back("#Discon");
+    labels.push_back("#Error");
+    labels.push_back("#OFlow");
+    labels.push_back("Rate");
+    labels.push_back("ByteRate");
+    labels.push_back("QLimit");
+    labels.push_back("#Shed");
+    labels.push_back("MemBytes");
+    labels.push_back("Tier");
+    labels.push_back("ConnectTime");
+    labels.push_back("CAContext");
+
+    root->getSubFieldT<pvd::PVStringArray>("labels")->replace(pvd::freeze(labels));
+    return root;
+}
+
+void put_time(pvd::PVStructure& root, pvd::BitSet& changed, const epicsTimeStamp& now)
+{
+    pvd::PVScalarPtr fscale;
+    fscale = root.getSubFieldT<pvd::PVScalar>("timeStamp.secondsPastEpoch");
+    fscale->putFrom<pvd::uint32>(now.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
+    changed.set(fscale->getFieldOffset());
+    fscale = root.getSubFieldT<pvd::PVScalar>("timeStamp.nanoseconds");
+    fscale->putFrom<pvd::uint32>(now.nsec);
+    changed.set(fscale->getFieldOffset());
+}
+
+void put_count(pvd::PVStructure& root, pvd::BitSet& changed, const char *name, pvd::uint64 val)
+{
+    pvd::PVScalarPtr fld(root.getSubFieldT<pvd::PVScalar>(name));
+    fld->putFrom<pvd::uint64>(val);
+    changed.set(fld->getFieldOffset());
+}
+
+void put_double(pvd::PVStructure& root, pvd::BitSet& changed, const char *name, double val)
+{
+    pvd::PVScalarPtr fld(root.getSubFieldT<pvd::PVScalar>(name));
+    fld->putFrom<double>(val);
+    changed.set(fld->getFieldOffset());
+}
+
+// seconds until 'percent' of 'total' PVs had connected, from sorted first connection times.  NaN if not yet
+double connect_time(const std::vector<double>& sorted, size_t total, unsigned percent)
+{
+    const size_t n = (total*percent + 99u)/100u;
+    if(n==0u)
+        return 0.0;
+    return n <= sorted.size() ? sorted[n-1u] : epicsNAN;
+}
+
+struct WorstFirst {
+    const std::vector<Subscription::Stats>& delta;
+    explicit WorstFirst(const std::vector<Subscription::Stats>& delta) :delta(delta) {}
+    bool operator()(size_t a, size_t b) const {
+        const Subscription::Stats& A = delta[a];
+        const Subscription::Stats& B = delta[b];
+        if(A.nOverflows != B.nOverflows)
+            return A.nOverflows > B.nOverflows;
+        if(A.nShed != B.nShed)
+            return A.nShed > B.nShed;
+        if(A.nDisconnects != B.nDisconnects)
+            return A.nDisconnects > B.nDisconnects;
+        if(A.nErrors != B.nErrors)
+            return A.nErrors > B.nErrors;
+        return a < b;
+    }
+};
+
+// find string argument from RPC, either top level or NTURI query
+std::string rpc_arg(const pvd::PVStructure& args, const std::string& name)
+{
+    pvd::PVScalar::const_shared_pointer fld(args.getSubField<pvd::PVScalar>("query."+name));
+    if(!fld)
+        fld = args.getSubField<pvd::PVScalar>(name);
+    return fld ? fld->getAs<std::string>() : std::string();
+}
+
+} // namespace
+
+void StatusPublisher::Snapshot::rank(std::vector<size_t>& rows, size_t n) const
+{
+    std::vector<size_t> bad;
+    for(size_t i=0, N=delta.size(); i<N; i++) {
+        if(delta[i].nOverflows || delta[i].nShed || delta[i].nDisconnects || delta[i].nErrors)
+            bad.push_back(i);
+    }
+
+    n = std::min(n, bad.size());
+    std::partial_sort(bad.begin(), bad.begin()+n, bad.end(), WorstFirst(delta));
+    rows.insert(rows.end(), bad.begin(), bad.begin()+n);
+}
+
+void StatusPublisher::Snapshot::select(std::vector<size_t>& rows, const std::string& pattern, const std::string& only) const
+{
+    // member to test, or NULL for any
+    size_t Subscription::Stats::*count = 0;
+    bool disconnected = false;
+
+    if(only.empty()) {
+    } else if(only=="disconnected") {
+        disconnected = true;
+    } else if(only=="overflow") {
+        count = &Subscription::Stats::nOverflows;
+    } else if(only=="discon") {
+        count = &Subscription::Stats::nDisconnects;
+    } else if(only=="error") {
+        count = &Subscription::Stats::nErrors;
+    } else if(only=="shed") {
+        count = &Subscription::Stats::nShed;
+    } else {
+        throw std::runtime_error("only= must be one of: disconnected, overflow, discon, error, shed");
+    }
+
+    for(size_t i=0, N=delta.size(); i<N; i++) {
+        if(!pattern.empty() && !epicsStrGlobMatch(names[i].c_str(), pattern.c_str()))
+            continue;
+        if(disconnected && connected[i])
+            continue;
+        if(count && !(delta[i].*count))
+            continue;
+
+        rows.push_back(i);
+    }
+}
+
+size_t StatusPublisher::num_instances;
+
+StatusPublisher::StatusPublisher(pvas::StaticProvider& provider, const std::string& prefix)
+    :provider(provider)
+    ,prefix(prefix)
+    ,pv_status(pvas::SharedPV::buildReadOnly())
+    ,pv_summary(pvas::SharedPV::buildReadOnly())
+    ,pv_top(pvas::SharedPV::buildReadOnly())
+    ,root_status(build_table())
+    ,root_summary(pvd::getPVDataCreate()->createPVStructure(type_summary))
+    ,root_top(build_table())
+    ,ca_last(0u)
+{
+    REFTRACE_INCREMENT(num_instances);
+
+    last_full.secPastEpoch = 0;
+    last_full.nsec = 0;
+
+    pv_status->open(*root_status);
+    pv_summary->open(*root_summary);
+    pv_top->open(*root_top);
+
+    provider.add(prefix+"STS", pv_status);
+    provider.add(prefix+"SUM", pv_summary);
+    provider.add(prefix+"TOP", pv_top);
+}
+
+StatusPublisher::~StatusPublisher()
+{
+    REFTRACE_DECREMENT(num_instances);
+    provider.remove(prefix+"STS");
+    provider.remove(prefix+"SUM");
+    provider.remove(prefix+"TOP");
+}
+
+void StatusPublisher::fill(pvd::PVStructure& root, pvd::BitSet& changed,
+                           const Snapshot& snap, const std::vector<size_t>& rows,
+                           const epicsTimeStamp& now)
+{
+    pvd::shared_vector<std::string> names(rows.size());
+    pvd::shared_vector<pvd::boolean> conn(rows.size());
+    pvd::shared_vector<pvd::uint64> events(rows.size()),
+                                    bytes(rows.size()),
+                                    discons(rows.size()),
+                                    errors(rows.size()),
+                                    oflows(rows.size()),
+                                    limits(rows.size()),
+                                    sheds(rows.size()),
+                                    mem(rows.size());
+    pvd::shared_vector<pvd::uint32> tiers(rows.size()),
+                                    ctxts(rows.size());
+    pvd::shared_vector<double> rates(rows.size()),
+                               brates(rows.size()),
+                               ctimes(rows.size());
+
+    for(size_t r=0; r<rows.size(); r++) {
+        const size_t i = rows[r];
+        const Subscription::Stats& delta = snap.delta[i];
+
+        names[r] = snap.names[i];
+        conn[r] = snap.connected[i];
+        events[r] = delta.nUpdates;
+        bytes[r] = delta.nUpdateBytes;
+        discons[r] = delta.nDisconnects;
+        errors[r] = delta.nErrors;
+        oflows[r] = delta.nOverflows;
+        rates[r] = snap.rate[i];
+        brates[r] = snap.byteRate[i];
+        limits[r] = snap.limit[i];
+        sheds[r] = delta.nShed;
+        mem[r] = snap.memBytes[i];
+        tiers[r] = snap.tier[i];
+        ctimes[r] = snap.connectTime[i];
+        ctxts[r] = snap.context[i];
+    }
+
+    pvd::PVScalarArrayPtr farr;
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.PV");
+    farr->putFrom(pvd::freeze(names));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.connected");
+    farr->putFrom(pvd::freeze(conn));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.nEvent");
+    farr->putFrom(pvd::freeze(events));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.nBytes");
+    farr->putFrom(pvd::freeze(bytes));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.nDiscon");
+    farr->putFrom(pvd::freeze(discons));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.nError");
+    farr->putFrom(pvd::freeze(errors));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.nOFlow");
+    farr->putFrom(pvd::freeze(oflows));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.rate");
+    farr->putFrom(pvd::freeze(rates));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.byteRate");
+    farr->putFrom(pvd::freeze(brates));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.qLimit");
+    farr->putFrom(pvd::freeze(limits));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.nShed");
+    farr->putFrom(pvd::freeze(sheds));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.memBytes");
+    farr->putFrom(pvd::freeze(mem));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.tier");
+    farr->putFrom(pvd::freeze(tiers));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.connectTime");
+    farr->putFrom(pvd::freeze(ctimes));
+    changed.set(farr->getFieldOffset());
+
+    farr = root.getSubFieldT<pvd::PVScalarArray>("value.caContext");
+    farr->putFrom(pvd::freeze(ctxts));
+    changed.set(farr->getFieldOffset());
+
+    put_time(root, changed, now);
+}
+
+void StatusPublisher::update(Collector& collector, const Collector::names_t& names, bool changed, size_t nRetype)
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    assert(names.size()==collector.pvs.size());
+
+    Snapshot snap;
+    snap.names = names;
+    snap.connected.resize(names.size(), 0);
+    snap.delta.resize(names.size());
+    snap.rate.resize(names.size(), 0.0);
+    snap.byteRate.resize(names.size(), 0.0);
+    snap.limit.resize(names.size(), 0u);
+    snap.memBytes.resize(names.size(), 0u);
+    snap.tier.resize(names.size(), 0u);
+    snap.connectTime.resize(names.size(), epicsNAN);
+    snap.context.resize(names.size(), 0u);
+
+    Subscription::Stats total;
+    size_t nconnected = 0u;
+    // first connection times of those which have ever connected
+    std::vector<double> connected_after;
+    connected_after.reserve(names.size());
+    const size_t start = epicsAtomicGetSizeT(&collector.connect_start);
+
+    for(size_t i=0, N=collector.pvs.size(); i<N; i++) {
+        const Collector::PV& pv = collector.pvs[i];
+        if(!pv.sub)
+            continue;
+
+        Subscription& sub = *pv.sub;
+
+        // no locking.  CA callbacks and Collector continue unimpeded
+        Subscription::Stats cur;
+        sub.snapshot(cur);
+        snap.delta[i] = cur - sub.published;
+        sub.published = cur;
+
+        snap.connected[i] = epicsAtomicGetIntT(&sub.connected)!=0;
+        snap.rate[i] = epicsAtomicGetSizeT(&sub.estRate)*1e-3;
+        snap.byteRate[i] = epicsAtomicGetSizeT(&sub.estByteRate);
+        snap.limit[i] = sub.values.limit(); // approximate
+        snap.memBytes[i] = epicsAtomicGetSizeT(&sub.pool->inuse);
+        snap.tier[i] = sub.tier;
+        snap.context[i] = sub.channel->context.index;
+        const size_t at = epicsAtomicGetSizeT(&sub.connectedAt);
+        if(at) {
+            // kept by Collector::setNames() may have connected before the current list
+            snap.connectTime[i] = at > start ? (at - start)*1e-3 : 0.0;
+            connected_after.push_back(snap.connectTime[i]);
+        }
+
+        nconnected += snap.connected[i];
+        total.nUpdates += snap.delta[i].nUpdates;
+        total.nUpdateBytes += snap.delta[i].nUpdateBytes;
+        total.nDisconnects += snap.delta[i].nDisconnects;
+        total.nErrors += snap.delta[i].nErrors;
+        total.nOverflows += snap.delta[i].nOverflows;
+        total.nShed += snap.delta[i].nShed;
+    }
+
+    {
+        pvd::BitSet changes;
+        put_count(*root_summary, changes, "nPV", names.size());
+        put_count(*root_summary, changes, "nConnected", nconnected);
+        put_count(*root_summary, changes, "nEvent", total.nUpdates);
+        put_count(*root_summary, changes, "nBytes", total.nUpdateBytes);
+        put_count(*root_summary, changes, "nDiscon", total.nDisconnects);
+        put_count(*root_summary, changes, "nError", total.nErrors);
+        put_count(*root_summary, changes, "nOFlow", total.nOverflows);
+        put_count(*root_summary, changes, "nComplete", epicsAtomicGetSizeT(&collector.nComplete));
+        put_count(*root_summary, changes, "nCollectorOFlow", epicsAtomicGetSizeT(&collector.nOverflow));
+        size_t nevicted = 0u;
+        for(unsigned k=0; k<EvictPolicy::nKinds; k++)
+            nevicted += epicsAtomicGetSizeT(&collector.nEvicted[k]);
+        put_count(*root_summary, changes, "nEvicted", nevicted);
+        put_count(*root_summary, changes, "nSpilled", epicsAtomicGetSizeT(&collector.nSpilled));
+        put_count(*root_summary, changes, "nReplayed", epicsAtomicGetSizeT(&collector.nReplayed));
+        put_count(*root_summary, changes, "nSpillDrop", epicsAtomicGetSizeT(&collector.nSpillDrop));
+        put_count(*root_summary, changes, "spillBytes", epicsAtomicGetSizeT(&collector.spill_used));
+        put_double(*root_summary, changes, "replayLag", epicsAtomicGetSizeT(&collector.replay_lag_ms)*1e-3);
+        put_count(*root_summary, changes, "nShed", total.nShed);
+        put_count(*root_summary, changes, "memBytes", epicsAtomicGetSizeT(&collector.mem->bytes));
+        put_count(*root_summary, changes, "memProcess", epicsAtomicGetSizeT(&MemAccount::process));
+        put_count(*root_summary, changes, "shedLevel", MemBudget::level());
+        std::sort(connected_after.begin(), connected_after.end());
+        put_double(*root_summary, changes, "connect50", connect_time(connected_after, names.size(), 50u));
+        put_double(*root_summary, changes, "connect90", connect_time(connected_after, names.size(), 90u));
+        put_double(*root_summary, changes, "connect100", connect_time(connected_after, names.size(), 100u));
+        put_count(*root_summary, changes, "nRetype", nRetype);
+        put_ca_load(collector.ctxt, changes);
+        put_time(*root_summary, changes, now);
+        pv_summary->post(*root_summary, changes);
+    }
+
+    {
+        std::vector<size_t> rows;
+        snap.rank(rows, std::max(0, bsasStatusTopN));
+
+        pvd::BitSet changes;
+        fill(*root_top, changes, snap, rows, now);
+        pv_top->post(*root_top, changes);
+    }
+
+    if(changed || epicsTimeDiffInSeconds(&now, &last_full) >= bsasStatusPeriod) {
+        last_full = now;
+
+        std::vector<size_t> rows(names.size());
+        for(size_t i=0; i<rows.size(); i++)
+            rows[i] = i;
+
+        pvd::BitSet changes;
+        fill(*root_status, changes, snap, rows, now);
+        pv_status->post(*root_status, changes);
+    }
+
+    Guard G(mutex);
+    latest.names.swap(snap.names);
+    latest.connected.swap(snap.connected);
+    latest.delta.swap(snap.delta);
+    latest.rate.swap(snap.rate);
+    latest.byteRate.swap(snap.byteRate);
+    latest.limit.swap(snap.limit);
+    latest.memBytes.swap(snap.memBytes);
+    latest.tier.swap(snap.tier);
+    latest.connectTime.swap(snap.connectTime);
+    latest.context.swap(snap.context);
+}
+
+void StatusPublisher::put_ca_load(const CAContext& ctxt, pvd::BitSet& changed)
+{
+    const size_t N = ctxt.nshards();
+    const epicsUInt64 now = epicsMonotonicGet();
+    const double interval = ca_last ? (now - ca_last)*1e-9 : 0.0;
+
+    ca_callbacks.resize(N, 0u);
+    ca_us.resize(N, 0u);
+
+    pvd::shared_vector<double> rate(N, 0.0), load(N, 0.0);
+    for(size_t i=0; i<N; i++) {
+        const size_t ncb = epicsAtomicGetSizeT(&ctxt.shard(i).nCallbacks),
+                     us = epicsAtomicGetSizeT(&ctxt.shard(i).callbackUs);
+        if(interval > 0.0) {
+            rate[i] = (ncb - ca_callbacks[i])/interval;
+            load[i] = (us - ca_us[i])*1e-6/interval;
+        }
+        ca_callbacks[i] = ncb;
+        ca_us[i] = us;
+    }
+    ca_last = now;
+
+    pvd::PVDoubleArrayPtr fld(root_summary->getSubFieldT<pvd::PVDoubleArray>("caRate"));
+    fld->replace(pvd::freeze(rate));
+    changed.set(fld->getFieldOffset());
+
+    fld = root_summary->getSubFieldT<pvd::PVDoubleArray>("caLoad");
+    fld->replace(pvd::freeze(load));
+    changed.set(fld->getFieldOffset());
+}
+
+void StatusPublisher::RPCHandler::onRPC(const pvas::SharedPV::shared_pointer& pv, pvas::Operation& op)
+{
+    std::tr1::shared_ptr<StatusPublisher> self(publisher.lock());
+    if(!self) {
+        op.complete(pvd::Status::error("Table removed"));
+        return;
+    }
+
+    try {
+        const std::string pattern(rpc_arg(op.value(), "pv")),
+                          only(rpc_arg(op.value(), "only"));
+
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+
+        pvd::PVStructurePtr root(build_table());
+        pvd::BitSet changes;
+        {
+            Guard G(self->mutex);
+
+            std::vector<size_t> rows;
+            self->latest.select(rows, pattern, only);
+            fill(*root, changes, self->latest, rows, now);
+        }
+
+        changes.set(root->getSubFieldT<pvd::PVStringArray>("labels")->getFieldOffset());
+        op.complete(*root, changes);
+
+    } catch(std::exception& e) {
+        op.complete(pvd::Status::error(e.what()));
+    }
+}
+
+extern "C" {
+epicsExportAddress(double, bsasStatusPeriod);
+epicsExportAddress(int, bsasStatusTopN);
+}
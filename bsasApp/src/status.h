@@ -0,0 +1,102 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <string>
+#include <vector>
+
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <pv/pvData.h>
+#include <pva/sharedstate.h>
+
+#include "collector.h"
+
+extern "C" {
+// interval (seconds) between posts of the full <prefix>STS table
+extern double bsasStatusPeriod;
+// # of rows in <prefix>TOP
+extern int bsasStatusTopN;
+}
+
+/* Per-PV status of one table.
+ *
+ * <prefix>STS - NTTable with a row for each PV.  Posted every bsasStatusPeriod, or when the PV list changes.
+ *               RPC returns the same, but only rows matching the arguments:
+ *                 "pv" - glob pattern of PV names
+ *                 "only" - one of "disconnected", "overflow", "discon", "error", "shed"
+ *               Arguments may also be given as NTURI query.
+ * <prefix>SUM - Totals of all PVs, time until 50%, 90%, and all PVs first connected, and # of TBL retypes.
+ *               Also callback rate and load of each CA context, shared by all tables.  Posted with each update()
+ * <prefix>TOP - NTTable of the worst bsasStatusTopN PVs, ranked by overflows, then shed, then disconnects, then errors.
+ *               Posted with each update()
+ */
+struct StatusPublisher {
+    static size_t num_instances;
+
+    // counts over the last update() interval
+    struct Snapshot {
+        Collector::names_t names;
+        std::vector<char> connected;
+        std::vector<Subscription::Stats> delta;
+        // estimated update rate (Hz) and byte rate (B/s), and current queue limit
+        std::vector<double> rate, byteRate;
+        std::vector<size_t> limit;
+        // bytes held by values of each PV, and MemBudget tier
+        std::vector<size_t> memBytes;
+        std::vector<unsigned> tier;
+        // seconds from channel creation to first connection.  NaN if never connected
+        std::vector<double> connectTime;
+        // CAContext::index of the context of each PV's Channel
+        std::vector<unsigned> context;
+
+        // append indices of worst, at most n, with any of nOverflows, nShed, nDisconnects, or nErrors
+        void rank(std::vector<size_t>& rows, size_t n) const;
+        // append indices of rows matching glob 'pattern' (empty for all), and 'only' (empty for all)
+        void select(std::vector<size_t>& rows, const std::string& pattern, const std::string& only) const;
+    };
+
+    StatusPublisher(pvas::StaticProvider& provider, const std::string& prefix);
+    ~StatusPublisher();
+
+    pvas::StaticProvider& provider;
+    const std::string prefix;
+
+    pvas::SharedPV::shared_pointer pv_status,
+                                   pv_summary,
+                                   pv_top;
+
+    // on Coordinator handler, with Coordinator::mutex unlocked.
+    // Snapshot counters of all PVs of Collector, and post.
+    // nRetype is the count of <prefix>TBL structure changes
+    void update(Collector& collector, const Collector::names_t& names, bool changed, size_t nRetype = 0u);
+
+    // for <prefix>STS RPC
+    struct RPCHandler : public pvas::SharedPV::Handler {
+        const std::tr1::weak_ptr<StatusPublisher> publisher;
+        RPCHandler(const std::tr1::shared_ptr<StatusPublisher>& publisher) :publisher(publisher) {}
+        virtual ~RPCHandler() {}
+        virtual void onRPC(const pvas::SharedPV::shared_pointer& pv, pvas::Operation& op);
+    };
+
+private:
+    // only accessed from update()
+    epics::pvData::PVStructurePtr root_status, root_summary, root_top;
+    epicsTimeStamp last_full;
+    // CA context counters at previous update()
+    std::vector<size_t> ca_callbacks, ca_us;
+    epicsUInt64 ca_last;
+
+    mutable epicsMutex mutex;
+    // protected by mutex.  Replaced by update()
+    Snapshot latest;
+
+    void put_ca_load(const CAContext& ctxt, epics::pvData::BitSet& changed);
+
+    static void fill(epics::pvData::PVStructure& root, epics::pvData::BitSet& changed,
+                     const Snapshot& snap, const std::vector<size_t>& rows,
+                     const epicsTimeStamp& now);
+
+    EPICS_NOT_COPYABLE(StatusPublisher)
+};
+
+#endif // STATUS_H
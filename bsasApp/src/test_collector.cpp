@@ -1,12 +1,21 @@
 
+#include <string.h>
+#include <stdio.h>
+
+#include <sstream>
+
 #include <testMain.h>
 #include <epicsMath.h>
+#include <epicsStdio.h>
 #include <errlog.h>
 #include <pv/pvUnitTest.h>
 #include <pv/current_function.h>
 #include <pv/sharedVector.h>
 
 #include "collector.h"
+#include "spsc_ring.h"
+#include "merger.h"
+#include "autotune.h"
 
 namespace pvd = epics::pvData;
 
@@ -57,18 +66,16 @@ struct TestReceiver : public Receiver
     }
     void push(size_t column, double val) {
         testDiag("column %zu push %f @%x%x", column, val, now.secPastEpoch, now.nsec);
-        pvd::shared_vector<double> V;
-        V.push_back(val);
-        DBRValue value(new DBRValue::Holder);
+        DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 1u));
         value->ts = now;
         value->sevr = value->stat = 0; // NO_ALARM
-        value->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(V));
+        *static_cast<double*>(value->data()) = val;
         collector.subscription(column)->push(value);
     }
 
     void push_disconn(size_t column) {
         testDiag("column %zu push disconnect @%x%x", column, now.secPastEpoch, now.nsec);
-        DBRValue value(new DBRValue::Holder);
+        DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 0u));
         value->ts = now;
         collector.subscription(column)->push(value);
     }
@@ -81,16 +88,20 @@ struct TestReceiver : public Receiver
 
 struct TestFooBar {
     CAContext ctxt;
+    epics::auto_ptr<Executor> pool;
     epics::auto_ptr<Collector> collect;
     epics::auto_ptr<TestReceiver> R;
-    TestFooBar()
+    explicit TestFooBar(size_t nworkers = 1u, int npool = 0)
         :ctxt(epicsThreadPriorityMedium, true)
     {
+        if(npool)
+            pool.reset(new Executor(npool, epicsThreadPriorityMedium));
+
         pvd::shared_vector<std::string> names;
         names.push_back("foo");
         names.push_back("bar");
 
-        collect.reset(new Collector(ctxt, pvd::freeze(names), epicsThreadPriorityMedium));
+        collect.reset(new Collector(ctxt, pvd::freeze(names), epicsThreadPriorityMedium, nworkers, pool.get()));
         R.reset(new TestReceiver(*collect));
         testEqual(R->mynames.size(), 2u);
     }
@@ -116,13 +127,13 @@ struct TestFooBar {
             if(!value.valid() || value->sevr>3) {
                 testPass("Expect %s disconnected.", label );
             } else {
-                double actual = pvd::shared_vector_convert<const double>(value->buffer)[0]; // assumes size()>=1
+                double actual = pvd::shared_vector_convert<const double>(value->buffer())[0]; // assumes size()>=1
                 testFail("Unexpected %s value %f", label, actual);
             }
         } else if(!value.valid()) {
             testFail("%s not valid", label);
         } else {
-            double actual = pvd::shared_vector_convert<const double>(value->buffer)[0]; // assumes size()>=1
+            double actual = pvd::shared_vector_convert<const double>(value->buffer())[0]; // assumes size()>=1
             bool test = value->ts.secPastEpoch==ts.secPastEpoch && value->ts.nsec==ts.nsec && val==actual;
             testTrue(test)
                     <<" ts "<<std::hex<<ts.secPastEpoch<<std::hex<<ts.nsec<<"=="<<std::hex<<value->ts.secPastEpoch<<std::hex<<value->ts.nsec
@@ -216,16 +227,801 @@ struct TestFooBar {
         testSlice(2, T2, epicsNAN, 6.0);
         testEqual(R->myslices.size(), 3u);
     }
+
+    void push_batch() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        sync_initial();
+
+        testDiag("Second event, one notEmpty() for both columns");
+        epicsTimeStamp T1;
+        R->start(T1);
+        R->push(0, 3.0);
+        R->push(1, 4.0);
+        Subscription* subs[2] = {collect->subscription(0), collect->subscription(1)};
+        collect->notEmpty(subs, 2u);
+
+        testDiag("Wait for event");
+        for(size_t n=0; n<10u && nslices()<2u; n++)
+            R->wakeup.wait(1.0);
+        errlogFlush();
+
+        testSlice(1, T1, 3.0, 4.0);
+        testEqual(nslices(), 2u);
+    }
+
+    void push_spill() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        collect->setSpill("test_collector.spill.fb", 65536u);
+
+        sync_initial();
+
+        testDiag("Queue more events than can be staged");
+        std::vector<epicsTimeStamp> T(15u);
+        {
+            // hold off the pass woken by sync_initial(), which would otherwise dequeue while we push
+            Guard G(collect->mutex);
+            for(size_t n=0; n<T.size(); n++) {
+                R->start(T[n]);
+                R->push(0, 10.0+n);
+                R->push(1, 20.0+n);
+            }
+        }
+        R->notify(0);
+        R->notify(1);
+
+        testDiag("Wait for events");
+        for(size_t n=0; n<10u && nslices()<1u+T.size(); n++)
+            R->wakeup.wait(1.0);
+        errlogFlush();
+
+        testEqual(nslices(), 1u+T.size());
+        testSlice(1, T[0], 10.0, 20.0);
+        testSlice(T.size(), T.back(), 24.0, 34.0);
+
+        Guard G(collect->mutex);
+        testOk(collect->nSpilled>0u && collect->nSpilled==collect->nReplayed,
+               "spilled %zu replayed %zu", collect->nSpilled, collect->nReplayed);
+        testEqual(collect->nSpillDrop, 0u);
+    }
+
+    void push_rename() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        sync_initial();
+
+        Subscription *foo = collect->subscription(0);
+
+        testDiag("Replace bar with baz, and reorder");
+        pvd::shared_vector<std::string> names;
+        names.push_back("baz");
+        names.push_back("foo");
+        testOk1(collect->setNames(pvd::freeze(names)));
+
+        testOk1(collect->subscription(1)==foo);
+        {
+            Guard G(R->mutex);
+            testOk(R->mynames.size()==2u && R->mynames[0]=="baz" && R->mynames[1]=="foo",
+                   "receiver names updated");
+        }
+
+        testDiag("Start second event with new columns");
+        epicsTimeStamp T1;
+        R->start(T1);
+        R->push(0, 5.0);
+        R->notify(0);
+        R->push(1, 6.0);
+        R->notify(1);
+
+        testDiag("Wait for event");
+        for(size_t n=0; n<10u && nslices()<2u; n++)
+            R->wakeup.wait(1.0);
+        errlogFlush();
+
+        testSlice(1, T1, 5.0, 6.0);
+        testEqual(nslices(), 2u);
+    }
+
+    size_t nslices() {
+        Guard G(R->mutex);
+        return R->myslices.size();
+    }
+};
+
+// one column per worker
+struct TestFooBarSharded : public TestFooBar {
+    TestFooBarSharded() :TestFooBar(2u) {}
 };
 
+// processing and delivery as Tasks
+struct TestFooBarPool : public TestFooBar {
+    TestFooBarPool() :TestFooBar(1u, 2) {}
+};
+
+void testRing()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    SPSCRing<std::vector<int> > ring(3u);
+    std::vector<int> V;
+
+    for(int i=0; i<3; i++) {
+        V.resize(1u, i);
+        testOk(ring.push(V), "push %d", i);
+        testOk1(V.empty());
+    }
+    V.resize(1u, 3);
+    testOk(!ring.push(V), "push 3 when full");
+    testEqual(ring.size(), 3u);
+
+    testDiag("switch segment with elements queued");
+    ring.setLimit(9u);
+    for(int i=3; i<6; i++) {
+        V.resize(1u, i);
+        testOk(ring.push(V), "push %d", i);
+    }
+
+    std::vector<std::vector<int> > out;
+    testEqual(ring.pop(out, 4u), 4u);
+    testEqual(ring.pop(out, 10u), 2u);
+    testEqual(ring.pop(out, 10u), 0u);
+    testOk1(ring.empty());
+
+    bool inorder = out.size()==6u;
+    for(size_t i=0; inorder && i<out.size(); i++)
+        inorder = out[i].size()==1u && out[i][0]==int(i);
+    testOk(inorder, "pop in order");
+}
+
+void testPool()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    DBRValue::Pool *pool = new DBRValue::Pool;
+    const size_t hits = DBRValue::Pool::num_hits,
+                 misses = DBRValue::Pool::num_misses;
+
+    DBRValue A(DBRValue::alloc(pool, pvd::pvDouble, 1u));
+    *static_cast<double*>(A->data()) = 4.0;
+    const void *storage = A->data();
+
+    pvd::shared_vector<const void> buf(A->buffer());
+    A.reset();
+    testEqual(pvd::shared_vector_convert<const double>(buf)[0], 4.0);
+
+    testDiag("release last reference, returns to pool");
+    buf.clear();
+
+    DBRValue B(DBRValue::alloc(pool, pvd::pvInt, 2u)); // same size class
+    testOk1(B->data()==storage);
+    testEqual(DBRValue::Pool::num_hits - hits, 1u);
+    testEqual(DBRValue::Pool::num_misses - misses, 1u);
+
+    pool->close(); // B keeps pool alive
+    B.reset();
+}
+
+void testMerger()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    Merger M(3u);
+    DBRValue V;
+
+    // column 0 has keys 1, 2, 4.  column 1 has 2, 3.  column 2 has 4
+    V = DBRValue::alloc(0, pvd::pvDouble, 1u); M.push(0u, 1u, V);
+    V = DBRValue::alloc(0, pvd::pvDouble, 1u); M.push(1u, 2u, V);
+    V = DBRValue::alloc(0, pvd::pvDouble, 1u); M.push(0u, 2u, V);
+    V = DBRValue::alloc(0, pvd::pvDouble, 1u); M.push(2u, 4u, V);
+    V = DBRValue::alloc(0, pvd::pvDouble, 1u); M.push(1u, 3u, V);
+    V = DBRValue::alloc(0, pvd::pvDouble, 1u); M.push(0u, 4u, V);
+
+    V = DBRValue::alloc(0, pvd::pvDouble, 1u);
+    testOk(!M.push(1u, 3u, V), "reject duplicate key");
+    testOk1(V.valid());
+
+    testEqual(M.staged(0u), 3u);
+    testEqual(M.newest(), 4u);
+
+    const char expect[][4] = {"X__", "XX_", "_X_", "X_X"};
+    for(size_t r=0; r<4u; r++) {
+        Merger::slice_t slice(3u);
+        testOk1(!M.empty());
+        epicsUInt64 key = M.pop(&slice);
+        char actual[4] = "___";
+        for(size_t c=0; c<3u; c++)
+            if(slice[c].valid())
+                actual[c] = 'X';
+        testOk(key==r+1u && strcmp(actual, expect[r])==0, "slice %llu %s == %zu %s",
+               (unsigned long long)key, actual, r+1u, expect[r]);
+    }
+    testOk1(M.empty());
+}
+
+struct TestTask : public Executor::Task {
+    epicsEvent *block; // wait for before returning
+    std::vector<int>& order;
+    const int id;
+    TestTask(unsigned prio, std::vector<int>& order, int id) :Task(prio), block(0), order(order), id(id) {}
+    virtual void run() {
+        order.push_back(id);
+        if(block)
+            block->wait();
+    }
+};
+
+void testExecutor()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    std::vector<int> order;
+    epicsEvent release;
+
+    Executor pool(1, epicsThreadPriorityMedium);
+    testEqual(pool.workers(), 1u);
+
+    TestTask first(epicsThreadPriorityMedium, order, 1),
+             low(epicsThreadPriorityLow, order, 2),
+             high(epicsThreadPriorityHigh, order, 3),
+             never(epicsThreadPriorityHigh, order, 4);
+    first.block = &release;
+
+    // occupy the only worker while others are queued
+    pool.schedule(first);
+    while(order.empty())
+        epicsThreadSleep(0.01);
+
+    pool.schedule(low);
+    pool.schedule(high);
+    pool.schedule(high); // already queued
+    pool.schedule(never, 0.1);
+    pool.cancel(never);
+    release.signal();
+
+    // cancel() waits for any run in progress
+    pool.cancel(first);
+    epicsThreadSleep(0.2);
+    pool.cancel(low);
+    pool.cancel(high);
+
+    testOk(order.size()==3u && order[0]==1 && order[1]==3 && order[2]==2,
+           "order %d %d %d", order.size()>0u ? order[0] : -1, order.size()>1u ? order[1] : -1, order.size()>2u ? order[2] : -1);
+}
+
+void testSliceFill()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    // span more than one mask word
+    SliceFill F(70u);
+    testEqual(F.missing(), 0u);
+
+    F.expect(0u, true);
+    F.expect(65u, true);
+    F.expect(65u, true);
+    F.fill(0u, 1u);
+    testEqual(F.missing(), 1u);
+    F.fill(3u, 1u); // not expected
+    testEqual(F.missing(), 1u);
+    F.fill(65u, 1u);
+    testEqual(F.missing(), 0u);
+
+    // newer key starts empty
+    F.fill(65u, 2u);
+    testEqual(F.key(), 2u);
+    testEqual(F.missing(), 1u);
+    F.fill(0u, 1u); // old key ignored
+    testEqual(F.missing(), 1u);
+
+    // disconnect of missing column completes
+    F.expect(0u, false);
+    testEqual(F.missing(), 0u);
+    F.expect(0u, true);
+    testEqual(F.missing(), 1u);
+}
+
+void testStats()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    CAContext ctxt(epicsThreadPriorityMedium, true);
+    pvd::shared_vector<std::string> names;
+    names.push_back("foo");
+    Collector collect(ctxt, pvd::freeze(names), epicsThreadPriorityMedium);
+    Subscription *sub = collect.subscription(0);
+
+    const size_t limit = sub->values.limit();
+    for(size_t i=0; i<limit+3u; i++) {
+        DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 0u));
+        sub->push(value); // no notify, so never dequeued
+    }
+
+    Subscription::Stats A, B;
+    sub->snapshot(A);
+    testEqual(A.nOverflows, 3u);
+
+    sub->clear(1u);
+    sub->snapshot(B);
+    testEqual(B.nOverflows, limit+2u);
+    testEqual((B-A).nOverflows, limit-1u);
+    testEqual((B-A).nUpdates, 0u);
+}
+
+void testSharedChannel()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    CAContext ctxt(epicsThreadPriorityMedium, true),
+              other(epicsThreadPriorityMedium, true);
+
+    pvd::shared_vector<std::string> names;
+    names.push_back("foo");
+    names.push_back("bar");
+    Collector A(ctxt, pvd::freeze(names), epicsThreadPriorityMedium);
+
+    names.clear();
+    names.push_back("bar");
+    names.push_back("baz");
+    epics::auto_ptr<Collector> B(new Collector(ctxt, pvd::freeze(names), epicsThreadPriorityMedium));
+
+    names.clear();
+    names.push_back("bar");
+    Collector C(other, pvd::freeze(names), epicsThreadPriorityMedium);
+
+    std::tr1::shared_ptr<Channel> bar(A.subscription(1)->channel);
+    testOk1(bar==B->subscription(0)->channel);
+    testOk1(bar!=A.subscription(0)->channel);
+    testOk1(bar!=C.subscription(0)->channel); // different context
+
+    TestReceiver RA(A);
+    epics::auto_ptr<TestReceiver> RB(new TestReceiver(*B));
+
+    testDiag("one update of bar, fanned out to A and B.  foo and baz are disconnected");
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 1u));
+    value->ts = now;
+    value->sevr = value->stat = 0;
+    *static_cast<double*>(value->data()) = 42.0;
+    bar->push(value);
+
+    testOk1(RA.wakeup.wait(1.0));
+    testOk1(RB->wakeup.wait(1.0));
+    {
+        Guard GA(RA.mutex), GB(RB->mutex);
+        testOk(RA.myslices.size()==1u && RB->myslices.size()==1u
+               && RA.myslices[0].second[1].valid() && RB->myslices[0].second[0].valid()
+               && RA.myslices[0].second[1]->data()==RB->myslices[0].second[0]->data(),
+               "same update by reference");
+    }
+
+    testDiag("remove B, A keeps bar");
+    RB.reset();
+    B.reset();
+    testOk1(bar==A.subscription(1)->channel);
+}
+
+void testCAShards()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    RealTime::Config rt;
+    CAContext ctxt(epicsThreadPriorityMedium, true);
+    ctxt.addShard(epicsThreadPriorityMedium, rt);
+    ctxt.addShard(epicsThreadPriorityMedium, rt);
+    testOk1(ctxt.nshards()==3u);
+    testOk1(&ctxt.shard(0)==&ctxt && ctxt.shard(2).index==2u);
+
+    pvd::shared_vector<std::string> names;
+    for(unsigned i=0; i<30u; i++) {
+        char buf[32];
+        epicsSnprintf(buf, sizeof(buf), "IOC%u:PV%u", i%3u, i);
+        names.push_back(buf);
+    }
+    const pvd::shared_vector<const std::string> pvs(pvd::freeze(names));
+    Collector A(ctxt, pvs, epicsThreadPriorityMedium);
+
+    unsigned used[3] = {0u, 0u, 0u};
+    bool consistent = true;
+    for(size_t i=0; i<30u; i++) {
+        const Subscription* sub = A.subscription(i);
+        used[sub->channel->context.index]++;
+        consistent &= &sub->channel->context==&ctxt.shard(sub->pvname);
+    }
+    testOk(used[0] && used[1] && used[2], "hash uses all contexts %u %u %u", used[0], used[1], used[2]);
+    testOk1(consistent);
+
+    ctxt.assign = CAContext::Prefix;
+    bool same = true;
+    for(unsigned i=3; i<30u; i++)
+        same &= &ctxt.shard(pvs[i])==&ctxt.shard(pvs[i%3u]);
+    testOk(same, "prefix keeps each IOC in one context");
+}
+
+void testCAPolled()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    // passes only when woken
+    const double period = collectorCaPollPeriod;
+    collectorCaPollPeriod = 100.0;
+
+    // no server, so channels never connect
+    CAContext ctxt(epicsThreadPriorityMedium, false, 0, true);
+    testOk1(ctxt.ingest.get() && ctxt.context);
+    const size_t nchannels = Channel::num_instances;
+
+    {
+        std::tr1::shared_ptr<MemAccount> mem(new MemAccount);
+        std::tr1::shared_ptr<Channel> chan(Channel::lookup(ctxt, "TEST:POLL:never", mem));
+        chan.reset(); // before any pass
+        ctxt.sync();
+        testOk(epicsAtomicGetSizeT(&ctxt.nCreated)==0u, "pending Create removed by Clear");
+    }
+
+    pvd::shared_vector<std::string> names;
+    names.push_back("TEST:POLL:a");
+    names.push_back("TEST:POLL:b");
+    names.push_back("TEST:POLL:c");
+    const pvd::shared_vector<const std::string> pvs(pvd::freeze(names));
+    epics::auto_ptr<Collector> A(new Collector(ctxt, pvs, epicsThreadPriorityMedium));
+    epics::auto_ptr<Collector> B(new Collector(ctxt, pvs, epicsThreadPriorityMedium));
+    ctxt.flush();
+    ctxt.sync();
+    testEqual(epicsAtomicGetSizeT(&ctxt.nCreated), 3u);
+
+    const size_t nA = epicsAtomicGetSizeT(&A->nNotify),
+                 nB = epicsAtomicGetSizeT(&B->nNotify);
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    for(size_t i=0; i<2u; i++) {
+        DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 1u));
+        value->ts = now;
+        value->sevr = value->stat = 0;
+        *static_cast<double*>(value->data()) = double(i);
+        A->subscription(i)->channel->push(value); // shared with B
+    }
+    // the first pass fans out both, then completes this sync() before its handoff()
+    ctxt.sync();
+    // completes after that handoff()
+    ctxt.sync();
+    testEqual(epicsAtomicGetSizeT(&A->nNotify) - nA, 1u);
+    testEqual(epicsAtomicGetSizeT(&B->nNotify) - nB, 1u);
+
+    A.reset(); // channels still used by B
+    testEqual(epicsAtomicGetSizeT(&ctxt.nCleared), 0u);
+    B.reset(); // ~Channel waits for its Clear
+    testEqual(epicsAtomicGetSizeT(&ctxt.nCleared), 3u);
+    testEqual(Channel::num_instances, nchannels);
+
+    collectorCaPollPeriod = period;
+}
+
+void testRateEstimator()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    RateEstimator R(1.0, 0.5);
+
+    // 10 Hz of 100 bytes
+    bool updated = false;
+    for(unsigned i=0; i<=10u; i++)
+        updated = R.add(i*0.1, 100u);
+    testOk1(updated);
+    testOk(fabs(R.rate-10.0)<0.01, "rate %f", R.rate);
+    testOk(fabs(R.brate-1000.0)<1.0, "brate %f", R.brate);
+
+    // drop to 2 Hz.  EWMA moves half way each window
+    testOk1(!R.add(1.5, 100u));
+    testOk1(R.add(2.0, 100u));
+    testOk(fabs(R.rate-(10.0+2.0)/2.0)<0.01, "rate %f", R.rate);
+
+    // silent.  Not before a window has passed, then as if an update arrived now
+    testOk1(!R.decay(2.5));
+    testOk1(R.decay(6.0));
+    testOk(fabs(R.rate-0.25)<0.01, "rate %f", R.rate);
+    testOk(fabs(R.brate-600.0*0.25/6.0)<0.1, "brate %f", R.brate);
+    // keeps falling while silent
+    testOk(R.decay(8.0) && fabs(R.rate-1.0/6.0)<0.01, "rate %f", R.rate);
+}
+
+void testAutoTuner()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    AutoTuner::Config conf;
+    conf.enable = true;
+    conf.maxEventRate = AutoTuner::Bounds(10.0, 40.0);
+    conf.maxEventAge = AutoTuner::Bounds(1.0, 4.0);
+    conf.flushPeriod = AutoTuner::Bounds(1.0, 4.0);
+    conf.holdoff = 3u;
+    AutoTuner T(conf);
+
+    Collector::Limits L;
+    L.maxEventRate = 20.0;
+    L.maxEventAge = 2.0;
+    L.flushPeriod = 2.0;
+
+    std::string reason;
+    AutoTuner::Sample S;
+    S.deliverTime = 0.5; // neither slow nor fast
+
+    testOk1(!T.step(S, L, reason));
+
+    S.nOverflow = 1u;
+    testOk1(T.step(S, L, reason));
+    testEqual(L.maxEventRate, 30.0);
+    testDiag("%s", reason.c_str());
+
+    S.nOverflow = 3u;
+    testOk1(T.step(S, L, reason));
+    testEqual(L.maxEventRate, 40.0); // upper bound
+
+    S.nLate = 2u;
+    S.deliverTime = 1.5;
+    testOk1(T.step(S, L, reason));
+    testEqual(L.maxEventRate, 40.0);
+    testEqual(L.maxEventAge, 2.5);
+    testEqual(L.flushPeriod, 2.5);
+
+    // no overflow for holdoff lowers buffer size
+    S.deliverTime = 0.5;
+    testOk1(!T.step(S, L, reason));
+    testOk1(T.step(S, L, reason));
+    testEqual(L.maxEventRate, 36.0);
+
+    // totals reset by new Collector
+    AutoTuner::Sample Z;
+    Z.nOverflow = 1u;
+    T.step(Z, L, reason);
+    testEqual(L.maxEventRate, 40.0);
+}
+
+// values with keys 1..N
+void makeValues(std::vector<DBRValue>& values, size_t N)
+{
+    values.clear();
+    for(size_t i=1; i<=N; i++) {
+        DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 0u));
+        value->ts.secPastEpoch = 0u;
+        value->ts.nsec = i;
+        values.push_back(value);
+    }
+}
+
+std::string keysOf(const std::vector<DBRValue>& values)
+{
+    std::ostringstream strm;
+    for(size_t i=0; i<values.size(); i++)
+        strm<<(i ? " " : "")<<values[i]->ts.nsec;
+    return strm.str();
+}
+
+void testEvictPolicy()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    std::vector<DBRValue> values;
+    std::vector<epicsUInt64> staged;
+    staged.push_back(2u);
+    staged.push_back(5u);
+
+    EvictPolicy P;
+    P.keep = 3u;
+    P.nth = 3u;
+
+    makeValues(values, 8u);
+    P.select(values, staged);
+    testEqual(keysOf(values), "6 7 8");
+
+    P.kind = EvictPolicy::DropNewest;
+    makeValues(values, 8u);
+    P.select(values, staged);
+    testEqual(keysOf(values), "1 2 3");
+
+    P.kind = EvictPolicy::KeepNth;
+    makeValues(values, 8u);
+    P.select(values, staged);
+    testEqual(keysOf(values), "2 5 8");
+
+    // at most 'keep' of every nth, the newest
+    P.keep = 2u;
+    makeValues(values, 8u);
+    P.select(values, staged);
+    testEqual(keysOf(values), "5 8");
+    P.keep = 3u;
+
+    P.kind = EvictPolicy::KeepLikely;
+    makeValues(values, 8u);
+    P.select(values, staged);
+    testEqual(keysOf(values), "2 5 8");
+
+    makeValues(values, 2u);
+    P.select(values, staged);
+    testEqual(keysOf(values), "1 2");
+
+    testEqual(EvictPolicy::parse("likely"), EvictPolicy::KeepLikely);
+    testEqual(EvictPolicy::parse("bogus"), EvictPolicy::nKinds);
+}
+
+void testSpillLog()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    SpillLog log;
+    log.open("test_collector.spill", 4096u);
+    testOk1(log.isOpen() && log.empty());
+
+    std::vector<DBRValue> values;
+    for(size_t i=1; i<=200u; i++) {
+        DBRValue value(DBRValue::alloc(0, pvd::pvDouble, 1u));
+        value->ts.secPastEpoch = 0u;
+        value->ts.nsec = i;
+        value->sevr = value->stat = 0;
+        *static_cast<double*>(value->data()) = i;
+        values.push_back(value);
+    }
+
+    // fill until full.  Each record is 48 bytes
+    size_t npush = 0u;
+    while(npush<values.size() && log.push(npush%3u, values[npush]))
+        npush++;
+    testEqual(npush, 4096u/48u);
+    testOk1(log.size() <= log.capacity());
+
+    // FIFO through the wrap at the end
+    bool ok = true;
+    size_t npop = 0u, next = npush;
+    for(size_t round=0; round<3u; round++) {
+        for(size_t i=0; i<20u; i++, npop++) {
+            ok &= log.frontColumn()==npop%3u && log.frontKey()==npop+1u;
+            DBRValue val(log.pop());
+            ok &= val->ts.nsec==npop+1u && *static_cast<const double*>(val->data())==double(npop+1u);
+        }
+        for(size_t i=0; i<20u; i++, next++)
+            ok &= log.push(next%3u, values[next]);
+    }
+    testOk(ok, "FIFO order");
+    testEqual(log.count(), npush);
+
+    while(!log.empty()) {
+        ok &= log.frontKey()==npop+1u;
+        log.pop();
+        npop++;
+    }
+    testOk(ok && npop==next, "drained %zu", npop);
+    testEqual(log.size(), 0u);
+
+    testDiag("Collector passes spill runs with interleaved keys.  Replayed merged by key");
+    log.mark();
+    for(size_t k=10u; k<=40u; k+=10u)
+        log.push(0u, values[k-1u]);
+    log.pop();
+    log.mark();
+    for(size_t k=15u; k<=35u; k+=10u)
+        log.push(1u, values[k-1u]);
+    testEqual(log.frontKey(), 15u);
+
+    DBRValue::Pool *pool = new DBRValue::Pool;
+    ok = true;
+    for(size_t k=15u; k<=40u; k+=5u) {
+        ok &= log.frontKey()==k && log.frontColumn()==(k%10u ? 1u : 0u);
+        DBRValue val(log.pop(pool));
+        ok &= val->ts.nsec==k && pool->inuse>0u;
+    }
+    testOk(ok && log.empty(), "merged order");
+    testEqual(log.size(), 0u);
+    testEqual(pool->inuse, 0u);
+    pool->close();
+
+    log.close();
+    FILE *F = fopen("test_collector.spill", "r");
+    testOk(!log.isOpen() && !F, "file removed");
+    if(F)
+        fclose(F);
+}
+
+void testMemBudget()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    std::tr1::shared_ptr<MemAccount> account(new MemAccount);
+    DBRValue::Pool *pool = new DBRValue::Pool;
+    pool->setAccount(account);
+    const size_t before = MemAccount::process;
+    {
+        DBRValue small(DBRValue::alloc(pool, pvd::pvDouble, 10u)),
+                 large(DBRValue::alloc(pool, pvd::pvDouble, 1u<<18)); // too large to cache
+        testOk(pool->inuse >= 2u*1048576u + 80u && pool->inuse==account->bytes, "inuse %zu", pool->inuse);
+        testEqual(MemAccount::process - before, account->bytes);
+    }
+    testEqual(pool->inuse, 0u);
+    testEqual(account->bytes, 0u);
+
+    // re-pointed, eg. when the owning table is removed.  Held values credit the old account
+    std::tr1::shared_ptr<MemAccount> other(new MemAccount);
+    {
+        DBRValue held(DBRValue::alloc(pool, pvd::pvDouble, 10u));
+        pool->setAccount(other);
+        DBRValue next(DBRValue::alloc(pool, pvd::pvDouble, 10u));
+        testOk(account->bytes==other->bytes && other->bytes>0u, "%zu == %zu", account->bytes, other->bytes);
+    }
+    testOk(account->bytes==0u && other->bytes==0u, "%zu, %zu", account->bytes, other->bytes);
+    pool->close();
+
+    // tier 0 never, tier 3 first, large before small
+    testOk1(!MemBudget::sheds(MemBudget::maxLevel, 0u, true));
+    testOk1(MemBudget::sheds(1u, 3u, true) && !MemBudget::sheds(1u, 3u, false));
+    testOk1(MemBudget::sheds(2u, 3u, false) && !MemBudget::sheds(2u, 2u, true));
+    testOk1(MemBudget::sheds(MemBudget::maxLevel, 1u, false));
+
+    unsigned quiet = 0u, L = 0u;
+    L = MemBudget::next(L, 110u, 100u, quiet, 2u);
+    testEqual(L, 1u);
+    L = MemBudget::next(L, 200u, 100u, quiet, 2u);
+    testEqual(L, unsigned(MemBudget::maxLevel));
+    L = MemBudget::next(L, 90u, 100u, quiet, 2u);
+    testEqual(L, unsigned(MemBudget::maxLevel)); // between watermarks
+    L = MemBudget::next(L, 10u, 100u, quiet, 2u);
+    L = MemBudget::next(L, 10u, 100u, quiet, 2u);
+    testEqual(L, unsigned(MemBudget::maxLevel)-1u); // after holdoff
+    testEqual(MemBudget::next(L, 1000u, 0u, quiet, 2u), 0u); // no budget
+}
+
+void testLatencyHistogram()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    LatencyHistogram H;
+    H.add(500u);     // < 1us
+    H.add(1500u);    // [1, 2) us
+    H.add(3000000u); // [2048, 4096) us
+
+    testEqual(H.count, 3u);
+    testEqual(H.max, 3000000u);
+    testEqual(H.bins[0], 1u);
+    testEqual(H.bins[1], 1u);
+    testEqual(H.bins[12], 1u);
+
+    H.reset();
+    testEqual(H.count, 0u);
+    testEqual(H.bins[12], 0u);
+}
+
 }
 
 MAIN(test_collector)
 {
     collectorDebug = 5;
     bsasFlushPeriod = 0.0;
-    testPlan(22);
+    testPlan(262);
+    testRing();
+    testPool();
+    testMerger();
+    testSliceFill();
+    testExecutor();
+    testLatencyHistogram();
+    testRateEstimator();
+    testAutoTuner();
+    testEvictPolicy();
+    testSpillLog();
+    testMemBudget();
+    testStats();
+    testSharedChannel();
+    testCAShards();
+    testCAPolled();
     TEST_METHOD(TestFooBar, push_start);
     TEST_METHOD(TestFooBar, push_disconn);
+    TEST_METHOD(TestFooBarSharded, push_start);
+    TEST_METHOD(TestFooBarSharded, push_disconn);
+    TEST_METHOD(TestFooBarPool, push_start);
+    TEST_METHOD(TestFooBarPool, push_disconn);
+    TEST_METHOD(TestFooBar, push_batch);
+    TEST_METHOD(TestFooBarSharded, push_batch);
+    TEST_METHOD(TestFooBar, push_spill);
+    TEST_METHOD(TestFooBarSharded, push_spill);
+    TEST_METHOD(TestFooBar, push_rename);
+    TEST_METHOD(TestFooBarSharded, push_rename);
     return testDone();
 }
@@ -1,3 +1,4 @@
+#include <stdio.h>
 
 #include <testMain.h>
 #include <epicsMath.h>
@@ -38,14 +39,25 @@ struct TestPVA {
         Receiver::slices_t::value_type& slice = slices[r];
         slice.second.resize(2);
 
-        DBRValue V(new DBRValue::Holder);
+        DBRValue V(DBRValue::alloc(0, pvd::pvDouble, 1u));
         V->sevr = V->stat = 0;
         V->ts = ts;
-        V->count = 1;
+        *static_cast<double*>(V->data()) = v;
 
-        pvd::shared_vector<double> temp(1);
-        temp[0] = v;
-        V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+        slice.second.at(c) = V;
+    }
+
+    void push_int(const epicsTimeStamp& ts, size_t r, size_t c, pvd::int32 v)
+    {
+        slices.resize(std::max(slices.size(), r+1));
+
+        Receiver::slices_t::value_type& slice = slices[r];
+        slice.second.resize(2);
+
+        DBRValue V(DBRValue::alloc(0, pvd::pvInt, 1u));
+        V->sevr = V->stat = 0;
+        V->ts = ts;
+        *static_cast<pvd::int32*>(V->data()) = v;
 
         slice.second.at(c) = V;
     }
@@ -62,8 +74,11 @@ struct TestPVA {
         push_scalar(T1, 1, 0, 3.0);
         push_scalar(T1, 1, 1, 4.0);
 
+        const size_t before = epicsAtomicGetSizeT(&collect->mem->bytes);
         R->slices(slices);
         testShow()<<R->changed<<"\n"<<R->root;
+        // secondsPastEpoch, nanoseconds, foo, bar of 2 rows
+        testEqual(epicsAtomicGetSizeT(&collect->mem->bytes) - before, 2u*(4u+4u+8u+8u));
 
         pvd::PVDoubleArrayPtr farr;
 
@@ -80,13 +95,121 @@ struct TestPVA {
             testFieldEqual<pvd::PVDoubleArray>(R->root, "value.bar", pvd::freeze(arr));
         }
     }
+
+    void test_widen()
+    {
+        epicsTimeStamp T0;
+        epicsTimeGetCurrent(&T0);
+        push_int(T0, 0, 0, 1);
+        push_scalar(T0, 0, 1, 2.0);
+
+        epicsTimeStamp T1 = T0;
+        T1.nsec++;
+        push_scalar(T1, 1, 0, 3.5);
+        push_int(T1, 1, 1, 4);
+
+        testDiag("foo int then double in one batch");
+        R->slices(slices);
+        testShow()<<R->root;
+
+        // both columns end as the default double
+        testEqual(R->nRetype, 0u);
+        {
+            pvd::shared_vector<double> arr(2);
+            arr[0] = 1.0;
+            arr[1] = 3.5;
+            testFieldEqual<pvd::PVDoubleArray>(R->root, "value.foo", pvd::freeze(arr));
+        }
+        {
+            pvd::shared_vector<double> arr(2);
+            arr[0] = 2.0;
+            arr[1] = 4.0;
+            testFieldEqual<pvd::PVDoubleArray>(R->root, "value.bar", pvd::freeze(arr));
+        }
+
+        testDiag("int again.  stays double");
+        slices.clear();
+        push_int(T1, 0, 0, 5);
+        push_int(T1, 0, 1, 6);
+        R->slices(slices);
+
+        testEqual(R->nRetype, 0u);
+        {
+            pvd::shared_vector<double> arr(1);
+            arr[0] = 5.0;
+            testFieldEqual<pvd::PVDoubleArray>(R->root, "value.foo", pvd::freeze(arr));
+        }
+
+        testDiag("foo array.  retype once");
+        slices.clear();
+        push_int(T1, 0, 1, 7);
+        {
+            DBRValue V(DBRValue::alloc(0, pvd::pvDouble, 2u));
+            V->sevr = V->stat = 0;
+            V->ts = T1;
+            static_cast<double*>(V->data())[0] = 8.0;
+            static_cast<double*>(V->data())[1] = 9.0;
+            slices[0].second.at(0) = V;
+        }
+        R->slices(slices);
+
+        testEqual(R->nRetype, 1u);
+    }
 };
 
+void testSchemaCache()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    const std::string fname("test_receiver.schema");
+    remove(fname.c_str());
+
+    CAContext ctxt(epicsThreadPriorityMedium, true);
+    pvd::shared_vector<std::string> names;
+    names.push_back("foo");
+    names.push_back("bar");
+    Collector collect(ctxt, pvd::freeze(names), epicsThreadPriorityMedium);
+
+    {
+        PVAReceiver R(collect, fname);
+        testOk1(!R.columns[1].cached);
+
+        testDiag("learn that bar is an int");
+        {
+            Guard G(R.mutex);
+            R.columns[1].ftype = pvd::pvInt;
+            R.state = PVAReceiver::NeedRetype;
+        }
+        R.update_type();
+        R.save_schema();
+    }
+
+    {
+        PVAReceiver R(collect, fname);
+        testOk(R.columns[1].ftype==pvd::pvInt && R.columns[1].cached, "bar type %d from cache", R.columns[1].ftype);
+        testOk1(!!R.root->getSubField<pvd::PVIntArray>("value.bar"));
+
+        testDiag("bar connects as double");
+        Subscription *bar = collect.subscription(1);
+        bar->nativeType = pvd::pvDouble;
+        bar->connected = 1;
+
+        testOk1(R.type_connected());
+        R.update_type();
+        testOk(R.columns[1].ftype==pvd::pvDouble && !R.columns[1].cached, "bar type %d", R.columns[1].ftype);
+        testOk1(!R.type_connected());
+    }
+
+    remove(fname.c_str());
+}
+
 } // namespace
 
 MAIN(test_receiver)
 {
-    testPlan(3);
+    testPlan(17);
     TEST_METHOD(TestPVA, test_simple);
+    TEST_METHOD(TestPVA, test_widen);
+    testSchemaCache();
     return testDone();
 }
@@ -0,0 +1,63 @@
+#include <testMain.h>
+#include <pv/pvUnitTest.h>
+#include <pv/current_function.h>
+#include <pv/sharedVector.h>
+
+#include "status.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+void testStatusSnapshot()
+{
+    testDiag("==== %s", CURRENT_FUNCTION);
+
+    StatusPublisher::Snapshot snap;
+    {
+        pvd::shared_vector<std::string> names;
+        names.push_back("A:one");
+        names.push_back("A:two");
+        names.push_back("B:one");
+        names.push_back("B:two");
+        snap.names = pvd::freeze(names);
+    }
+    snap.connected.resize(4u, 1);
+    snap.delta.resize(4u);
+
+    snap.connected[3] = 0;
+    snap.delta[1].nErrors = 5u;
+    snap.delta[2].nOverflows = 1u;
+    snap.delta[3].nDisconnects = 1u;
+    snap.delta[3].nOverflows = 1u;
+
+    std::vector<size_t> rows;
+    snap.rank(rows, 2u);
+    testOk(rows.size()==2u && rows[0]==3u && rows[1]==2u, "rank %zu %zu",
+           rows.size()>0u ? rows[0] : size_t(-1), rows.size()>1u ? rows[1] : size_t(-1));
+
+    rows.clear();
+    snap.rank(rows, 10u); // only those with problems
+    testEqual(rows.size(), 3u);
+
+    rows.clear();
+    snap.select(rows, "A:*", "");
+    testOk(rows.size()==2u && rows[0]==0u && rows[1]==1u, "select A:*");
+
+    rows.clear();
+    snap.select(rows, "", "disconnected");
+    testOk(rows.size()==1u && rows[0]==3u, "select disconnected");
+
+    rows.clear();
+    snap.select(rows, "B:*", "overflow");
+    testEqual(rows.size(), 2u);
+}
+
+} // namespace
+
+MAIN(test_status)
+{
+    testPlan(5);
+    testStatusSnapshot();
+    return testDone();
+}
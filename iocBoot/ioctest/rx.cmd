@@ -11,8 +11,69 @@ var(receiverPVADebug, 1)
 var(maxEventRate, 40.0)
 var(collectorCaScalarMaxRate, 20.0)
 var(collectorCaArrayMaxRate, 1.5)
+# queue limits start from the above, then follow the measured rate of each PV
+#var(collectorCaAdaptive, 1)
+#var(collectorCaHeadroom, 2.0)
+# channels of a table are created in batches of this many, each flushed so that searches begin early
+#var(collectorCaConnectBatch, 256)
 var(bsasFlushPeriod, 2.0)
+# post full RX:STS every 10 seconds.  RX:SUM and RX:TOP are posted every second
+#var(bsasStatusPeriod, 10.0)
+#var(bsasStatusTopN, 20)
+# run all tables on a shared pool of threads.  -1 for one per CPU
+#var(bsasWorkerPool, -1)
+# total MB of queued and buffered data of all tables, before shedding updates of low priority PVs
+#var(bsasMemBudget, 512)
+# updates of at least this many bytes are shed before others of the same tier
+#var(bsasMemLargeBytes, 65536)
 
+# real-time operation (Linux).  Lock memory and prefault buffers
+#var(bsasRTMemLock, 1)
+# bsasRTThread("role", "cpus", SCHED_FIFO prio)  role is one of: ca, processor, coordinator (ignored with bsasWorkerPool)
+#bsasRTThread("ca", "2", 50)
+#bsasRTThread("processor", "3-4", 60)
+# bsasCAContext(prio, "cpus", SCHED_FIFO prio)  once for each CA client context.  Default is one, w/ bsasRTThread("ca", ...)
+# prio is the EPICS priority of its threads, 0 for the default
+#bsasCAContext(0, "2", 50)
+#bsasCAContext(0, "5", 50)
+# bsasCAAssign("how")  how channels are divided between contexts.
+# "hash" of the whole PV name (default), or "prefix" before the first ':' to keep each IOC in one context
+#bsasCAAssign("prefix")
+# Non-preemptive CA contexts, each drained by one ingest thread every collectorCaPollPeriod seconds,
+# which notifies each table once per pass.  Fewer wakeups at high update rates, for up to one period of latency.
+#var(bsasCAPolled, 1)
+#var(collectorCaPollPeriod, 0.01)
+
+# bsasTableAdd("prefix", nworkers, prio)
+# nworkers>1 divides the columns of the table between that many threads
+# prio is the thread priority, or the order of Tasks in the shared pool
 bsasTableAdd("RX:")
+# bsasTableControl("pvname")
+# RPC to this PV adds or removes tables while running.  Its value lists the current tables.
+#   eget -s BSAS:CTL -a op=add -a prefix=RX2: [-a nworkers=2] [-a prio=60]
+#   eget -s BSAS:CTL -a op=remove -a prefix=RX2:
+# After iocInit(), bsasTableAdd() and bsasTableRemove("prefix") do the same from the shell.
+#bsasTableControl("BSAS:CTL")
+# bsasTableTune("prefix", "param", min, max)
+# automatically adjust maxEventRate, maxEventAge, or bsasFlushPeriod of a table within [min, max].
+# Decisions are published on RX:TUNE
+#bsasTableTune("RX:", "maxEventAge", 1.0, 5.0)
+# bsasTableEvict("prefix", "policy", n)
+# on overflow, which queued updates of each PV to keep.  policy is one of:
+#   oldest (default) - drop oldest, keep newest n.  newest - keep oldest n.
+#   nth - keep every n-th, at most 4.  likely - keep n, preferring those other PVs also have
+#bsasTableEvict("RX:", "likely", 4)
+# bsasTableSpill("prefix", "dir", MB)
+# on overflow, instead of evicting, spill queued updates to memory mapped files in dir, using at most MB.
+# Replayed once the backlog clears.  Progress and replay lag are shown on RX:SUM
+#bsasTableSpill("RX:", "/tmp", 256)
+# bsasTableTier("prefix", "pattern", tier)
+# memory budget priority of PVs matching glob pattern.  First match wins.
+# 0 is never shed, 1 (default) is shed last, 3 first.
+#bsasTableTier("RX:", "TX:img*", 3)
+# bsasTableSchema("prefix", "dir")
+# remember learned TBL column types in dir/<prefix>schema.  Reused on restart with the same PV list,
+# so clients see the final structure immediately.  Discarded as PVs connect with a different native type.
+#bsasTableSchema("RX:", "/tmp")
 
 iocInit()